@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sched.h>
 #include <errno.h>
 #include <getopt.h>
@@ -32,6 +33,10 @@
 #include <pthread.h>
 #include <syslog.h>
 #include <sys/signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
 #include "alsaloop.h"
 
 struct loopback_thread {
@@ -41,8 +46,26 @@ struct loopback_thread {
 	struct loopback **loopbacks;
 	int loopbacks_count;
 	snd_output_t *output;
+	int timerfd;			/* periodic wake (-W) */
+	/* worker pool */
+	int index;
+	int wakefd;			/* migration requests */
+	struct loopback **inbox;	/* loops moved to this worker */
+	int inbox_count;
+	struct loopback *move_group;	/* group leaving this worker */
+	struct loopback_thread *move_to;
+	unsigned long long busy;	/* processing time in us */
+	long pass_max;			/* longest processing pass in us */
+	unsigned long long busy_last;	/* seen by the balancer */
+	double load;			/* part of the real time */
+	double margin;			/* free part of the shortest period */
 };
 
+#define POOL_INTERVAL	1	/* balancer period in seconds */
+#define POOL_MARGIN	0.5	/* minimal free part of the shortest period */
+#define POOL_WAKE	(~0ULL)	/* epoll data of the wakefd */
+#define THREAD_TIMER	(~1ULL)	/* epoll data of the timerfd */
+
 int quit = 0;
 int verbose = 0;
 int workarounds = 0;
@@ -57,6 +80,9 @@ int threads_count = 0;
 pthread_t main_job;
 int arg_default_xrun = 0;
 int arg_default_wake = 0;
+char *arg_stats = NULL;
+int arg_workers = -1;		/* -1 = manual thread grouping */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void my_exit(struct loopback_thread *thread, int exitcode)
 {
@@ -124,6 +150,7 @@ static int create_loopback(struct loopback **_handle,
 	handle->latency_reqtime = 10000;
 	handle->loop_time = ~0UL;
 	handle->loop_limit = ~0ULL;
+	handle->sync_bw = 0.05;
 	handle->output = output;
 	handle->state = output;
 #ifdef USE_SAMPLERATE
@@ -166,16 +193,26 @@ void help(void)
 "-h,--help      help\n"
 "-g,--config    configuration file (one line = one job specified)\n"
 "-d,--daemonize daemonize the main process and use syslog for errors\n"
-"-P,--pdevice   playback device\n"
-"-C,--cdevice   capture device\n"
+"-P,--pdevice   playback device (udp:HOST:PORT sends to the network,\n"
+"		    shm:NAME to a shared memory ring)\n"
+"-o,--output    additional playback device sharing the capture (fan-out)\n"
+"-C,--cdevice   capture device (udp:[HOST]:PORT receives from the network,\n"
+"		    shm:NAME from a shared memory ring)\n"
+"-i,--input     additional capture device mixed to the playback, argument is:\n"
+"		    CDEVICE[@GAIN_DB]\n"
 "-X,--pctl      playback ctl device\n"
 "-Y,--cctl      capture ctl device\n"
 "-l,--latency   requested latency in frames\n"
 "-t,--tlatency  requested latency in usec (1/1000000sec)\n"
+"-L,--adaptive  adaptive latency range in usec, argument is: MIN:MAX\n"
 "-f,--format    sample format\n"
 "-c,--channels  channels\n"
+"-R,--route     capture to playback channel routing, argument is:\n"
+"		    PCH=CCH[*GAIN][+CCH[*GAIN]...][,PCH=...]\n"
+"		    (for example: \"1=9,2=10\" or \"1=1*0.7+3*0.5,2=2*0.7+3*0.5\")\n"
 "-r,--rate      rate\n"
 "-n,--resample  resample in alsa-lib\n"
+"-M,--mmap      use mmap access (zero-copy transfers when possible)\n"
 "-A,--samplerate use converter (0=sincbest,1=sincmedium,2=sincfastest,\n"
 "                               3=zerohold,4=linear)\n"
 "-B,--buffer    buffer size in frames\n"
@@ -184,17 +221,31 @@ void help(void)
 "-b,--nblock    non-block mode (very early process wakeup)\n"
 "-S,--sync      sync mode(0=none,1=simple,2=captshift,3=playshift,4=samplerate,\n"
 "                         5=auto)\n"
+"-K,--syncbw    drift controller bandwidth in Hz (default 0.05)\n"
 "-a,--slave     stream parameters slave mode (0=auto, 1=on, 2=off)\n"
 "-T,--thread    thread number (-1 = create unique)\n"
+"-j,--workers   distribute the loops to a pool of worker threads\n"
+"                (0 = one per CPU), overrides -T\n"
 "-m,--mixer	redirect mixer, argument is:\n"
 "		    SRC_SLAVE_ID(PLAYBACK)[@DST_SLAVE_ID(CAPTURE)]\n"
 "-O,--ossmixer	rescan and redirect oss mixer, argument is:\n"
 "		    ALSA_ID@OSS_ID  (for example: \"Master@VOLUME\")\n"
-"-e,--effect    apply an effect (bandpass filter sweep)\n"
+"-V,--volume    software volume with a user control, argument is:\n"
+"		    NAME[@MIN_DB:MAX_DB]  (default range -60:0)\n"
+"-D,--float     process in float, convert once to the playback format\n"
+"		    with the dither: none, tpdf or shaped (default)\n"
+"-e,--effect    apply an effect, argument is NAME[:PARAMS] (repeat for a chain):\n"
+"		    sweep[:CENTER:DEPTH:LFO:BW]  bandpass filter sweep (default)\n"
+"		    gain[:DB]  eq[:FREQ:DB:Q]  limit[:DB:RELEASE_MS]\n"
 "-v,--verbose   verbose mode (more -v means more verbose)\n"
-"-w,--workaround use workaround (serialopen)\n"
+"-w,--workaround use workaround (serialopen, nosnapshot)\n"
+"-I,--idle      stop the playback after silence, argument is: HOLD_MS[:DB]\n"
+"		    (DB is the peak level of silence, default digital silence)\n"
 "-U,--xrun      xrun profiling\n"
 "-W,--wake      process wake timeout in ms\n"
+"-Z,--stats     publish the loop statistics in the shared memory segment NAME\n"
+"-x,--ptap      record the playback stream, argument is: FILE[@SECONDS]\n"
+"-y,--ctap      record the capture stream, argument is: FILE[@SECONDS]\n"
 );
 	printf("\nRecognized sample formats are:");
 	for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -334,6 +385,148 @@ static int add_oss_mixers(struct loopback *loop,
 	return 0;
 }
 
+/*
+ * Create a loop for an additional playback device. It reads from
+ * the capture buffer of the source loop and keeps its own latency,
+ * drift compensation and xrun recovery.
+ */
+static int add_fanout(struct loopback *src, const char *device,
+		      const char *route,
+		      const char **effects, int effects_count)
+{
+	struct loopback_handle *play, *capt, **last;
+	struct loopback *loop;
+	int i, err;
+
+	err = create_loopback_handle(&play, device, NULL, "playback");
+	if (err < 0)
+		return err;
+	err = create_loopback_handle(&capt, src->capt->device, NULL, "capture");
+	if (err < 0)
+		return err;
+	err = create_loopback(&loop, play, capt, src->output);
+	if (err < 0)
+		return err;
+	capt->source = src->capt;
+	for (last = &src->capt->fanout; *last; last = &(*last)->fanout)
+		;
+	*last = capt;
+	play->access = capt->access = src->play->access;
+	play->format = capt->format = src->play->format;
+	play->rate = play->rate_req = src->play->rate_req;
+	capt->rate = capt->rate_req = src->capt->rate_req;
+	play->channels = capt->channels = src->play->channels;
+	play->buffer_size_req = src->play->buffer_size_req;
+	play->period_size_req = src->play->period_size_req;
+	play->resample = src->play->resample;
+	play->nblock = src->play->nblock;
+	loop->latency_req = src->latency_req;
+	loop->latency_reqtime = src->latency_reqtime;
+	loop->latency_mintime = src->latency_mintime;
+	loop->latency_maxtime = src->latency_maxtime;
+	loop->sync = src->sync;
+	loop->sync_bw = src->sync_bw;
+	loop->slave = SLAVE_TYPE_OFF;
+	loop->thread = src->thread;	/* the buffer is not locked */
+	loop->xrun = src->xrun;
+	loop->wake = src->wake;
+	loop->float_req = src->float_req;
+	loop->dither_type = src->dither_type;
+	loop->idle_hold = src->idle_hold;
+	loop->idle_level = src->idle_level;
+#ifdef USE_SAMPLERATE
+	loop->src_enable = src->src_enable;
+	loop->src_converter_type = src->src_converter_type;
+#endif
+	if (route && (err = route_parse(route, &loop->route)) < 0)
+		return err;
+	for (i = 0; i < effects_count; i++) {
+		err = effect_add(loop, effects[i]);
+		if (err < 0)
+			return err;
+	}
+	set_loop_time(loop, src->loop_time);
+	add_loop(loop);
+	return 0;
+}
+
+/*
+ * Create a loop for an additional capture device. Its frames are
+ * converted to the playback parameters of the job, queued and mixed
+ * to the frames of the job capture. The drift is compensated per input.
+ */
+static int add_input(struct loopback *dst, char *arg, const char *route)
+{
+	struct loopback_handle *play, *capt, **last;
+	struct loopback *loop;
+	char *str;
+	float gain = 0;
+	int err;
+
+	str = strchr(arg, '@');
+	if (str) {
+		*str = '\0';
+		gain = atof(str + 1);
+		if (gain < -60 || gain > 20) {
+			logit(LOG_CRIT, "Wrong input gain '%s'\n", str + 1);
+			return -EINVAL;
+		}
+	}
+	err = create_loopback_handle(&capt, arg, NULL, "capture");
+	if (str)
+		*str = '@';
+	if (err < 0)
+		return err;
+	err = create_loopback_handle(&play, dst->play->device, NULL, "playback");
+	if (err < 0)
+		return err;
+	err = create_loopback(&loop, play, capt, dst->output);
+	if (err < 0)
+		return err;
+	play->source = dst->play;
+	play->mix_gain = pow(10.0, gain / 20.0);
+	for (last = &dst->play->mix; *last; last = &(*last)->mix)
+		;
+	*last = play;
+	play->access = capt->access = dst->capt->access;
+	play->format = capt->format = dst->capt->format;
+	play->rate = play->rate_req = dst->play->rate_req;
+	capt->rate = capt->rate_req = dst->capt->rate_req;
+	play->channels = capt->channels = dst->capt->channels;
+	if (route) {
+		/* routed like the job capture */
+		err = route_parse(route, &loop->route);
+		if (err < 0)
+			return err;
+		play->channels = dst->play->channels;
+	}
+	capt->buffer_size_req = dst->capt->buffer_size_req;
+	capt->period_size_req = dst->capt->period_size_req;
+	capt->resample = dst->capt->resample;
+	capt->nblock = dst->capt->nblock;
+	loop->latency_req = dst->latency_req;
+	loop->latency_reqtime = dst->latency_reqtime;
+	loop->latency_mintime = dst->latency_mintime;
+	loop->latency_maxtime = dst->latency_maxtime;
+	loop->sync = dst->sync;
+	loop->sync_bw = dst->sync_bw;
+	loop->slave = dst->slave == SLAVE_TYPE_ON ? SLAVE_TYPE_AUTO : dst->slave;
+	loop->thread = dst->thread;	/* the buffers are not locked */
+	loop->xrun = dst->xrun;
+	loop->wake = dst->wake;
+	loop->float_req = dst->float_req;
+	/* scanned for the playback loop, see idle_signal() */
+	loop->idle_hold = dst->idle_hold;
+	loop->idle_level = dst->idle_level;
+#ifdef USE_SAMPLERATE
+	loop->src_enable = dst->src_enable;
+	loop->src_converter_type = dst->src_converter_type;
+#endif
+	set_loop_time(loop, dst->loop_time);
+	add_loop(loop);
+	return 0;
+}
+
 static int parse_config_file(const char *file, snd_output_t *output);
 
 static int parse_config(int argc, char *argv[], snd_output_t *output,
@@ -345,32 +538,46 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		{"config", 1, NULL, 'g'},
 		{"daemonize", 0, NULL, 'd'},
 		{"pdevice", 1, NULL, 'P'},
+		{"output", 1, NULL, 'o'},
 		{"cdevice", 1, NULL, 'C'},
+		{"input", 1, NULL, 'i'},
 		{"pctl", 1, NULL, 'X'},
 		{"cctl", 1, NULL, 'Y'},
 		{"latency", 1, NULL, 'l'},
 		{"tlatency", 1, NULL, 't'},
+		{"adaptive", 1, NULL, 'L'},
 		{"format", 1, NULL, 'f'},
 		{"channels", 1, NULL, 'c'},
+		{"route", 1, NULL, 'R'},
 		{"rate", 1, NULL, 'r'},
 		{"buffer", 1, NULL, 'B'},
 		{"period", 1, NULL, 'E'},
 		{"seconds", 1, NULL, 's'},
 		{"nblock", 0, NULL, 'b'},
-		{"effect", 0, NULL, 'e'},
+		{"effect", 2, NULL, 'e'},
+		{"float", 2, NULL, 'D'},
+		{"volume", 1, NULL, 'V'},
 		{"verbose", 0, NULL, 'v'},
 		{"resample", 0, NULL, 'n'},
+		{"mmap", 0, NULL, 'M'},
 		{"samplerate", 1, NULL, 'A'},
 		{"sync", 1, NULL, 'S'},
+		{"syncbw", 1, NULL, 'K'},
 		{"slave", 1, NULL, 'a'},
 		{"thread", 1, NULL, 'T'},
+		{"workers", 1, NULL, 'j'},
 		{"mixer", 1, NULL, 'm'},
 		{"ossmixer", 1, NULL, 'O'},
 		{"workaround", 1, NULL, 'w'},
+		{"idle", 1, NULL, 'I'},
 		{"xrun", 0, NULL, 'U'},
+		{"stats", 1, NULL, 'Z'},
+		{"ptap", 1, NULL, 'x'},
+		{"ctap", 1, NULL, 'y'},
 		{NULL, 0, NULL, 0},
 	};
-	int err, morehelp;
+	int err, morehelp, i;
+	char *str;
 	char *arg_config = NULL;
 	char *arg_pdevice = NULL;
 	char *arg_cdevice = NULL;
@@ -378,17 +585,23 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	char *arg_cctl = NULL;
 	unsigned int arg_latency_req = 0;
 	unsigned int arg_latency_reqtime = 10000;
+	unsigned int arg_latency_mintime = 0;
+	unsigned int arg_latency_maxtime = 0;
 	snd_pcm_format_t arg_format = SND_PCM_FORMAT_S16_LE;
 	unsigned int arg_channels = 2;
+	char *arg_route = NULL;
+	char *arg_ptap = NULL;
+	char *arg_ctap = NULL;
 	unsigned int arg_rate = 48000;
 	snd_pcm_uframes_t arg_buffer_size = 0;
 	snd_pcm_uframes_t arg_period_size = 0;
 	unsigned long arg_loop_time = ~0UL;
 	int arg_nblock = 0;
-	int arg_effect = 0;
 	int arg_resample = 0;
+	int arg_mmap = 0;
 	int arg_samplerate = SRC_SINC_FASTEST + 1;
 	int arg_sync = SYNC_TYPE_AUTO;
+	double arg_sync_bw = 0.05;
 	int arg_slave = SLAVE_TYPE_AUTO;
 	int arg_thread = 0;
 	struct loopback *loop = NULL;
@@ -396,6 +609,16 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	int arg_mixers_count = 0;
 	char *arg_ossmixers[MAX_MIXERS];
 	int arg_ossmixers_count = 0;
+	const char *arg_effects[MAX_EFFECTS];
+	int arg_effects_count = 0;
+	const char *arg_outputs[MAX_OUTPUTS];
+	int arg_outputs_count = 0;
+	char *arg_inputs[MAX_INPUTS];
+	int arg_inputs_count = 0;
+	int arg_dither = -1;
+	char *arg_volume = NULL;
+	unsigned int arg_idle_hold = 0;
+	float arg_idle_level = 0;
 	int arg_xrun = arg_default_xrun;
 	int arg_wake = arg_default_wake;
 
@@ -403,7 +626,7 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 	while (1) {
 		int c;
 		if ((c = getopt_long(argc, argv,
-				"hdg:P:C:X:Y:l:t:F:f:c:r:s:benvA:S:a:m:T:O:w:UW:",
+				"hdg:P:o:C:i:X:Y:l:t:L:F:f:c:R:r:s:be::D::V:nMvA:S:K:a:m:T:j:O:w:I:UW:Z:x:y:",
 				long_option, NULL)) < 0)
 			break;
 		switch (c) {
@@ -421,9 +644,23 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'P':
 			arg_pdevice = strdup(optarg);
 			break;
+		case 'o':
+			if (arg_outputs_count >= MAX_OUTPUTS) {
+				logit(LOG_CRIT, "Maximum fan-out outputs reached (max %i)\n", (int)MAX_OUTPUTS);
+				exit(EXIT_FAILURE);
+			}
+			arg_outputs[arg_outputs_count++] = optarg;
+			break;
 		case 'C':
 			arg_cdevice = strdup(optarg);
 			break;
+		case 'i':
+			if (arg_inputs_count >= MAX_INPUTS) {
+				logit(LOG_CRIT, "Maximum mixed inputs reached (max %i)\n", (int)MAX_INPUTS);
+				exit(EXIT_FAILURE);
+			}
+			arg_inputs[arg_inputs_count++] = optarg;
+			break;
 		case 'X':
 			arg_pctl = strdup(optarg);
 			break;
@@ -438,6 +675,14 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			err = atoi(optarg);
 			arg_latency_reqtime = err >= 500 ? err : 500;
 			break;
+		case 'L':
+			if (sscanf(optarg, "%u:%u", &arg_latency_mintime, &arg_latency_maxtime) != 2 ||
+			    arg_latency_mintime < 500 ||
+			    arg_latency_maxtime < arg_latency_mintime) {
+				logit(LOG_CRIT, "Wrong adaptive latency range (use MIN:MAX in usec)\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'f':
 			arg_format = snd_pcm_format_value(optarg);
 			if (arg_format == SND_PCM_FORMAT_UNKNOWN) {
@@ -449,6 +694,9 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			err = atoi(optarg);
 			arg_channels = err >= 1 && err < 1024 ? err : 1;
 			break;
+		case 'R':
+			arg_route = optarg;
+			break;
 		case 'r':
 			err = atoi(optarg);
 			arg_rate = err >= 4000 && err < 200000 ? err : 44100;
@@ -469,11 +717,26 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			arg_nblock = 1;
 			break;
 		case 'e':
-			arg_effect = 1;
+			if (arg_effects_count >= MAX_EFFECTS) {
+				logit(LOG_CRIT, "Maximum effects reached (max %i)\n", (int)MAX_EFFECTS);
+				exit(EXIT_FAILURE);
+			}
+			arg_effects[arg_effects_count++] = optarg ? optarg : "sweep";
+			break;
+		case 'D':
+			arg_dither = dither_parse(optarg);
+			if (arg_dither < 0)
+				exit(EXIT_FAILURE);
+			break;
+		case 'V':
+			arg_volume = optarg;
 			break;
 		case 'n':
 			arg_resample = 1;
 			break;
+		case 'M':
+			arg_mmap = 1;
+			break;
 		case 'A':
 			if (strcasecmp(optarg, "sincbest") == 0)
 				arg_samplerate = SRC_SINC_BEST_QUALITY;
@@ -509,6 +772,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			if (arg_sync < 0 || arg_sync > SYNC_TYPE_LAST)
 				arg_sync = SYNC_TYPE_AUTO;
 			break;
+		case 'K':
+			arg_sync_bw = atof(optarg);
+			if (arg_sync_bw < 0.001 || arg_sync_bw > 10)
+				arg_sync_bw = 0.05;
+			break;
 		case 'a':
 			if (optarg[0] == 'a')
 				arg_slave = SLAVE_TYPE_AUTO;
@@ -526,6 +794,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			if (arg_thread < 0)
 				arg_thread = 10000000 + loopbacks_count;
 			break;
+		case 'j':
+			arg_workers = atoi(optarg);
+			if (arg_workers < 0 || arg_workers > 1024)
+				arg_workers = 0;
+			break;
 		case 'm':
 			if (arg_mixers_count >= MAX_MIXERS) {
 				logit(LOG_CRIT, "Maximum redirected mixer controls reached (max %i)\n", (int)MAX_MIXERS);
@@ -546,6 +819,18 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		case 'w':
 			if (strcasecmp(optarg, "serialopen") == 0)
 				workarounds |= WORKAROUND_SERIALOPEN;
+			else if (strcasecmp(optarg, "nosnapshot") == 0)
+				workarounds |= WORKAROUND_NOSNAPSHOT;
+			break;
+		case 'I':
+			err = atoi(optarg);
+			if (err <= 0) {
+				logit(LOG_CRIT, "Wrong idle hold time '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			arg_idle_hold = err;
+			str = strchr(optarg, ':');
+			arg_idle_level = str ? pow(10.0, atof(str + 1) / 20.0) : 0;
 			break;
 		case 'U':
 			arg_xrun = 1;
@@ -557,6 +842,16 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			if (cmdline)
 				arg_default_wake = arg_wake;
 			break;
+		case 'Z':
+			free(arg_stats);
+			arg_stats = strdup(optarg);
+			break;
+		case 'x':
+			arg_ptap = optarg;
+			break;
+		case 'y':
+			arg_ctap = optarg;
+			break;
 		}
 	}
 
@@ -564,6 +859,11 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		help();
 		exit(EXIT_SUCCESS);
 	}
+	/* the latency changes are followed by the drift controller */
+	if (arg_latency_maxtime && arg_sync == SYNC_TYPE_NONE) {
+		logit(LOG_CRIT, "Adaptive latency (-L) requires a sync mode (-S)\n");
+		exit(EXIT_FAILURE);
+	}
 	if (arg_config == NULL) {
 		struct loopback_handle *play;
 		struct loopback_handle *capt;
@@ -585,17 +885,48 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 		play->format = capt->format = arg_format;
 		play->rate = play->rate_req = capt->rate = capt->rate_req = arg_rate;
 		play->channels = capt->channels = arg_channels;
+		if (arg_route) {
+			err = route_parse(arg_route, &loop->route);
+			if (err < 0) {
+				logit(LOG_CRIT, "Unable to parse channel route.\n");
+				exit(EXIT_FAILURE);
+			}
+			play->channels = loop->route->channels;
+		}
 		play->buffer_size_req = capt->buffer_size_req = arg_buffer_size;
 		play->period_size_req = capt->period_size_req = arg_period_size;
 		play->resample = capt->resample = arg_resample;
+		if (arg_mmap)
+			play->access = capt->access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
 		play->nblock = capt->nblock = arg_nblock ? 1 : 0;
 		loop->latency_req = arg_latency_req;
 		loop->latency_reqtime = arg_latency_reqtime;
+		loop->latency_mintime = arg_latency_mintime;
+		loop->latency_maxtime = arg_latency_maxtime;
+		if (arg_latency_maxtime) {
+			/* start low, see latency_adapt() */
+			loop->latency_req = 0;
+			loop->latency_reqtime = arg_latency_mintime;
+		}
 		loop->sync = arg_sync;
+		loop->sync_bw = arg_sync_bw;
 		loop->slave = arg_slave;
 		loop->thread = arg_thread;
 		loop->xrun = arg_xrun;
 		loop->wake = arg_wake;
+		loop->float_req = arg_dither >= 0;
+		loop->idle_hold = arg_idle_hold;
+		loop->idle_level = arg_idle_level;
+		loop->dither_type = arg_dither >= 0 ? arg_dither : DITHER_NONE;
+		if (arg_volume && volume_parse(arg_volume, &loop->volume) < 0) {
+			logit(LOG_CRIT, "Unable to parse the volume control.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ((arg_ptap && tap_add(play, arg_ptap) < 0) ||
+		    (arg_ctap && tap_add(capt, arg_ctap) < 0)) {
+			logit(LOG_CRIT, "Unable to add the recording tap.\n");
+			exit(EXIT_FAILURE);
+		}
 		err = add_mixers(loop, arg_mixers, arg_mixers_count);
 		if (err < 0) {
 			logit(LOG_CRIT, "Unable to add mixer controls.\n");
@@ -606,18 +937,34 @@ static int parse_config(int argc, char *argv[], snd_output_t *output,
 			logit(LOG_CRIT, "Unable to add ossmixer controls.\n");
 			exit(EXIT_FAILURE);
 		}
+		for (i = 0; i < arg_effects_count; i++) {
+			if (effect_add(loop, arg_effects[i]) < 0) {
+				logit(LOG_CRIT, "Unable to add effect '%s'.\n", arg_effects[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
 #ifdef USE_SAMPLERATE
 		loop->src_enable = arg_samplerate > 0;
 		if (loop->src_enable)
 			loop->src_converter_type = arg_samplerate - 1;
-#else
-		if (arg_samplerate > 0) {
-			logit(LOG_CRIT, "No libsamplerate support.\n");
-			exit(EXIT_FAILURE);
-		}
 #endif
 		set_loop_time(loop, arg_loop_time);
 		add_loop(loop);
+		for (i = 0; i < arg_outputs_count; i++) {
+			err = add_fanout(loop, arg_outputs[i], arg_route,
+					 arg_effects, arg_effects_count);
+			if (err < 0) {
+				logit(LOG_CRIT, "Unable to add fan-out output '%s'.\n", arg_outputs[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (i = 0; i < arg_inputs_count; i++) {
+			err = add_input(loop, arg_inputs[i], arg_route);
+			if (err < 0) {
+				logit(LOG_CRIT, "Unable to add mixed input '%s'.\n", arg_inputs[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
 		return 0;
 	}
 
@@ -694,22 +1041,291 @@ static int parse_config_file(const char *file, snd_output_t *output)
 	return err;
 }
 
+static void thread_pollfds_clear(int epfd, struct loopback *loop)
+{
+	int i;
+
+	for (i = 0; i < loop->active_pollfd_count; i++)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, loop->pollfds[i].fd, NULL);
+	loop->active_pollfd_count = 0;
+}
+
+/*
+ * Register the current poll descriptors of the loop to the epoll set.
+ * It's called only when the loop was started, stopped or reinitialized.
+ * The event data carries the loop index (upper 32 bits) and the index
+ * of the descriptor in loop->pollfds (lower 32 bits).
+ */
+static int thread_pollfds_update(int epfd, struct loopback_thread *thread,
+				 int idx)
+{
+	struct loopback *loop = thread->loopbacks[idx];
+	struct epoll_event ev;
+	struct pollfd *pfds;
+	int i, err;
+
+	thread_pollfds_clear(epfd, loop);
+	loop->pollfds_changed = 0;
+	loop->pollfds_ready = 0;
+	if (loop->pollfd_count <= 0)
+		return 0;
+	pfds = realloc(loop->pollfds, loop->pollfd_count * sizeof(struct pollfd));
+	if (pfds == NULL)
+		return -ENOMEM;
+	loop->pollfds = pfds;
+	err = pcmjob_pollfds_init(loop, pfds);
+	if (err < 0)
+		return err;
+	/* counts the registered descriptors, see thread_pollfds_clear() */
+	loop->active_pollfd_count = 0;
+	for (i = 0; i < err; i++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = pfds[i].events;
+		ev.data.u64 = ((uint64_t)idx << 32) | i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, pfds[i].fd, &ev) < 0) {
+			err = -errno;
+			/* the epoll data can dispatch to one handle only */
+			if (err == -EEXIST)
+				logit(LOG_CRIT, "%s: poll descriptor %i is shared with another handle of the thread\n", loop->id, pfds[i].fd);
+			thread_pollfds_clear(epfd, loop);
+			return err;
+		}
+		loop->active_pollfd_count = i + 1;
+	}
+	return 0;
+}
+
+static int thread_pollfds_handle(int epfd, struct loopback_thread *thread,
+				 int idx)
+{
+	struct loopback *loop = thread->loopbacks[idx];
+	int i, err;
+
+	loop->pollfds_ready = 0;
+	err = pcmjob_pollfds_handle(loop, loop->pollfds);
+	if (err < 0)
+		return err;
+	/* a fan-out source starts and stops the other loops, too */
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		if (!thread->loopbacks[i]->pollfds_changed)
+			continue;
+		err = thread_pollfds_update(epfd, thread, i);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/* the loops sharing a device must run in one thread */
+static struct loopback *loop_group(struct loopback *loop)
+{
+	if (loop->capt->source)
+		return loop->capt->source->loopback;
+	if (loop->play->source)
+		return loop->play->source->loopback;
+	return loop;
+}
+
+static int thread_pfds_count(struct loopback_thread *thread)
+{
+	int i, count = (thread->wakefd >= 0) + (thread->timerfd >= 0);
+
+	for (i = 0; i < thread->loopbacks_count; i++)
+		count += thread->loopbacks[i]->pollfd_count;
+	return count;
+}
+
+static int thread_wake(struct loopback_thread *thread)
+{
+	int i, j, wake = 1000000;
+
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		j = thread->loopbacks[i]->wake;
+		if (j > 0 && j < wake)
+			wake = j;
+	}
+	return wake >= 1000000 ? -1 : wake;
+}
+
+/* arm the periodic wake timer, wake in ms, -1 = disarm */
+static void thread_timer_set(struct loopback_thread *thread, int wake)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (wake > 0) {
+		its.it_value.tv_sec = wake / 1000;
+		its.it_value.tv_nsec = (wake % 1000) * 1000000;
+		its.it_interval = its.it_value;
+	}
+	if (timerfd_settime(thread->timerfd, 0, &its, NULL) < 0)
+		logit(LOG_WARNING, "Wake timer setup failed: %s\n", strerror(errno));
+}
+
+/* earliest deadline first, see update_deadline() in pcmjob.c */
+static void thread_edf_sort(struct loopback_thread *thread, int *ready,
+			    int count)
+{
+	struct loopback **loops = thread->loopbacks;
+	int i, j, k;
+
+	for (i = 1; i < count; i++) {
+		k = ready[i];
+		for (j = i; j > 0 &&
+		     loops[ready[j - 1]]->deadline > loops[k]->deadline; j--)
+			ready[j] = ready[j - 1];
+		ready[j] = k;
+	}
+}
+
+struct loopback_open {
+	pthread_t thread;
+	struct loopback *loop;
+	int started;
+	int err;
+};
+
+static void *thread_open1(void *data)
+{
+	struct loopback_open *open = data;
+
+	open->err = pcmjob_init(open->loop);
+	return NULL;
+}
+
+/*
+ * Open the devices of all loops in the thread. The opens may take long
+ * (plugins, configuration parsing), so they run in parallel unless the
+ * serialopen workaround is used. The fan-out and mix loops use
+ * the devices of their owners, they are initialized afterwards.
+ */
+static int thread_open(struct loopback_thread *thread)
+{
+	struct loopback_open *opens;
+	struct loopback *loop;
+	int i, pass, err = 0;
+	int parallel = !(workarounds & WORKAROUND_SERIALOPEN) &&
+		       thread->loopbacks_count > 1;
+
+	opens = calloc(thread->loopbacks_count, sizeof(*opens));
+	if (opens == NULL)
+		return -ENOMEM;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < thread->loopbacks_count; i++) {
+			loop = thread->loopbacks[i];
+			if ((loop_group(loop) == loop) != (pass == 0))
+				continue;
+			opens[i].loop = loop;
+			if (parallel && pass == 0 &&
+			    pthread_create(&opens[i].thread, NULL,
+					   thread_open1, &opens[i]) == 0)
+				opens[i].started = 1;
+			else
+				thread_open1(&opens[i]);
+		}
+		for (i = 0; i < thread->loopbacks_count; i++) {
+			if (opens[i].started) {
+				pthread_join(opens[i].thread, NULL);
+				opens[i].started = 0;
+			}
+			if (opens[i].err < 0)
+				err = opens[i].err;
+		}
+		if (err < 0)
+			break;
+	}
+	free(opens);
+	return err;
+}
+
+static void pool_wakeup(struct loopback_thread *thread)
+{
+	uint64_t one = 1;
+
+	if (write(thread->wakefd, &one, sizeof(one)) != sizeof(one))
+		logit(LOG_WARNING, "Worker %i wakeup failed: %s\n", thread->index, strerror(errno));
+}
+
+static void pool_affinity(struct loopback_thread *thread)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t cpus;
+
+	if (ncpu < 1)
+		return;
+	CPU_ZERO(&cpus);
+	CPU_SET(thread->index % ncpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0 &&
+	    verbose)
+		logit(LOG_WARNING, "Unable to bind worker %i to CPU %li\n", thread->index, thread->index % ncpu);
+}
+
+/*
+ * Called by the worker when its wakefd was signalled. The group requested
+ * by the balancer is handed over to the target worker and the loops
+ * handed over to this worker are adopted. The loops keep running, only
+ * the poll descriptors are moved to the other epoll set.
+ */
+static int pool_migrate(int epfd, struct loopback_thread *thread)
+{
+	struct loopback_thread *target = NULL;
+	struct loopback *loop;
+	uint64_t val;
+	int i, j, err;
+
+	if (read(thread->wakefd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+	pthread_mutex_lock(&pool_mutex);
+	if (thread->move_group) {
+		target = thread->move_to;
+		for (i = j = 0; i < thread->loopbacks_count; i++) {
+			loop = thread->loopbacks[i];
+			if (loop_group(loop) == thread->move_group) {
+				thread_pollfds_clear(epfd, loop);
+				loop->thread = target->index;
+				target->inbox[target->inbox_count++] = loop;
+			} else {
+				thread->loopbacks[j++] = loop;
+			}
+		}
+		thread->loopbacks_count = j;
+		thread->move_group = NULL;
+	}
+	for (i = 0; i < thread->inbox_count; i++)
+		thread->loopbacks[thread->loopbacks_count++] = thread->inbox[i];
+	thread->inbox_count = 0;
+	pthread_mutex_unlock(&pool_mutex);
+	if (target)
+		pool_wakeup(target);
+	/* the loop indexes in the epoll data have changed */
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		err = thread_pollfds_update(epfd, thread, i);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
 static void thread_job1(void *_data)
 {
 	struct loopback_thread *thread = _data;
 	snd_output_t *output = thread->output;
-	struct pollfd *pfds = NULL;
-	int pfds_count = 0;
-	int i, j, err, wake = 1000000;
+	struct epoll_event *events = NULL;
+	int *ready = NULL;
+	int pfds_count;
+	int i, j, k, ready_count, epfd, err, wake, timeout, migrate, timer;
+	struct timeval tp1, tp2;
+	uint64_t val;
+	long diff;
 
 	setscheduler();
+	if (arg_workers >= 0)
+		pool_affinity(thread);
 
-	for (i = 0; i < thread->loopbacks_count; i++) {
-		err = pcmjob_init(thread->loopbacks[i]);
-		if (err < 0) {
-			logit(LOG_CRIT, "Loopback initialization failure.\n");
-			my_exit(thread, EXIT_FAILURE);
-		}
+	err = thread_open(thread);
+	if (err < 0) {
+		logit(LOG_CRIT, "Loopback initialization failure.\n");
+		my_exit(thread, EXIT_FAILURE);
 	}
 	for (i = 0; i < thread->loopbacks_count; i++) {
 		err = pcmjob_start(thread->loopbacks[i]);
@@ -717,31 +1333,54 @@ static void thread_job1(void *_data)
 			logit(LOG_CRIT, "Loopback start failure.\n");
 			my_exit(thread, EXIT_FAILURE);
 		}
-		pfds_count += thread->loopbacks[i]->pollfd_count;
-		j = thread->loopbacks[i]->wake;
-		if (j > 0 && j < wake)
-			wake = j;
 	}
-	if (wake >= 1000000)
-		wake = -1;
-	pfds = calloc(pfds_count, sizeof(struct pollfd));
-	if (pfds == NULL || pfds_count <= 0) {
+	/* the poll timeout has only the millisecond resolution and
+	   drifts with the processing time, prefer a timer */
+	thread->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	pfds_count = thread_pfds_count(thread);
+	wake = thread_wake(thread);
+	epfd = epoll_create(pfds_count > 0 ? pfds_count : 1);
+	events = calloc(pfds_count, sizeof(struct epoll_event));
+	/* the pool workers may adopt any loop */
+	ready = calloc(loopbacks_count, sizeof(int));
+	if (epfd < 0 || events == NULL || ready == NULL || pfds_count <= 0) {
 		logit(LOG_CRIT, "Poll FDs allocation failed.\n");
 		my_exit(thread, EXIT_FAILURE);
 	}
+	for (i = 0; i < thread->loopbacks_count; i++) {
+		err = thread_pollfds_update(epfd, thread, i);
+		if (err < 0) {
+			logit(LOG_CRIT, "Poll FD initialization failed.\n");
+			my_exit(thread, EXIT_FAILURE);
+		}
+	}
+	if (thread->wakefd >= 0) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = POOL_WAKE;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, thread->wakefd, &ev) < 0) {
+			logit(LOG_CRIT, "Worker wakeup registration failed.\n");
+			my_exit(thread, EXIT_FAILURE);
+		}
+	}
+	if (thread->timerfd >= 0) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = THREAD_TIMER;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, thread->timerfd, &ev) < 0) {
+			logit(LOG_CRIT, "Wake timer registration failed.\n");
+			my_exit(thread, EXIT_FAILURE);
+		}
+		thread_timer_set(thread, wake);
+	}
 	while (!quit) {
 		struct timeval tv1, tv2;
-		for (i = j = 0; i < thread->loopbacks_count; i++) {
-			err = pcmjob_pollfds_init(thread->loopbacks[i], &pfds[j]);
-			if (err < 0) {
-				logit(LOG_CRIT, "Poll FD initialization failed.\n");
-				my_exit(thread, EXIT_FAILURE);
-			}
-			j += err;
-		}
 		if (verbose > 10)
 			gettimeofday(&tv1, NULL);
-		err = poll(pfds, j, wake);
+		timeout = thread->timerfd >= 0 ? -1 : wake;
+		err = epoll_wait(epfd, events, pfds_count, timeout);
 		if (err < 0)
 			err = -errno;
 		if (verbose > 10) {
@@ -754,22 +1393,260 @@ static void thread_job1(void *_data)
 			logit(LOG_CRIT, "Poll failed: %s\n", strerror(-err));
 			my_exit(thread, EXIT_FAILURE);
 		}
-		for (i = j = 0; i < thread->loopbacks_count; i++) {
-			struct loopback *loop = thread->loopbacks[i];
-			if (j < loop->active_pollfd_count) {
-				err = pcmjob_pollfds_handle(loop, &pfds[j]);
-				if (err < 0) {
-					logit(LOG_CRIT, "pcmjob failed.\n");
-					exit(EXIT_FAILURE);
-				}
+		migrate = 0;
+		timer = err == 0;
+		ready_count = 0;
+		/* dispatch events directly to the owning loops */
+		for (i = 0; i < err; i++) {
+			struct loopback *loop;
+			if (events[i].data.u64 == POOL_WAKE) {
+				migrate = 1;
+				continue;
 			}
-			j += loop->active_pollfd_count;
+			if (events[i].data.u64 == THREAD_TIMER) {
+				if (read(thread->timerfd, &val, sizeof(val)) > 0)
+					timer = 1;
+				continue;
+			}
+			j = events[i].data.u64 >> 32;
+			k = events[i].data.u64 & 0xffffffff;
+			loop = thread->loopbacks[j];
+			if (!loop->pollfds_ready) {
+				int l;
+				for (l = 0; l < loop->active_pollfd_count; l++)
+					loop->pollfds[l].revents = 0;
+				loop->pollfds_ready = 1;
+				ready[ready_count++] = j;
+			}
+			loop->pollfds[k].revents = events[i].events;
+		}
+		if (timer) {
+			/* wake timeout - process all loops */
+			for (i = 0; i < thread->loopbacks_count; i++) {
+				struct loopback *loop = thread->loopbacks[i];
+				if (loop->pollfds_ready ||
+				    loop->active_pollfd_count <= 0)
+					continue;
+				for (k = 0; k < loop->active_pollfd_count; k++)
+					loop->pollfds[k].revents = 0;
+				loop->pollfds_ready = 1;
+				ready[ready_count++] = i;
+			}
+		}
+		thread_edf_sort(thread, ready, ready_count);
+		if (thread->wakefd >= 0)
+			gettimeofday(&tp1, NULL);
+		for (i = 0; i < ready_count; i++) {
+			struct loopback *loop = thread->loopbacks[ready[i]];
+			if (loop->active_pollfd_count <= 0)
+				continue;
+			err = thread_pollfds_handle(epfd, thread, ready[i]);
+			if (err < 0) {
+				logit(LOG_CRIT, "pcmjob failed.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (thread->wakefd >= 0) {
+			gettimeofday(&tp2, NULL);
+			diff = timediff(tp2, tp1);
+			/* read and reset by pool_balance() */
+			__atomic_store_n(&thread->busy, thread->busy + diff,
+					 __ATOMIC_RELAXED);
+			if (diff > __atomic_load_n(&thread->pass_max,
+						   __ATOMIC_RELAXED))
+				__atomic_store_n(&thread->pass_max, diff,
+						 __ATOMIC_RELAXED);
+		}
+		if (migrate) {
+			err = pool_migrate(epfd, thread);
+			if (err < 0) {
+				logit(LOG_CRIT, "Worker %i migration failed: %s\n", thread->index, strerror(-err));
+				my_exit(thread, EXIT_FAILURE);
+			}
+			pfds_count = thread_pfds_count(thread);
+			free(events);
+			events = calloc(pfds_count, sizeof(struct epoll_event));
+			if (events == NULL) {
+				logit(LOG_CRIT, "Poll FDs allocation failed.\n");
+				my_exit(thread, EXIT_FAILURE);
+			}
+			wake = thread_wake(thread);
+			if (thread->timerfd >= 0)
+				thread_timer_set(thread, wake);
 		}
 	}
 
+	close(epfd);
+	if (thread->timerfd >= 0)
+		close(thread->timerfd);
+	free(events);
+	free(ready);
 	my_exit(thread, EXIT_SUCCESS);
 }
 
+/*
+ * Assign the loop groups to the workers, the longest estimated processing
+ * time first. The estimate is the sample count per second, the balancer
+ * corrects it with the measured times later.
+ */
+static void pool_create(snd_output_t *output)
+{
+	struct loopback *loop;
+	double *cost, *load;
+	int i, j, k, n, groups = 0;
+
+	n = arg_workers > 0 ? arg_workers : sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < loopbacks_count; i++)
+		if (loop_group(loopbacks[i]) == loopbacks[i])
+			groups++;
+	if (n > groups)
+		n = groups;
+	if (n < 1)
+		n = 1;
+	threads = calloc(n, sizeof(struct loopback_thread));
+	cost = calloc(loopbacks_count, sizeof(double));
+	load = calloc(n, sizeof(double));
+	if (threads == NULL || cost == NULL || load == NULL) {
+		logit(LOG_CRIT, "No enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (k = 0; k < n; k++) {
+		threads[k].loopbacks = malloc(loopbacks_count * sizeof(struct loopback *));
+		threads[k].inbox = malloc(loopbacks_count * sizeof(struct loopback *));
+		threads[k].wakefd = eventfd(0, EFD_NONBLOCK);
+		if (threads[k].loopbacks == NULL || threads[k].inbox == NULL ||
+		    threads[k].wakefd < 0) {
+			logit(LOG_CRIT, "Unable to create worker %i\n", k);
+			exit(EXIT_FAILURE);
+		}
+		threads[k].threaded = 1;
+		threads[k].index = k;
+		threads[k].output = output;
+	}
+	for (i = 0; i < loopbacks_count; i++) {
+		if (loop_group(loopbacks[i]) != loopbacks[i])
+			continue;
+		for (j = 0; j < loopbacks_count; j++) {
+			loop = loopbacks[j];
+			if (loop_group(loop) == loopbacks[i])
+				cost[i] += (double)loop->play->rate_req *
+					   loop->play->channels;
+		}
+	}
+	while (groups-- > 0) {
+		for (i = 0, j = -1; i < loopbacks_count; i++)
+			if (loop_group(loopbacks[i]) == loopbacks[i] &&
+			    cost[i] >= 0 && (j < 0 || cost[i] > cost[j]))
+				j = i;
+		for (k = 1, i = 0; k < n; k++)
+			if (load[k] < load[i])
+				i = k;
+		load[i] += cost[j];
+		cost[j] = -1;
+		loopbacks[j]->thread = i;
+	}
+	for (i = 0; i < loopbacks_count; i++) {
+		loop = loopbacks[i];
+		loop->thread = loop_group(loop)->thread;
+		loop->balance = 1;
+		k = loop->thread;
+		threads[k].loopbacks[threads[k].loopbacks_count++] = loop;
+	}
+	threads_count = n;
+	free(cost);
+	free(load);
+}
+
+/*
+ * Called periodically from the main thread. The worker with the smallest
+ * deadline margin hands one loop group to the least loaded worker when
+ * the margin is below POOL_MARGIN and the move makes the pair better
+ * balanced. The margin is the free part of the real time or of the
+ * shortest period of the worker, whichever is smaller. The counters are
+ * written by the workers and accessed atomically here without locks, so
+ * the decision is approximate.
+ */
+static void pool_balance(void)
+{
+	static struct timeval last;
+	struct loopback_thread *thread, *src = NULL, *dst = NULL;
+	struct loopback *loop, *group, *move = NULL;
+	struct timeval now;
+	double interval, period, period_min, burst, gload, best = 0;
+	unsigned long long busy, proc_time, period_time;
+	long pass_max;
+	int i, j, k, groups;
+
+	gettimeofday(&now, NULL);
+	interval = last.tv_sec ? timediff(now, last) / 1000000.0 : 0;
+	last = now;
+	pthread_mutex_lock(&pool_mutex);
+	for (k = 0; k < threads_count; k++) {
+		thread = &threads[k];
+		busy = __atomic_load_n(&thread->busy, __ATOMIC_RELAXED);
+		thread->load = interval > 0 ?
+			(busy - thread->busy_last) / 1e6 / interval : 0;
+		thread->busy_last = busy;
+		period_min = 0;
+		for (i = 0; i < thread->loopbacks_count; i++) {
+			loop = thread->loopbacks[i];
+			proc_time = __atomic_load_n(&loop->proc_time,
+						    __ATOMIC_RELAXED);
+			loop->proc_load = interval > 0 ?
+				(proc_time - loop->proc_time_last) / 1e6 / interval : 0;
+			loop->proc_time_last = proc_time;
+			/* published by the worker, the loop may restart meanwhile */
+			period_time = __atomic_load_n(&loop->period_time,
+						      __ATOMIC_RELAXED);
+			if (period_time == 0)
+				continue;
+			period = period_time / 1e6;
+			if (period_min == 0 || period < period_min)
+				period_min = period;
+		}
+		pass_max = __atomic_exchange_n(&thread->pass_max, 0,
+					       __ATOMIC_RELAXED);
+		burst = period_min > 0 ? pass_max / 1e6 / period_min : 0;
+		thread->margin = 1 - (thread->load > burst ? thread->load : burst);
+		if (verbose > 1)
+			logit(LOG_INFO, "Worker %i: %i loops, load %.2f%%, margin %.2f%%\n", k, thread->loopbacks_count, thread->load * 100, thread->margin * 100);
+		if (src == NULL || thread->margin < src->margin)
+			src = thread;
+		if (dst == NULL || thread->load < dst->load)
+			dst = thread;
+	}
+	if (interval == 0 || src == dst || src->margin >= POOL_MARGIN ||
+	    src->move_group || dst->inbox_count)
+		goto __unlock;
+	for (i = groups = 0; i < src->loopbacks_count; i++)
+		if (loop_group(src->loopbacks[i]) == src->loopbacks[i])
+			groups++;
+	if (groups < 2)
+		goto __unlock;
+	for (i = 0; i < src->loopbacks_count; i++) {
+		group = src->loopbacks[i];
+		if (loop_group(group) != group)
+			continue;
+		for (j = 0, gload = 0; j < src->loopbacks_count; j++)
+			if (loop_group(src->loopbacks[j]) == group)
+				gload += src->loopbacks[j]->proc_load;
+		if (gload > best && dst->load + gload < src->load - gload) {
+			best = gload;
+			move = group;
+		}
+	}
+	if (move) {
+		if (verbose)
+			logit(LOG_INFO, "Moving %s from worker %i to %i (margin %.2f%%, load %.2f%%)\n", move->id, src->index, dst->index, src->margin * 100, best * 100);
+		src->move_group = move;
+		src->move_to = dst;
+	}
+      __unlock:
+	pthread_mutex_unlock(&pool_mutex);
+	if (move)
+		pool_wakeup(src);
+}
+
 static void thread_job(struct loopback_thread *thread)
 {
 	if (!thread->threaded) {
@@ -861,6 +1738,10 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (arg_workers >= 0) {
+		pool_create(output);
+		goto __start;
+	}
 	/* we must sort thread IDs */
 	j = -1;
 	do {
@@ -896,12 +1777,25 @@ int main(int argc, char *argv[])
 		threads[k].loopbacks_count = l;
 		threads[k].output = output;
 		threads[k].threaded = j > 1;
+		threads[k].index = k;
+		threads[k].wakefd = -1;
 		for (i = l = 0; i < loopbacks_count; i++)
 			if (loopbacks[i]->thread == k)
 				threads[k].loopbacks[l++] = loopbacks[i];
 	}
 	threads_count = j;
+      __start:
 	main_job = pthread_self();
+
+	if (arg_stats) {
+		err = stats_open(arg_stats, loopbacks, loopbacks_count);
+		if (err < 0)
+			exit(EXIT_FAILURE);
+		atexit(stats_close);
+	}
+	if (tap_start() < 0)
+		exit(EXIT_FAILURE);
+	atexit(tap_close);
  
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
@@ -912,7 +1806,14 @@ int main(int argc, char *argv[])
 	for (k = 0; k < threads_count; k++)
 		thread_job(&threads[k]);
 
-	if (j > 1) {
+	if (arg_workers >= 0) {
+		while (!quit) {
+			sleep(POOL_INTERVAL);
+			if (!quit)
+				pool_balance();
+		}
+	}
+	if (threads[0].threaded) {
 		for (k = 0; k < threads_count; k++)
 			pthread_join(threads[k].thread, NULL);
 	}
@@ -19,28 +19,24 @@
  */
 
 #include "aconfig.h"
-#ifdef HAVE_SAMPLERATE_H
 #define USE_SAMPLERATE
+#ifdef HAVE_SAMPLERATE_H
 #include <samplerate.h>
 #else
-enum {
-	SRC_SINC_BEST_QUALITY	= 0,
-	SRC_SINC_MEDIUM_QUALITY	= 1,
-	SRC_SINC_FASTEST	= 2,
-	SRC_ZERO_ORDER_HOLD	= 3,
-	SRC_LINEAR		= 4
-};
+#include "resample.h"		/* built-in converter */
 #endif
 
 #define MAX_ARGS	128
 #define MAX_MIXERS	64
-
-#if 0
-#define FILE_PWRITE "/tmp/alsaloop.praw"
-#define FILE_CWRITE "/tmp/alsaloop.craw"
-#endif
+#define MAX_EFFECTS	16
+#define MAX_OUTPUTS	16
+#define MAX_INPUTS	16
+#define EFFECT_BLOCK	256	/* frames processed at once by the effects */
+#define ROUTE_BLOCK	256	/* frames converted at once by the router */
+#define MAX_HWCACHE	8	/* cached configurations per device */
 
 #define WORKAROUND_SERIALOPEN	(1<<0)
+#define WORKAROUND_NOSNAPSHOT	(1<<1)
 
 typedef enum _sync_type {
 	SYNC_TYPE_NONE = 0,
@@ -81,6 +77,129 @@ struct loopback_ossmixer {
 	struct loopback_ossmixer *next;
 };
 
+struct loopback_effect;
+
+struct loopback_effect_ops {
+	const char *name;
+	size_t private_size;		/* allocated with the effect */
+	int (*parse)(struct loopback_effect *effect, const char *args);
+	int (*init)(struct loopback_effect *effect);
+	void (*process)(struct loopback_effect *effect, float *buf,
+			snd_pcm_uframes_t frames);
+	void (*done)(struct loopback_effect *effect);
+};
+
+struct loopback_effect {
+	const struct loopback_effect_ops *ops;
+	void *private_data;
+	unsigned int active:1;		/* init was called */
+	unsigned int channels;
+	unsigned int rate;
+	/* statistics */
+	unsigned long long frames;	/* processed frames */
+	unsigned long long nsec;	/* processing time */
+	struct loopback_effect *next;
+};
+
+struct loopback_biquad {
+	float a0, a1, a2;		/* feed-forward coefficients */
+	float b1, b2;			/* feedback coefficients */
+	unsigned int channels;
+	float *x1, *x2, *y1, *y2;	/* per channel state */
+};
+
+enum {
+	DITHER_NONE = 0,
+	DITHER_TPDF,		/* triangular, two LSB peak to peak */
+	DITHER_SHAPED		/* TPDF with the error feedback */
+};
+
+struct loopback_dither {
+	int type;			/* DITHER_* */
+	snd_pcm_format_t format;	/* S16, S24 or S24_3LE */
+	unsigned int channels;
+	double scale;			/* 1.0 in LSB */
+	double max, min;
+	unsigned int seed;
+	double *e1, *e2;		/* per channel error feedback */
+	unsigned long long clipped;	/* samples */
+};
+
+struct loopback_volume {
+	snd_ctl_t *ctl;			/* the card with the control, NULL = off */
+	snd_ctl_elem_id_t *id;
+	snd_ctl_elem_value_t *value;
+	float min_db, max_db;		/* the control range */
+	unsigned int count;		/* control values */
+	unsigned int channels;
+	unsigned int ramp;		/* frames */
+	unsigned int left;		/* frames to the target */
+	unsigned int unity:1;		/* all targets are 0dB */
+	unsigned int uniform:1;		/* one target for all channels */
+	float *cur, *target, *step;	/* per channel */
+	float *buf;			/* EFFECT_BLOCK frames */
+	unsigned long long changes;
+};
+
+struct alsaloop_stats;
+struct loopback_tap;
+struct loopback_handle;
+
+/* a loop end which is not a PCM (network socket, shared memory ring) */
+struct loopback_endpoint_ops {
+	const char *prefix;		/* device name prefix */
+	int (*open)(struct loopback_handle *lhandle);
+	void (*close)(struct loopback_handle *lhandle);
+	int (*setparams)(struct loopback_handle *lhandle,
+			 snd_pcm_uframes_t bufsize);
+	void (*start)(struct loopback_handle *lhandle);
+	int (*poll_descriptors_count)(struct loopback_handle *lhandle);
+	int (*poll_descriptors)(struct loopback_handle *lhandle,
+				struct pollfd *pfds, unsigned int count);
+	int (*poll_descriptors_revents)(struct loopback_handle *lhandle,
+					struct pollfd *pfds, unsigned int count,
+					unsigned short *revents);
+	snd_pcm_sframes_t (*avail)(struct loopback_handle *lhandle);
+	snd_pcm_sframes_t (*delay)(struct loopback_handle *lhandle);
+	snd_pcm_sframes_t (*read)(struct loopback_handle *lhandle, void *buf,
+				  snd_pcm_uframes_t frames);
+	snd_pcm_sframes_t (*write)(struct loopback_handle *lhandle,
+				   const void *buf, snd_pcm_uframes_t frames);
+	void (*state)(struct loopback_handle *lhandle, snd_output_t *out);
+};
+
+/* negotiated hw parameters, reused when the stream is restarted */
+struct loopback_hwcache {
+	/* requested */
+	snd_pcm_access_t access;
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int rate_req;
+	unsigned int resample;
+	snd_pcm_uframes_t bufsize;
+	unsigned int buffer_size_req;
+	unsigned int period_size_req;
+	/* result */
+	snd_pcm_hw_params_t *params;
+	snd_pcm_access_t access_set;
+	unsigned int rate;
+	double pitch;
+	unsigned int buffer_size;
+	unsigned int period_size;
+	struct loopback_hwcache *next;
+};
+
+struct loopback_route {
+	unsigned int channels;		/* playback channels */
+	unsigned int capt_channels;	/* referenced capture channels */
+	unsigned int sparse:1;		/* one source with unity gain */
+	unsigned int native:1;		/* sparse copy without conversion */
+	int *select;			/* capture channel or -1 (sparse) */
+	float *matrix;			/* gains, capt_channels x channels */
+	float *in, *out;		/* ROUTE_BLOCK frames */
+	unsigned char silence[8];	/* playback silence pattern */
+};
+
 struct loopback_handle {
 	struct loopback *loopback;
 	char *device;
@@ -88,6 +207,8 @@ struct loopback_handle {
 	char *id;
 	int card_number;
 	snd_pcm_t *handle;
+	const struct loopback_endpoint_ops *ep;	/* instead of the PCM */
+	void *ep_data;
 	snd_pcm_access_t access;
 	snd_pcm_format_t format;
 	unsigned int rate;
@@ -103,19 +224,39 @@ struct loopback_handle {
 	unsigned int nblock:1;		/* do block (period size) transfers */
 	unsigned int xrun_pending:1;
 	unsigned int pollfd_count;
+	struct loopback_hwcache *hwcache;
+	struct loopback_hwcache *hwconfig; /* installed in the device */
+	struct loopback_tap *tap;	/* recording of the transfers */
+	/* status snapshot, taken once per pass */
+	snd_pcm_status_t *status;
+	unsigned int status_valid:1;
+	snd_pcm_state_t status_state;
+	snd_pcm_sframes_t status_avail;	/* less the frames transferred since */
+	snd_pcm_sframes_t status_delay;	/* moved by the frames transferred */
+	/* device queries, see the state dump */
+	unsigned long long status_calls;
+	unsigned long long avail_calls;
+	unsigned long long delay_calls;
+	unsigned long long state_calls;
 	/* I/O job */
 	char *buf;			/* I/O buffer */
+	size_t buf_bytes;		/* allocated size of buf */
 	snd_pcm_uframes_t buf_pos;	/* I/O position */
 	snd_pcm_uframes_t buf_count;	/* filled samples */
 	snd_pcm_uframes_t buf_size;	/* buffer size in frames */
 	snd_pcm_uframes_t buf_over;	/* capture buffer overflow */
+	snd_pcm_sframes_t queued;	/* device frames after the last write */
+	/* devices shared by more loops (fan-out and mixing) */
+	struct loopback_handle *source;	/* handle owning the device */
+	struct loopback_handle *fanout;	/* next reader of the same capture */
+	snd_pcm_uframes_t fanout_new;	/* frames added since the last read */
+	struct loopback_handle *mix;	/* next input mixed to this playback */
+	float mix_gain;
 	/* statistics */
 	snd_pcm_uframes_t max;
 	unsigned long long counter;
-	unsigned long sync_point;	/* in samples */
-	snd_pcm_sframes_t last_delay;
+	unsigned long long xruns;
 	double pitch;
-	snd_pcm_uframes_t total_queued;
 	/* control */
 	snd_ctl_t *ctl;
 	unsigned int ctl_pollfd_count;
@@ -134,28 +275,67 @@ struct loopback {
 	snd_pcm_uframes_t latency;	/* final latency in frames */
 	unsigned int latency_req;	/* in frames */
 	unsigned int latency_reqtime;	/* in us */
+	unsigned int latency_mintime;	/* adaptive latency range in us, */
+	unsigned int latency_maxtime;	/* 0 = fixed latency */
+	snd_pcm_uframes_t latency_room;	/* hw buffer for the highest latency */
 	unsigned long loop_time;	/* ~0 = unlimited (in seconds) */
 	unsigned long long loop_limit;	/* ~0 = unlimited (in frames) */
 	snd_output_t *output;
 	snd_output_t *state;
 	int pollfd_count;
 	int active_pollfd_count;
+	struct pollfd *pollfds;		/* registered poll descriptors */
+	unsigned int pollfds_changed:1;	/* descriptors must be registered again */
+	unsigned int pollfds_ready:1;	/* events are pending in pollfds */
 	unsigned int linked:1;		/* linked streams */
 	unsigned int reinit:1;
+	unsigned int restart:1;		/* partial reinit in progress */
 	unsigned int running:1;
 	unsigned int stop_pending:1;
+	unsigned int zerocopy:1;	/* direct mmap transfers */
 	snd_pcm_uframes_t stop_count;
 	sync_type_t sync;		/* type of sync */
 	slave_type_t slave;
 	int thread;			/* thread number */
 	unsigned int wake;
+	unsigned long long deadline;	/* next service in us (monotonic) */
 	/* statistics */
+	struct alsaloop_stats *stats;	/* shared memory block */
+	unsigned long long wakes;	/* processing passes */
+	unsigned int balance:1;		/* measured for the worker pool */
+	unsigned long long proc_time;	/* processing time in us */
+	unsigned long long proc_time_last; /* seen by the balancer */
+	double proc_load;		/* part of the real time */
+	unsigned long long period_time;	/* playback period in us, 0 = stopped */
 	double pitch;
 	double pitch_delta;
 	snd_pcm_sframes_t pitch_diff;
 	snd_pcm_sframes_t pitch_diff_min;
 	snd_pcm_sframes_t pitch_diff_max;
-	unsigned int total_queued_count;
+	/* drift controller */
+	double sync_bw;			/* loop bandwidth in Hz */
+	double sync_error;		/* filtered latency error in frames */
+	double sync_integral;		/* integral term of the pitch */
+	double sync_time;		/* last measurement in seconds */
+	double sync_pitch;		/* last applied pitch */
+	/* adaptive latency */
+	snd_pcm_uframes_t adapt_target;	/* latency goal in frames */
+	double adapt_latency;		/* ramped towards the goal */
+	unsigned long long adapt_time;	/* last change or event in us */
+	unsigned long long adapt_ramp;	/* last ramp step in us */
+	snd_pcm_sframes_t adapt_pdelay;	/* lowest playback queue of the pass */
+	unsigned int adapt_near:1;	/* the last pass was a near miss */
+	unsigned int adapt_nearcount;	/* near misses since the last change */
+	unsigned long long adapt_nearmisses;
+	unsigned long long adapt_changes;
+	/* silence detection */
+	unsigned int idle_hold;		/* ms of silence to stop the playback, 0 = off */
+	float idle_level;		/* silence peak, 0 = digital silence */
+	unsigned int idle:1;		/* the playback is stopped */
+	unsigned long long idle_signal;	/* last captured signal in us */
+	unsigned long long idle_start;	/* in us */
+	unsigned long long idle_time;	/* total time stopped in us */
+	unsigned long long idle_count;	/* stops */
 	snd_timestamp_t tstamp_start;
 	snd_timestamp_t tstamp_end;
 	/* xrun profiling */
@@ -175,6 +355,21 @@ struct loopback {
 	/* control mixer */
 	struct loopback_mixer *controls;
 	struct loopback_ossmixer *oss_controls;
+	/* effect chain */
+	struct loopback_effect *effects;
+	float *effect_buf;		/* EFFECT_BLOCK frames */
+	/* software volume */
+	struct loopback_volume *volume;
+	/* channel routing */
+	struct loopback_route *route;
+	/* float pipeline */
+	unsigned int float_req:1;	/* -D was given */
+	unsigned int float_pipe:1;	/* one conversion at each end */
+	int dither_type;		/* DITHER_* */
+	struct loopback_dither dither;	/* type is DITHER_NONE when unused */
+	float *float_in;		/* EFFECT_BLOCK capture frames */
+	float *float_out;		/* EFFECT_BLOCK playback frames */
+	float *float_mix;		/* EFFECT_BLOCK playback frames */
 	/* sample rate */
 	unsigned int use_samplerate:1;
 #ifdef USE_SAMPLERATE
@@ -184,12 +379,6 @@ struct loopback {
 	SRC_DATA src_data;
 	unsigned int src_out_frames;
 #endif
-#ifdef FILE_CWRITE
-	FILE *cfile;
-#endif
-#ifdef FILE_PWRITE
-	FILE *pfile;
-#endif
 };
 
 extern int verbose;
@@ -211,6 +400,69 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds);
 int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds);
 void pcmjob_state(struct loopback *loop);
 
+const char *effect_names(void);
+int effect_add(struct loopback *loop, const char *spec);
+int effect_init(struct loopback *loop);
+void effect_done(struct loopback *loop);
+void effect_process(struct loopback *loop, float *buf,
+		    snd_pcm_uframes_t frames);
+void effect_state(struct loopback *loop, snd_output_t *out);
+int biquad_init(struct loopback_biquad *bq, unsigned int channels);
+void biquad_free(struct loopback_biquad *bq);
+void biquad_process(struct loopback_biquad *bq, float *buf,
+		    snd_pcm_uframes_t frames);
+
+extern const struct loopback_effect_ops effect_sweep;
+extern const struct loopback_effect_ops effect_gain;
+extern const struct loopback_effect_ops effect_eq;
+extern const struct loopback_effect_ops effect_limit;
+
+int dither_parse(const char *arg);
+const char *dither_name(int type);
+int dither_init(struct loopback_dither *d, int type, snd_pcm_format_t format,
+		unsigned int channels);
+void dither_free(struct loopback_dither *d);
+void dither_process(struct loopback_dither *d, const float *src, void *dst,
+		    snd_pcm_uframes_t frames);
+
+int volume_parse(const char *arg, struct loopback_volume **volume);
+void volume_free(struct loopback_volume *g);
+int volume_init(struct loopback *loop);
+void volume_done(struct loopback *loop);
+int volume_start(struct loopback *loop);
+void volume_stop(struct loopback *loop);
+int volume_event(struct loopback *loop, snd_ctl_t *ctl, snd_ctl_event_t *ev);
+void volume_process(struct loopback_volume *g, float *buf,
+		  snd_pcm_uframes_t frames);
+void volume_state(struct loopback *loop, snd_output_t *out);
+
+int route_parse(const char *spec, struct loopback_route **route);
+void route_free(struct loopback_route *route);
+int route_init(struct loopback_route *route,
+	       struct loopback_handle *capt,
+	       struct loopback_handle *play);
+void route_done(struct loopback_route *route);
+void route_select(struct loopback_route *route, const void *src,
+		  unsigned int src_channels, void *dst,
+		  snd_pcm_uframes_t frames, unsigned int width);
+void route_float(struct loopback_route *route, const float *src,
+		 unsigned int src_channels, float *dst,
+		 snd_pcm_uframes_t frames);
+
+extern const struct loopback_endpoint_ops endpoint_udp;
+extern const struct loopback_endpoint_ops endpoint_shm;
+
+int stats_open(const char *name, struct loopback **loops, int count);
+void stats_close(void);
+void stats_update(struct loopback *loop);
+
+int tap_add(struct loopback_handle *lhandle, const char *arg);
+void tap_push(struct loopback_tap *tap, struct loopback_handle *lhandle,
+	      const char *buf, snd_pcm_uframes_t frames);
+void tap_dump(struct loopback_tap *tap, snd_output_t *out);
+int tap_start(void);
+void tap_close(void);
+
 int control_parse_id(const char *str, snd_ctl_elem_id_t *id);
 int control_id_match(snd_ctl_elem_id_t *id1, snd_ctl_elem_id_t *id2);
 int control_init(struct loopback *loop);
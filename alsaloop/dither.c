@@ -0,0 +1,183 @@
+/*
+ *  A simple PCM loopback utility
+ *  Dithered conversion of the float pipeline to the playback format
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The TPDF dither is the sum of two uniform random values of one LSB
+ * each, which makes the quantization error independent of the signal.
+ * The shaped dither adds a second order error feedback: the total error
+ * is filtered with (1 - z^-1)^2, so the noise below a sixth of the rate
+ * is lowered and the noise near the Nyquist frequency is raised.
+ *
+ * The error is taken before the clipping, so a clipped sample does not
+ * feed a large error back and the filter stays stable.
+ *
+ * The computation is in double: near the full scale of the 24-bit
+ * formats a float resolves only about one LSB, which would quantize
+ * the dither and the error feedback away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+static const char *dither_types[] = {
+	[DITHER_NONE] = "none",
+	[DITHER_TPDF] = "tpdf",
+	[DITHER_SHAPED] = "shaped",
+};
+
+int dither_parse(const char *arg)
+{
+	unsigned int i;
+
+	if (arg == NULL)
+		return DITHER_SHAPED;
+	for (i = 0; i < sizeof(dither_types) / sizeof(dither_types[0]); i++)
+		if (strcasecmp(arg, dither_types[i]) == 0)
+			return i;
+	logit(LOG_CRIT, "Unknown dither '%s' (known: none, tpdf, shaped)\n", arg);
+	return -EINVAL;
+}
+
+const char *dither_name(int type)
+{
+	return dither_types[type];
+}
+
+/*
+ * Returns -EINVAL for the formats which do not need the dither (32-bit
+ * and float), the caller converts them without it.
+ */
+int dither_init(struct loopback_dither *d, int type, snd_pcm_format_t format,
+		unsigned int channels)
+{
+	double *state;
+
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		d->scale = 0x8000;
+		break;
+	case SND_PCM_FORMAT_S24:
+	case SND_PCM_FORMAT_S24_3LE:
+		d->scale = 0x800000;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (type == DITHER_NONE)
+		return -EINVAL;
+	state = calloc(2 * channels, sizeof(double));
+	if (state == NULL)
+		return -ENOMEM;
+	d->type = type;
+	d->format = format;
+	d->channels = channels;
+	d->max = d->scale - 1;
+	d->min = -d->scale;
+	d->seed = 22222;
+	d->e1 = state;
+	d->e2 = state + channels;
+	d->clipped = 0;
+	return 0;
+}
+
+void dither_free(struct loopback_dither *d)
+{
+	free(d->e1);
+	d->e1 = d->e2 = NULL;
+	d->type = DITHER_NONE;
+}
+
+/* uniform in [-0.5, 0.5) */
+static inline double dither_rand(unsigned int *seed)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return (int32_t)*seed * (1.0 / 4294967296.0);
+}
+
+static inline int32_t dither_sample(struct loopback_dither *d,
+				    unsigned int c, float x)
+{
+	double v, q;
+
+	v = x * d->scale;
+	if (d->type == DITHER_SHAPED)
+		v += -2.0 * d->e1[c] + d->e2[c];
+	q = rint(v + dither_rand(&d->seed) + dither_rand(&d->seed));
+	d->e2[c] = d->e1[c];
+	d->e1[c] = q - v;
+	if (q > d->max) {
+		q = d->max;
+		d->clipped++;
+	} else if (q < d->min) {
+		q = d->min;
+		d->clipped++;
+	}
+	return (int32_t)q;
+}
+
+/* one pass over the interleaved frames, the feedback is per channel */
+void dither_process(struct loopback_dither *d, const float *src, void *dst,
+		    snd_pcm_uframes_t frames)
+{
+	const unsigned int channels = d->channels;
+	snd_pcm_uframes_t i;
+	unsigned int c;
+	int32_t x;
+
+	switch (d->format) {
+	case SND_PCM_FORMAT_S16: {
+		int16_t *p = dst;
+
+		for (i = 0; i < frames; i++)
+			for (c = 0; c < channels; c++)
+				*p++ = dither_sample(d, c, *src++);
+		break;
+	}
+	case SND_PCM_FORMAT_S24: {
+		int32_t *p = dst;
+
+		for (i = 0; i < frames; i++)
+			for (c = 0; c < channels; c++)
+				*p++ = dither_sample(d, c, *src++);
+		break;
+	}
+	case SND_PCM_FORMAT_S24_3LE: {
+		uint8_t *p = dst;
+
+		for (i = 0; i < frames; i++)
+			for (c = 0; c < channels; c++, p += 3) {
+				x = dither_sample(d, c, *src++);
+				p[0] = x;
+				p[1] = x >> 8;
+				p[2] = x >> 16;
+			}
+		break;
+	}
+	default:
+		break;
+	}
+}
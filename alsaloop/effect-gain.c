@@ -0,0 +1,222 @@
+/*
+ *  A simple PCM loopback utility
+ *  Gain, equalizer and limiter effects
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+static inline float db_to_gain(float db)
+{
+	return pow(10.0, db / 20.0);
+}
+
+/*
+ * gain - GAIN in dB
+ */
+
+struct gain_private {
+	float gain;
+};
+
+static int gain_parse(struct loopback_effect *effect, const char *args)
+{
+	struct gain_private *priv = effect->private_data;
+	float db = 0;
+
+	if (args && sscanf(args, "%f", &db) != 1)
+		return -EINVAL;
+	if (db < -120 || db > 60)
+		return -EINVAL;
+	priv->gain = db_to_gain(db);
+	return 0;
+}
+
+static int gain_init(struct loopback_effect *effect)
+{
+	return 0;
+}
+
+static void gain_process(struct loopback_effect *effect, float *buf,
+			 snd_pcm_uframes_t frames)
+{
+	struct gain_private *priv = effect->private_data;
+	const float gain = priv->gain;
+	snd_pcm_uframes_t i, count = frames * effect->channels;
+
+	for (i = 0; i < count; i++)
+		buf[i] *= gain;
+}
+
+const struct loopback_effect_ops effect_gain = {
+	.name = "gain",
+	.private_size = sizeof(struct gain_private),
+	.parse = gain_parse,
+	.init = gain_init,
+	.process = gain_process,
+};
+
+/*
+ * eq - peaking equalizer FREQ:GAIN:Q (Hz, dB)
+ */
+
+struct eq_private {
+	float freq, db, q;
+	struct loopback_biquad bq;
+};
+
+static int eq_parse(struct loopback_effect *effect, const char *args)
+{
+	struct eq_private *priv = effect->private_data;
+
+	priv->freq = 1000;
+	priv->db = 0;
+	priv->q = 0.7071;
+	if (args && sscanf(args, "%f:%f:%f", &priv->freq, &priv->db,
+			   &priv->q) < 1)
+		return -EINVAL;
+	if (priv->freq <= 0 || priv->q <= 0 || fabs(priv->db) > 40)
+		return -EINVAL;
+	return 0;
+}
+
+static int eq_init(struct loopback_effect *effect)
+{
+	struct eq_private *priv = effect->private_data;
+	struct loopback_biquad *bq = &priv->bq;
+	double A, w0, alpha, c, n;
+	int err;
+
+	if (priv->freq >= effect->rate / 2.0)
+		return -EINVAL;
+	err = biquad_init(bq, effect->channels);
+	if (err < 0)
+		return err;
+	A = pow(10.0, priv->db / 40.0);
+	w0 = 2 * M_PI * priv->freq / effect->rate;
+	alpha = sin(w0) / (2 * priv->q);
+	c = cos(w0);
+	n = 1 + alpha / A;
+	bq->a0 = (1 + alpha * A) / n;
+	bq->a1 = -2 * c / n;
+	bq->a2 = (1 - alpha * A) / n;
+	bq->b1 = -2 * c / n;
+	bq->b2 = (1 - alpha / A) / n;
+	return 0;
+}
+
+static void eq_process(struct loopback_effect *effect, float *buf,
+		       snd_pcm_uframes_t frames)
+{
+	struct eq_private *priv = effect->private_data;
+
+	biquad_process(&priv->bq, buf, frames);
+}
+
+static void eq_done(struct loopback_effect *effect)
+{
+	struct eq_private *priv = effect->private_data;
+
+	biquad_free(&priv->bq);
+}
+
+const struct loopback_effect_ops effect_eq = {
+	.name = "eq",
+	.private_size = sizeof(struct eq_private),
+	.parse = eq_parse,
+	.init = eq_init,
+	.process = eq_process,
+	.done = eq_done,
+};
+
+/*
+ * limit - peak limiter THRESHOLD[:RELEASE] (dB, ms)
+ *
+ * All channels share one envelope which follows the peaks immediately
+ * and decays with the release time, so the output never exceeds
+ * the threshold and the stereo image is kept.
+ */
+
+struct limit_private {
+	float threshold;
+	float release_ms;
+	float release;		/* envelope decay per frame */
+	float env;
+};
+
+static int limit_parse(struct loopback_effect *effect, const char *args)
+{
+	struct limit_private *priv = effect->private_data;
+	float db = -1;
+
+	priv->release_ms = 50;
+	if (args && sscanf(args, "%f:%f", &db, &priv->release_ms) < 1)
+		return -EINVAL;
+	if (db > 0 || db < -60 || priv->release_ms <= 0)
+		return -EINVAL;
+	priv->threshold = db_to_gain(db);
+	return 0;
+}
+
+static int limit_init(struct loopback_effect *effect)
+{
+	struct limit_private *priv = effect->private_data;
+
+	priv->release = exp(-1000.0 / (priv->release_ms * effect->rate));
+	priv->env = 0;
+	return 0;
+}
+
+static void limit_process(struct loopback_effect *effect, float *buf,
+			  snd_pcm_uframes_t frames)
+{
+	struct limit_private *priv = effect->private_data;
+	const unsigned int channels = effect->channels;
+	const float threshold = priv->threshold;
+	const float release = priv->release;
+	float env = priv->env, peak, gain;
+	snd_pcm_uframes_t i;
+	unsigned int c;
+
+	for (i = 0; i < frames; i++, buf += channels) {
+		peak = 0;
+		for (c = 0; c < channels; c++)
+			peak = fmaxf(peak, fabsf(buf[c]));
+		if (peak >= env)
+			env = peak;
+		else
+			env = peak + (env - peak) * release;
+		if (env <= threshold)
+			continue;
+		gain = threshold / env;
+		for (c = 0; c < channels; c++)
+			buf[c] *= gain;
+	}
+	priv->env = env;
+}
+
+const struct loopback_effect_ops effect_limit = {
+	.name = "limit",
+	.private_size = sizeof(struct limit_private),
+	.parse = limit_parse,
+	.init = limit_init,
+	.process = limit_process,
+};
@@ -18,111 +18,93 @@
  *
  */
 
+#include <stdio.h>
+#include <errno.h>
 #include <math.h>
 #include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+/* the filter coefficients are updated once per block */
+#define SWEEP_BLOCK	32
 
 struct effect_private {
+	/* parameters */
+	float lfo_center, lfo_depth, lfo_freq, BW;
 	/* filter the sweep variables */
-	float lfo,dlfo,fs,fc,BW,C,D,a0,a1,a2,b1,b2,*x[3],*y[3];
-	float lfo_depth, lfo_center;
-	unsigned int channels;
+	double lfo, dlfo, fs;
+	struct loopback_biquad bq;
 };
 
-static int effect_init(struct lookback *loopback,
-		       void *private_data,
-		       snd_pcm_access_t access,
-		       unsigned int channels,
-		       unsigned int rate,
-		       snd_pcm_format_t format)
+/* CENTER:DEPTH:LFO_FREQ:BANDWIDTH, all in Hz */
+static int sweep_parse(struct loopback_effect *effect, const char *args)
 {
-	struct effect_private *priv = private_data;
-	int i;
+	struct effect_private *priv = effect->private_data;
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-	if (format != SND_PCM_FORMAT_S16_LE)
-		return -EIO;
-#elif __BYTE_ORDER == __BIG_ENDIAN
-	if (format != SND_PCM_FORMAT_S16_BE)
-		return -EIO;
-#else
-	return -EIO;
-#endif
-	priv->fs = (float) rate;
-	priv->channels = channels;
-	for (i = 0; i < 3; i++) {
-		priv->x[i] = calloc(channels * sizeof(float));
-		priv->y[i] = calloc(channels * sizeof(float));
-	}
+	priv->lfo_center = 2000.;
+	priv->lfo_depth = 1800.;
+	priv->lfo_freq = 0.2;
+	priv->BW = 50;
+	if (args && sscanf(args, "%f:%f:%f:%f", &priv->lfo_center,
+			   &priv->lfo_depth, &priv->lfo_freq, &priv->BW) < 1)
+		return -EINVAL;
+	if (priv->lfo_depth < 0 || priv->lfo_center - priv->lfo_depth <= 0 ||
+	    priv->lfo_freq <= 0 || priv->BW <= 0)
+		return -EINVAL;
 	return 0;
 }
 
-static int effect_done(struct loopback *loopback,
-		       void *private_data)
+static int sweep_init(struct loopback_effect *effect)
 {
-	struct effect_private *priv = private_data;
-	int i;
+	struct effect_private *priv = effect->private_data;
 
-	for (i = 0; i < 3; i++) {
-		free(priv->x[i]);
-		free(priv->y[i]);
-	}
-	return 0;
+	priv->fs = effect->rate;
+	if (priv->lfo_center + priv->lfo_depth >= priv->fs / 2 ||
+	    priv->BW >= priv->fs / 2)
+		return -EINVAL;
+	priv->lfo = 0;
+	priv->dlfo = 2. * M_PI * priv->lfo_freq / priv->fs;
+	return biquad_init(&priv->bq, effect->channels);
 }
 
-static int effect_apply(struct loopback *loopback,
-			void *private_data,
-			const snd_pcm_channel_area_t *areas,
-			snd_uframes_t offset,
-			snd_uframes_t frames)
+static void sweep_process(struct loopback_effect *effect, float *buf,
+			  snd_pcm_uframes_t frames)
 {
-	struct effect_private *priv = private_data;
-	short *samples = (short*)areas[0].addr + offset*priv->channels;
-	snd_uframes_t i;
-
-	for (i=0; i < frames; i++) {
-		int chn;
-
-		fc = sin(priv->lfo)*priv->lfo_depth+priv->lfo_center;
-		priv->lfo += priv->dlfo;
-		if (priv->lfo>2.*M_PI) priv->lfo -= 2.*M_PI;
-		priv->C = 1./tan(M_PI*priv->BW/priv->fs);
-		priv->D = 2.*cos(2*M_PI*fc/fs);
-		priv->a0 = 1./(1.+priv->C);
-		priv->a1 = 0;
-		priv->a2 = -priv->a0;
-		priv->b1 = -priv->C*priv->D*a0;
-		priv->b2 = (priv->C-1)*priv->a0;
+	struct effect_private *priv = effect->private_data;
+	struct loopback_biquad *bq = &priv->bq;
+	snd_pcm_uframes_t count;
+	double fc, C, D;
 
-		for (chn=0; chn < priv->channels; chn++)
-		{
-			priv->x[chn][2] = priv->x[chn][1];
-			priv->x[chn][1] = priv->x[chn][0];
-
-			priv->y[chn][2] = priv->y[chn][1];
-			priv->y[chn][1] = priv->y[chn][0];
-
-			priv->x[chn][0] = samples[i*channels+chn];
-			priv->y[chn][0] = priv->a0*priv->x[0][chn]
-				+ priv->a1*priv->x[1][chn] + priv->a2*x[2][chn]
-				- priv->b1*priv->y[1][chn] - priv->b2*y[2][chn];
-			samples[i*channels+chn] = priv->y[chn][0];
-		}
+	while (frames > 0) {
+		count = frames > SWEEP_BLOCK ? SWEEP_BLOCK : frames;
+		fc = sin(priv->lfo) * priv->lfo_depth + priv->lfo_center;
+		C = 1. / tan(M_PI * priv->BW / priv->fs);
+		D = 2. * cos(2 * M_PI * fc / priv->fs);
+		bq->a0 = 1. / (1. + C);
+		bq->a1 = 0;
+		bq->a2 = -bq->a0;
+		bq->b1 = -C * D * bq->a0;
+		bq->b2 = (C - 1) * bq->a0;
+		biquad_process(bq, buf, count);
+		priv->lfo += priv->dlfo * count;
+		if (priv->lfo > 2. * M_PI)
+			priv->lfo -= 2. * M_PI;
+		buf += count * effect->channels;
+		frames -= count;
 	}
-	return 0;
 }
 
-void effect_init_sweep(void)
+static void sweep_done(struct loopback_effect *effect)
 {
-	struct effect_private *priv;
+	struct effect_private *priv = effect->private_data;
 
-	priv = register_effect(effect_init,
-			       effect_apply,
-			       effect_done,
-			       sizeof(struct effectprivate));
-	if (priv) {
-		priv->lfo_center = 2000.;
-		priv->lfo_depth = 1800.;
-		priv->lfo_freq = 0.2;
-		priv->BW = 50;
-	}
+	biquad_free(&priv->bq);
 }
+
+const struct loopback_effect_ops effect_sweep = {
+	.name = "sweep",
+	.private_size = sizeof(struct effect_private),
+	.parse = sweep_parse,
+	.init = sweep_init,
+	.process = sweep_process,
+	.done = sweep_done,
+};
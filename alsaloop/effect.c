@@ -0,0 +1,243 @@
+/*
+ *  A simple PCM loopback utility
+ *  Effect chain
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+static const struct loopback_effect_ops *effect_ops[] = {
+	&effect_sweep,
+	&effect_gain,
+	&effect_eq,
+	&effect_limit,
+	NULL
+};
+
+const char *effect_names(void)
+{
+	static char names[64];
+	const struct loopback_effect_ops **ops;
+
+	if (names[0])
+		return names;
+	for (ops = effect_ops; *ops; ops++) {
+		if (ops != effect_ops)
+			strcat(names, ",");
+		strcat(names, (*ops)->name);
+	}
+	return names;
+}
+
+/*
+ * The specification is NAME[:PARAMS]. The parameters are checked here,
+ * so a wrong command line is refused before any device is opened.
+ */
+int effect_add(struct loopback *loop, const char *spec)
+{
+	const struct loopback_effect_ops **ops;
+	struct loopback_effect *effect, **last;
+	const char *args = strchr(spec, ':');
+	size_t len = args ? (size_t)(args - spec) : strlen(spec);
+	int err;
+
+	for (ops = effect_ops; *ops; ops++)
+		if (strlen((*ops)->name) == len &&
+		    strncasecmp((*ops)->name, spec, len) == 0)
+			break;
+	if (*ops == NULL) {
+		logit(LOG_CRIT, "Unknown effect '%s' (known: %s)\n", spec, effect_names());
+		return -EINVAL;
+	}
+	effect = calloc(1, sizeof(*effect));
+	if (effect == NULL)
+		return -ENOMEM;
+	effect->ops = *ops;
+	if ((*ops)->private_size) {
+		effect->private_data = calloc(1, (*ops)->private_size);
+		if (effect->private_data == NULL) {
+			free(effect);
+			return -ENOMEM;
+		}
+	}
+	err = (*ops)->parse(effect, args ? args + 1 : NULL);
+	if (err < 0) {
+		logit(LOG_CRIT, "Wrong parameters for effect '%s'\n", spec);
+		free(effect->private_data);
+		free(effect);
+		return err;
+	}
+	for (last = &loop->effects; *last; last = &(*last)->next)
+		;
+	*last = effect;
+	return 0;
+}
+
+/* called from pcmjob_start() when the playback parameters are known */
+int effect_init(struct loopback *loop)
+{
+	struct loopback_effect *effect;
+	int err;
+
+	loop->effect_buf = malloc(EFFECT_BLOCK * loop->play->channels *
+				  sizeof(float));
+	if (loop->effect_buf == NULL)
+		return -ENOMEM;
+	for (effect = loop->effects; effect; effect = effect->next) {
+		effect->channels = loop->play->channels;
+		effect->rate = loop->play->rate;
+		err = effect->ops->init(effect);
+		if (err < 0) {
+			logit(LOG_CRIT, "%s: effect %s init error: %s\n", loop->id, effect->ops->name, snd_strerror(err));
+			effect_done(loop);
+			return err;
+		}
+		effect->active = 1;
+	}
+	return 0;
+}
+
+void effect_done(struct loopback *loop)
+{
+	struct loopback_effect *effect;
+
+	for (effect = loop->effects; effect; effect = effect->next) {
+		if (effect->active && effect->ops->done)
+			effect->ops->done(effect);
+		effect->active = 0;
+	}
+	free(loop->effect_buf);
+	loop->effect_buf = NULL;
+}
+
+static inline unsigned long long effect_clock(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+/* run all stages on one block of at most EFFECT_BLOCK frames */
+void effect_process(struct loopback *loop, float *buf,
+		    snd_pcm_uframes_t frames)
+{
+	struct loopback_effect *effect;
+	unsigned long long t1, t2;
+
+	t1 = effect_clock();
+	for (effect = loop->effects; effect; effect = effect->next) {
+		effect->ops->process(effect, buf, frames);
+		t2 = effect_clock();
+		effect->nsec += t2 - t1;
+		effect->frames += frames;
+		t1 = t2;
+	}
+}
+
+void effect_state(struct loopback *loop, snd_output_t *out)
+{
+	struct loopback_effect *effect;
+	double real;
+
+	for (effect = loop->effects; effect; effect = effect->next) {
+		if (effect->frames == 0 || effect->rate == 0) {
+			snd_output_printf(out, "  effect %s: idle\n", effect->ops->name);
+			continue;
+		}
+		/* processing time relative to the real time of the frames */
+		real = (double)effect->frames * 1e9 / effect->rate;
+		snd_output_printf(out, "  effect %s: frames = %llu, %.1fns/frame, load = %.3f%%\n",
+			effect->ops->name, effect->frames,
+			(double)effect->nsec / effect->frames,
+			(double)effect->nsec * 100.0 / real);
+	}
+}
+
+int biquad_init(struct loopback_biquad *bq, unsigned int channels)
+{
+	float *state = calloc(4 * channels, sizeof(float));
+
+	if (state == NULL)
+		return -ENOMEM;
+	bq->channels = channels;
+	bq->x1 = state;
+	bq->x2 = state + channels;
+	bq->y1 = state + 2 * channels;
+	bq->y2 = state + 3 * channels;
+	return 0;
+}
+
+void biquad_free(struct loopback_biquad *bq)
+{
+	free(bq->x1);
+	bq->x1 = bq->x2 = bq->y1 = bq->y2 = NULL;
+}
+
+/*
+ * Direct form I on interleaved frames. The state is kept per channel
+ * in separate arrays and the coefficients are shared by the channels.
+ * The recursion runs along the frames, so the filter is computed one
+ * sample after another.
+ */
+void biquad_process(struct loopback_biquad *bq, float *buf,
+		    snd_pcm_uframes_t frames)
+{
+	const unsigned int channels = bq->channels;
+	const float a0 = bq->a0, a1 = bq->a1, a2 = bq->a2;
+	const float b1 = bq->b1, b2 = bq->b2;
+	float *x1 = bq->x1, *x2 = bq->x2, *y1 = bq->y1, *y2 = bq->y2;
+	snd_pcm_uframes_t i;
+	unsigned int c;
+	float x0, y0;
+
+	for (i = 0; i < frames; i++, buf += channels) {
+		for (c = 0; c < channels; c++) {
+			x0 = buf[c];
+			y0 = a0 * x0 + a1 * x1[c] + a2 * x2[c]
+			     - b1 * y1[c] - b2 * y2[c];
+			x2[c] = x1[c];
+			x1[c] = x0;
+			y2[c] = y1[c];
+			y1[c] = y0;
+			buf[c] = y0;
+		}
+	}
+	/* do not let the feedback decay into denormals */
+	for (c = 0; c < channels; c++) {
+		if (fabsf(y1[c]) < 1e-20f)
+			y1[c] = 0;
+		if (fabsf(y2[c]) < 1e-20f)
+			y2[c] = 0;
+	}
+}
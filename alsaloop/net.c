@@ -0,0 +1,510 @@
+/*
+ *  A simple PCM loopback utility
+ *  Network endpoint (UDP with RTP style packets)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define NET_PREFIX		"udp:"
+#define NET_HEADER		12	/* RTP fixed header */
+#define NET_PAYLOAD		1400	/* stay below the usual MTU */
+#define NET_PACKET_MAX		65536
+#define NET_PAYLOAD_TYPE	96	/* dynamic */
+
+struct loopback_net {
+	int fd;
+	int capture;
+	unsigned int frame_size;
+	unsigned int frames;		/* maximal frames per packet */
+	unsigned char *packet;
+	/* sender */
+	uint16_t seq;
+	uint32_t timestamp;
+	uint32_t ssrc;
+	/* receiver, the jitter buffer is indexed by the timestamps */
+	char *jb;
+	snd_pcm_uframes_t jb_size;	/* ring size in frames */
+	snd_pcm_uframes_t jb_pos;	/* read position */
+	snd_pcm_uframes_t jb_count;	/* up to the newest received frame */
+	uint32_t jb_ts;			/* timestamp at the read position */
+	uint32_t jb_ssrc;
+	uint16_t seq_next;
+	unsigned int synced:1;
+	double transit;			/* last arrival - timestamp (frames) */
+	double jitter;			/* RFC 3550 interarrival jitter */
+	double target;			/* frames held for late packets */
+	double target_min;
+	/* statistics */
+	unsigned long long packets;
+	unsigned long long lost;
+	unsigned long long late;
+	unsigned long long resyncs;
+	unsigned long long dropped;
+};
+
+static inline double net_clock(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+/*
+ * The device is udp:HOST:PORT. The capture side binds to the address
+ * (an empty host means all interfaces), the playback side sends to it.
+ */
+static int net_open(struct loopback_handle *lhandle)
+{
+	struct loopback_net *net;
+	struct addrinfo hints, *res = NULL;
+	char *host, *port;
+	int capture = lhandle == lhandle->loopback->capt;
+	int err;
+
+	host = strdup(lhandle->device + strlen(NET_PREFIX));
+	if (host == NULL)
+		return -ENOMEM;
+	port = strrchr(host, ':');
+	if (port == NULL || port[1] == '\0') {
+		logit(LOG_CRIT, "%s: wrong network address (use %sHOST:PORT)\n", lhandle->id, NET_PREFIX);
+		free(host);
+		return -EINVAL;
+	}
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host) - 1] = '\0';
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = capture ? AI_PASSIVE : 0;
+	err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+	free(host);
+	if (err) {
+		logit(LOG_CRIT, "%s: address error: %s\n", lhandle->id, gai_strerror(err));
+		return -EINVAL;
+	}
+	net = calloc(1, sizeof(*net));
+	if (net == NULL) {
+		freeaddrinfo(res);
+		return -ENOMEM;
+	}
+	net->capture = capture;
+	net->fd = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (net->fd < 0) {
+		err = -errno;
+		goto __error;
+	}
+	fcntl(net->fd, F_SETFL, fcntl(net->fd, F_GETFL) | O_NONBLOCK);
+	if (capture)
+		err = bind(net->fd, res->ai_addr, res->ai_addrlen);
+	else
+		err = connect(net->fd, res->ai_addr, res->ai_addrlen);
+	if (err < 0) {
+		err = -errno;
+		goto __error;
+	}
+	net->packet = malloc(NET_PACKET_MAX);
+	if (net->packet == NULL) {
+		err = -ENOMEM;
+		goto __error;
+	}
+	freeaddrinfo(res);
+	net->ssrc = getpid() ^ (uint32_t)(net_clock() * 1000000);
+	lhandle->ep_data = net;
+	lhandle->handle = NULL;
+	lhandle->card_number = -1;
+	lhandle->ctl = NULL;
+	return 0;
+      __error:
+	logit(LOG_CRIT, "%s: socket error: %s\n", lhandle->id, strerror(-err));
+	freeaddrinfo(res);
+	if (net->fd >= 0)
+		close(net->fd);
+	free(net);
+	return err;
+}
+
+static void net_close(struct loopback_handle *lhandle)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	if (net == NULL)
+		return;
+	close(net->fd);
+	free(net->packet);
+	free(net->jb);
+	free(net);
+	lhandle->ep_data = NULL;
+}
+
+/*
+ * There is no device to negotiate with. The samples are sent in the
+ * loop format, so both ends must use the same format, rate and channels.
+ */
+static int net_setparams(struct loopback_handle *lhandle,
+			 snd_pcm_uframes_t bufsize)
+{
+	struct loopback_net *net = lhandle->ep_data;
+	snd_pcm_uframes_t size;
+
+	net->frame_size = snd_pcm_format_physical_width(lhandle->format) / 8 *
+			  lhandle->channels;
+	if (net->frame_size == 0 || net->frame_size > NET_PAYLOAD) {
+		logit(LOG_CRIT, "%s: unsupported frame size\n", lhandle->id);
+		return -EINVAL;
+	}
+	lhandle->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	lhandle->rate = lhandle->rate_req;
+	lhandle->pitch = 1.0;
+	lhandle->buffer_size = bufsize;
+	lhandle->period_size = lhandle->period_size_req ?
+				lhandle->period_size_req : bufsize / 2;
+	if (lhandle->period_size == 0)
+		lhandle->period_size = 1;
+	lhandle->avail_min = lhandle->period_size;
+	net->frames = NET_PAYLOAD / net->frame_size;
+	if (net->frames > lhandle->period_size)
+		net->frames = lhandle->period_size;
+	if (!net->capture)
+		return 0;
+	/* one second, or more for long latencies */
+	size = lhandle->rate > bufsize * 4 ? lhandle->rate : bufsize * 4;
+	if (net->jb == NULL || net->jb_size != size) {
+		free(net->jb);
+		net->jb = malloc(size * net->frame_size);
+		if (net->jb == NULL)
+			return -ENOMEM;
+		net->jb_size = size;
+	}
+	net->target_min = lhandle->period_size;
+	return 0;
+}
+
+static void net_reset(struct loopback_handle *lhandle)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	snd_pcm_format_set_silence(lhandle->format, net->jb,
+				   net->jb_size * lhandle->channels);
+	net->jb_pos = 0;
+	net->jb_count = 0;
+	net->synced = 0;
+}
+
+/* the packets queued while the loop was stopped are stale */
+static void net_start(struct loopback_handle *lhandle)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	if (!net->capture)
+		return;
+	while (recv(net->fd, net->packet, NET_PACKET_MAX, 0) > 0)
+		;
+	net_reset(lhandle);
+	net->jitter = 0;
+	net->target = net->target_min;
+}
+
+static int net_poll_descriptors_count(struct loopback_handle *lhandle)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	/* sending never waits */
+	return net->capture ? 1 : 0;
+}
+
+static int net_poll_descriptors(struct loopback_handle *lhandle,
+				struct pollfd *pfds, unsigned int count)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	if (count < 1 || !net->capture)
+		return 0;
+	pfds->fd = net->fd;
+	pfds->events = POLLIN;
+	pfds->revents = 0;
+	return 1;
+}
+
+static int net_poll_descriptors_revents(struct loopback_handle *lhandle,
+					struct pollfd *pfds, unsigned int count,
+					unsigned short *revents)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	*revents = count > 0 && net->capture ? pfds->revents : 0;
+	return 0;
+}
+
+/* copy frames into the ring, the caller checks the size */
+static void jb_copy(struct loopback_net *net, snd_pcm_uframes_t pos,
+		    const unsigned char *src, snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t count1;
+
+	while (frames > 0) {
+		pos %= net->jb_size;
+		count1 = frames;
+		if (count1 + pos > net->jb_size)
+			count1 = net->jb_size - pos;
+		memcpy(net->jb + pos * net->frame_size, src,
+		       count1 * net->frame_size);
+		src += count1 * net->frame_size;
+		pos += count1;
+		frames -= count1;
+	}
+}
+
+/*
+ * The hold time (target) follows the interarrival jitter: it grows at
+ * once and shrinks slowly, so a single late packet does not make the
+ * buffer oscillate.
+ */
+static void net_jitter(struct loopback_handle *lhandle, uint32_t ts,
+		       snd_pcm_uframes_t frames)
+{
+	struct loopback_net *net = lhandle->ep_data;
+	double transit, d, target;
+
+	transit = net_clock() * lhandle->rate - ts;
+	if (net->packets > 1) {
+		d = fabs(transit - net->transit);
+		if (d < net->jb_size)
+			net->jitter += (d - net->jitter) / 16;
+	}
+	net->transit = transit;
+	target = frames + 4 * net->jitter;
+	if (target < net->target_min)
+		target = net->target_min;
+	if (target > net->jb_size / 2)
+		target = net->jb_size / 2;
+	if (target > net->target)
+		net->target = target;
+	else
+		net->target += (target - net->target) / 256;
+}
+
+static void net_packet(struct loopback_handle *lhandle, ssize_t size)
+{
+	struct loopback_net *net = lhandle->ep_data;
+	const unsigned char *p = net->packet;
+	snd_pcm_uframes_t frames;
+	uint32_t ts, ssrc;
+	uint16_t seq;
+	int16_t dseq;
+	int32_t offset;
+	unsigned int csrc;
+
+	if (size < NET_HEADER || (p[0] & 0xc0) != 0x80)
+		return;
+	csrc = (p[0] & 0x0f) * 4;
+	if (size < NET_HEADER + csrc)
+		return;
+	size -= NET_HEADER + csrc;
+	if (size % net->frame_size)
+		return;		/* other format */
+	frames = size / net->frame_size;
+	seq = (p[2] << 8) | p[3];
+	ts = ((uint32_t)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+	ssrc = ((uint32_t)p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11];
+	p += NET_HEADER + csrc;
+	net->packets++;
+	if (!net->synced || ssrc != net->jb_ssrc) {
+		net_reset(lhandle);
+		net->synced = 1;
+		net->jb_ssrc = ssrc;
+		net->jb_ts = ts;
+		net->seq_next = seq;
+	}
+	dseq = seq - net->seq_next;
+	if (dseq > 0)
+		net->lost += dseq;
+	if (dseq >= 0)
+		net->seq_next = seq + 1;
+	net_jitter(lhandle, ts, frames);
+	offset = ts - net->jb_ts;
+	if (offset < 0) {
+		if (offset + (int32_t)frames <= 0) {
+			net->late++;
+			return;
+		}
+		/* the beginning was already played */
+		p += -offset * net->frame_size;
+		frames += offset;
+		offset = 0;
+	}
+	if ((snd_pcm_uframes_t)offset > net->jb_count + net->target ||
+	    offset + frames > net->jb_size) {
+		/* a gap longer than the hold time, start again */
+		net->resyncs++;
+		net_reset(lhandle);
+		net->synced = 1;
+		net->jb_ts = ts;
+		offset = 0;
+		if (frames > net->jb_size)
+			return;
+	}
+	jb_copy(net, net->jb_pos + offset, p, frames);
+	if (offset + frames > net->jb_count)
+		net->jb_count = offset + frames;
+}
+
+/*
+ * The frames older than the hold time are available for reading,
+ * the newer ones wait for the late and reordered packets.
+ */
+static snd_pcm_sframes_t net_avail(struct loopback_handle *lhandle)
+{
+	struct loopback_net *net = lhandle->ep_data;
+	ssize_t size;
+
+	if (!net->capture)
+		return lhandle->buffer_size;
+	while ((size = recv(net->fd, net->packet, NET_PACKET_MAX, 0)) >= 0)
+		net_packet(lhandle, size);
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    verbose > 1)
+		logit(LOG_WARNING, "%s: receive error: %s\n", lhandle->id, strerror(errno));
+	if (net->jb_count <= net->target)
+		return 0;
+	return net->jb_count - (snd_pcm_uframes_t)net->target;
+}
+
+/* the frames held in the jitter buffer over the hold time */
+static snd_pcm_sframes_t net_delay(struct loopback_handle *lhandle)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	if (!net->capture)
+		return 0;
+	return (snd_pcm_sframes_t)net->jb_count - (snd_pcm_sframes_t)net->target;
+}
+
+static snd_pcm_sframes_t net_read(struct loopback_handle *lhandle,
+				  void *buf, snd_pcm_uframes_t frames)
+{
+	struct loopback_net *net = lhandle->ep_data;
+	snd_pcm_uframes_t count, count1;
+	char *dst = buf;
+
+	if (frames > net->jb_count)
+		frames = net->jb_count;
+	for (count = frames; count > 0; count -= count1) {
+		count1 = count;
+		if (count1 + net->jb_pos > net->jb_size)
+			count1 = net->jb_size - net->jb_pos;
+		memcpy(dst, net->jb + net->jb_pos * net->frame_size,
+		       count1 * net->frame_size);
+		/* the lost packets leave silence */
+		snd_pcm_format_set_silence(lhandle->format,
+					   net->jb + net->jb_pos * net->frame_size,
+					   count1 * lhandle->channels);
+		dst += count1 * net->frame_size;
+		net->jb_pos = (net->jb_pos + count1) % net->jb_size;
+	}
+	net->jb_count -= frames;
+	net->jb_ts += frames;
+	return frames;
+}
+
+/* a packet which cannot be sent is lost like on the network */
+static snd_pcm_sframes_t net_write(struct loopback_handle *lhandle,
+				   const void *buf, snd_pcm_uframes_t frames)
+{
+	struct loopback_net *net = lhandle->ep_data;
+	unsigned char *p = net->packet;
+	const char *src = buf;
+	snd_pcm_uframes_t count, count1;
+
+	for (count = frames; count > 0; count -= count1) {
+		count1 = count < net->frames ? count : net->frames;
+		p[0] = 0x80;
+		p[1] = NET_PAYLOAD_TYPE;
+		p[2] = net->seq >> 8;
+		p[3] = net->seq;
+		p[4] = net->timestamp >> 24;
+		p[5] = net->timestamp >> 16;
+		p[6] = net->timestamp >> 8;
+		p[7] = net->timestamp;
+		p[8] = net->ssrc >> 24;
+		p[9] = net->ssrc >> 16;
+		p[10] = net->ssrc >> 8;
+		p[11] = net->ssrc;
+		memcpy(p + NET_HEADER, src, count1 * net->frame_size);
+		if (send(net->fd, p, NET_HEADER + count1 * net->frame_size, 0) < 0)
+			net->dropped++;
+		net->packets++;
+		net->seq++;
+		net->timestamp += count1;
+		src += count1 * net->frame_size;
+	}
+	return frames;
+}
+
+static void net_state(struct loopback_handle *lhandle, snd_output_t *out)
+{
+	struct loopback_net *net = lhandle->ep_data;
+
+	if (!net->capture) {
+		snd_output_printf(out, "    net: packets = %llu, dropped = %llu, frames/packet = %u\n", net->packets, net->dropped, net->frames);
+		return;
+	}
+	snd_output_printf(out, "    net: packets = %llu, lost = %llu, late = %llu, resyncs = %llu\n", net->packets, net->lost, net->late, net->resyncs);
+	snd_output_printf(out, "    net: jitter = %.1f, hold = %.1f, queued = %li frames\n", net->jitter, net->target, net->jb_count);
+}
+
+const struct loopback_endpoint_ops endpoint_udp = {
+	.prefix = NET_PREFIX,
+	.open = net_open,
+	.close = net_close,
+	.setparams = net_setparams,
+	.start = net_start,
+	.poll_descriptors_count = net_poll_descriptors_count,
+	.poll_descriptors = net_poll_descriptors,
+	.poll_descriptors_revents = net_poll_descriptors_revents,
+	.avail = net_avail,
+	.delay = net_delay,
+	.read = net_read,
+	.write = net_write,
+	.state = net_state,
+};
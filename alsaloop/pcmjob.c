@@ -24,10 +24,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sched.h>
 #include <errno.h>
 #include <getopt.h>
 #include <alsa/asoundlib.h>
+#include <time.h>
 #include <sys/time.h>
 #include <math.h>
 #include <syslog.h>
@@ -35,6 +37,13 @@
 #include "alsaloop.h"
 
 #define XRUN_PROFILE_UNKNOWN (-10000000)
+#define SYNC_PITCH_MAX		0.01	/* maximal drift correction */
+#define ADAPT_GROW		1.5	/* latency step after an xrun */
+#define ADAPT_NEAR_GROW		1.25	/* latency step after near misses */
+#define ADAPT_NEAR_COUNT	3	/* near misses before a step */
+#define ADAPT_SHRINK		0.875	/* latency step after a stable period */
+#define ADAPT_STABLE		60	/* seconds without an event */
+#define ADAPT_SLEW		0.002	/* ramp speed, part of the rate */
 
 static int set_rate_shift(struct loopback_handle *lhandle, double pitch);
 static int get_rate(struct loopback_handle *lhandle);
@@ -52,7 +61,6 @@ static const char *sync_types[] = {
 
 #define SRCTYPE(v) [SRC_##v] = "SRC_" #v
 
-#ifdef USE_SAMPLERATE
 static const char *src_types[] = {
 	SRCTYPE(SINC_BEST_QUALITY),
 	SRCTYPE(SINC_MEDIUM_QUALITY),
@@ -60,7 +68,6 @@ static const char *src_types[] = {
 	SRCTYPE(ZERO_ORDER_HOLD),
 	SRCTYPE(LINEAR)
 };
-#endif
 
 static pthread_mutex_t pcm_open_mutex =
                                 PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
@@ -113,6 +120,12 @@ static int setparams_stream(struct loopback_handle *lhandle,
 		return err;
 	}
 	err = snd_pcm_hw_params_set_access(handle, params, lhandle->access);
+	if (err < 0 && lhandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+		if (verbose)
+			logit(LOG_WARNING, "MMAP access not available for %s, using RW access\n", lhandle->id);
+		lhandle->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+		err = snd_pcm_hw_params_set_access(handle, params, lhandle->access);
+	}
 	if (err < 0) {
 		logit(LOG_CRIT, "Access type not available for %s: %s\n", lhandle->id, snd_strerror(err));
 		return err;
@@ -179,6 +192,9 @@ static int setparams_bufsize(struct loopback_handle *lhandle,
       __set_it:
 	snd_pcm_hw_params_copy(params, tparams);
 	periodsize = bufsize * 8;
+	/* the adaptive latency grows without a new configuration */
+	if (periodsize < lhandle->loopback->latency_room)
+		periodsize = lhandle->loopback->latency_room;
 	err = snd_pcm_hw_params_set_buffer_size_near(handle, params, &periodsize);
 	if (err < 0) {
 		logit(LOG_CRIT, "Unable to set buffer size %li for %s: %s\n", periodsize, lhandle->id, snd_strerror(err));
@@ -189,6 +205,8 @@ static int setparams_bufsize(struct loopback_handle *lhandle,
 		snd_output_printf(lhandle->loopback->output, "%s: buffer_size=%li\n", lhandle->id, periodsize);
 	if (lhandle->period_size_req > 0)
 		periodsize = lhandle->period_size_req;
+	else if (lhandle->loopback->latency_room)
+		periodsize = bufsize;
 	else
 		periodsize /= 8;
 	err = snd_pcm_hw_params_set_period_size_near(handle, params, &periodsize, 0);
@@ -233,6 +251,11 @@ static int setparams_set(struct loopback_handle *lhandle,
 		logit(LOG_CRIT, "Unable to set start threshold mode for %s: %s\n", lhandle->id, snd_strerror(err));
 		return err;
 	}
+	err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE);
+	if (err < 0) {
+		logit(LOG_CRIT, "Unable to set timestamp mode for %s: %s\n", lhandle->id, snd_strerror(err));
+		return err;
+	}
 	snd_pcm_hw_params_get_period_size(params, &period_size, NULL);
 	snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
 	if (lhandle->nblock) {
@@ -275,9 +298,174 @@ static int setparams_set(struct loopback_handle *lhandle,
 	return 0;
 }
 
-static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
+static struct loopback_hwcache *hwcache_find(struct loopback_handle *lhandle,
+					     snd_pcm_uframes_t bufsize)
+{
+	struct loopback_hwcache *c;
+
+	for (c = lhandle->hwcache; c; c = c->next)
+		if ((c->access == lhandle->access ||
+		     c->access_set == lhandle->access) &&
+		    c->format == lhandle->format &&
+		    c->channels == lhandle->channels &&
+		    c->rate_req == lhandle->rate_req &&
+		    c->resample == lhandle->resample &&
+		    c->bufsize == bufsize &&
+		    c->buffer_size_req == lhandle->buffer_size_req &&
+		    c->period_size_req == lhandle->period_size_req)
+			return c;
+	return NULL;
+}
+
+static void hwcache_drop(struct loopback_handle *lhandle,
+			 struct loopback_hwcache *cache)
+{
+	struct loopback_hwcache **c;
+
+	for (c = &lhandle->hwcache; *c; c = &(*c)->next) {
+		if (*c == cache) {
+			*c = cache->next;
+			if (lhandle->hwconfig == cache)
+				lhandle->hwconfig = NULL;
+			snd_pcm_hw_params_free(cache->params);
+			free(cache);
+			return;
+		}
+	}
+}
+
+static void hwcache_free(struct loopback_handle *lhandle)
+{
+	while (lhandle->hwcache)
+		hwcache_drop(lhandle, lhandle->hwcache);
+}
+
+static void hwcache_add(struct loopback_handle *lhandle,
+			snd_pcm_access_t access, snd_pcm_uframes_t bufsize,
+			snd_pcm_hw_params_t *params)
+{
+	struct loopback_hwcache *c, **last;
+	int count;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return;
+	if (snd_pcm_hw_params_malloc(&c->params) < 0) {
+		free(c);
+		return;
+	}
+	snd_pcm_hw_params_copy(c->params, params);
+	c->access = access;
+	c->format = lhandle->format;
+	c->channels = lhandle->channels;
+	c->rate_req = lhandle->rate_req;
+	c->resample = lhandle->resample;
+	c->bufsize = bufsize;
+	c->buffer_size_req = lhandle->buffer_size_req;
+	c->period_size_req = lhandle->period_size_req;
+	c->access_set = lhandle->access;
+	c->rate = lhandle->rate;
+	c->pitch = lhandle->pitch;
+	c->buffer_size = lhandle->buffer_size;
+	c->period_size = lhandle->period_size;
+	c->next = lhandle->hwcache;
+	lhandle->hwcache = c;
+	/* forget the oldest configuration */
+	for (last = &lhandle->hwcache, count = 0; *last; last = &(*last)->next)
+		if (++count > MAX_HWCACHE) {
+			hwcache_drop(lhandle, *last);
+			break;
+		}
+}
+
+/*
+ * The refinement in setparams_bufsize() may take many hw_params
+ * calls, so the result is remembered per requested configuration and
+ * restored on the next start (xrun recovery, reinit, rate change).
+ * Returns 1 when the cached configuration was used.
+ */
+static int setparams_hw(struct loopback_handle *lhandle,
+			snd_pcm_hw_params_t *params,
+			snd_pcm_hw_params_t *tparams,
+			snd_pcm_uframes_t bufsize, int use_cache)
+{
+	struct loopback_hwcache *c = use_cache ? hwcache_find(lhandle, bufsize) : NULL;
+	snd_pcm_access_t access = lhandle->access;
+	int err;
+
+	if (c) {
+		snd_pcm_hw_params_copy(params, c->params);
+		lhandle->access = c->access_set;
+		lhandle->rate = c->rate;
+		lhandle->pitch = c->pitch;
+		lhandle->buffer_size = c->buffer_size;
+		lhandle->period_size = c->period_size;
+		if (verbose > 1)
+			snd_output_printf(lhandle->loopback->output, "%s: cached hw parameters\n", lhandle->id);
+		return 1;
+	}
+	if ((err = setparams_stream(lhandle, tparams)) < 0) {
+		logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", lhandle->id, snd_strerror(err));
+		return err;
+	}
+	if ((err = setparams_bufsize(lhandle, params, tparams, bufsize / lhandle->pitch)) < 0) {
+		logit(LOG_CRIT, "Unable to set buffer parameters for %s stream: %s\n", lhandle->id, snd_strerror(err));
+		return err;
+	}
+	hwcache_drop(lhandle, hwcache_find(lhandle, bufsize));
+	hwcache_add(lhandle, access, bufsize, params);
+	return 0;
+}
+
+static int setparams_sw(struct loopback_handle *lhandle,
+			 snd_pcm_hw_params_t *params,
+			 snd_pcm_hw_params_t *tparams,
+			 snd_pcm_sw_params_t *swparams,
+			 snd_pcm_uframes_t bufsize, int cached)
+{
+	int err;
+
+	err = setparams_set(lhandle, params, swparams, bufsize / lhandle->pitch);
+	if (err < 0 && cached) {
+		/* the device refused the remembered configuration */
+		hwcache_drop(lhandle, hwcache_find(lhandle, bufsize));
+		err = setparams_hw(lhandle, params, tparams, bufsize, 0);
+		if (err >= 0)
+			err = setparams_set(lhandle, params, swparams, bufsize / lhandle->pitch);
+	}
+	if (err < 0)
+		logit(LOG_CRIT, "Unable to set sw parameters for %s stream: %s\n", lhandle->id, snd_strerror(err));
+	return err;
+}
+
+/*
+ * After a partial restart the device still holds the configuration of
+ * the previous run. It is kept when the request did not change, so only
+ * the side with new parameters goes through hw_free and hw_params.
+ */
+static int setparams_keep(struct loopback_handle *lhandle,
+			  snd_pcm_uframes_t bufsize)
 {
 	int err;
+
+	if (lhandle->hwconfig == NULL)
+		return 0;
+	if (lhandle->hwconfig == hwcache_find(lhandle, bufsize)) {
+		if (verbose > 1)
+			snd_output_printf(lhandle->loopback->output, "%s: hw parameters kept\n", lhandle->id);
+		return 1;
+	}
+	lhandle->hwconfig = NULL;
+	if ((err = snd_pcm_hw_free(lhandle->handle)) < 0)
+		logit(LOG_WARNING, "pcm hw_free %s error: %s\n", lhandle->id, snd_strerror(err));
+	return 0;
+}
+
+static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
+{
+	int pdev = !loop->play->source && !loop->play->ep;
+	int cdev = !loop->capt->source && !loop->capt->ep;
+	int err, pcached = 0, ccached = 0, pkeep = 0, ckeep = 0;
 	snd_pcm_hw_params_t *pt_params, *ct_params;	/* templates with rate, format and channels */
 	snd_pcm_hw_params_t *p_params, *c_params;
 	snd_pcm_sw_params_t *p_swparams, *c_swparams;
@@ -288,31 +476,32 @@ static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
 	snd_pcm_hw_params_alloca(&ct_params);
 	snd_pcm_sw_params_alloca(&p_swparams);
 	snd_pcm_sw_params_alloca(&c_swparams);
-	if ((err = setparams_stream(loop->play, pt_params)) < 0) {
-		logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
-		return err;
-	}
-	if ((err = setparams_stream(loop->capt, ct_params)) < 0) {
-		logit(LOG_CRIT, "Unable to set parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
-		return err;
-	}
-
-	if ((err = setparams_bufsize(loop->play, p_params, pt_params, bufsize / loop->play->pitch)) < 0) {
-		logit(LOG_CRIT, "Unable to set buffer parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
+	if (loop->play->ep &&
+	    (err = loop->play->ep->setparams(loop->play, bufsize)) < 0)
 		return err;
-	}
-	if ((err = setparams_bufsize(loop->capt, c_params, ct_params, bufsize / loop->capt->pitch)) < 0) {
-		logit(LOG_CRIT, "Unable to set buffer parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
-		return err;
-	}
-
-	if ((err = setparams_set(loop->play, p_params, p_swparams, bufsize / loop->play->pitch)) < 0) {
-		logit(LOG_CRIT, "Unable to set sw parameters for %s stream: %s\n", loop->play->id, snd_strerror(err));
+	if (loop->capt->ep &&
+	    (err = loop->capt->ep->setparams(loop->capt, bufsize)) < 0)
 		return err;
+	if (pdev)
+		pkeep = setparams_keep(loop->play, bufsize);
+	if (cdev)
+		ckeep = setparams_keep(loop->capt, bufsize);
+	if (pdev &&
+	    (pcached = setparams_hw(loop->play, p_params, pt_params, bufsize, 1)) < 0)
+		return pcached;
+	if (cdev &&
+	    (ccached = setparams_hw(loop->capt, c_params, ct_params, bufsize, 1)) < 0)
+		return ccached;
+
+	if (pdev && !pkeep) {
+		if ((err = setparams_sw(loop->play, p_params, pt_params, p_swparams, bufsize, pcached)) < 0)
+			return err;
+		loop->play->hwconfig = hwcache_find(loop->play, bufsize);
 	}
-	if ((err = setparams_set(loop->capt, c_params, c_swparams, bufsize / loop->capt->pitch)) < 0) {
-		logit(LOG_CRIT, "Unable to set sw parameters for %s stream: %s\n", loop->capt->id, snd_strerror(err));
-		return err;
+	if (cdev && !ckeep) {
+		if ((err = setparams_sw(loop->capt, c_params, ct_params, c_swparams, bufsize, ccached)) < 0)
+			return err;
+		loop->capt->hwconfig = hwcache_find(loop->capt, bufsize);
 	}
 
 #if 0
@@ -320,18 +509,22 @@ static int setparams(struct loopback *loop, snd_pcm_uframes_t bufsize)
 		if (snd_pcm_link(loop->capt->handle, loop->play->handle) >= 0)
 			loop->linked = 1;
 #endif
-	if ((err = snd_pcm_prepare(loop->play->handle)) < 0) {
+	if (pdev &&
+	    (err = snd_pcm_prepare(loop->play->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->play->id, snd_strerror(err));
 		return err;
 	}
-	if (!loop->linked && (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
+	if (!loop->linked && cdev &&
+	    (err = snd_pcm_prepare(loop->capt->handle)) < 0) {
 		logit(LOG_CRIT, "Prepare %s error: %s\n", loop->capt->id, snd_strerror(err));
 		return err;
 	}
 
 	if (verbose) {
-		snd_pcm_dump(loop->play->handle, loop->output);
-		snd_pcm_dump(loop->capt->handle, loop->output);
+		if (pdev)
+			snd_pcm_dump(loop->play->handle, loop->output);
+		if (cdev)
+			snd_pcm_dump(loop->capt->handle, loop->output);
 	}
 	return 0;
 }
@@ -358,6 +551,46 @@ static long timediff(snd_timestamp_t t1, snd_timestamp_t t2)
 	return (t1.tv_sec * 1000000) + l;
 }
 
+static unsigned long long monotonic_us(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+}
+
+/*
+ * The loop must be serviced before the playback device plays the queued
+ * frames. The mix inputs have no own playback device, they must read
+ * the capture device within one period. The threads service the ready
+ * loops with the earliest deadline first.
+ */
+static void update_deadline(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	unsigned long long us = 0;
+
+	if (!loop->running) {
+		loop->deadline = ~0ULL;
+		return;
+	}
+	if (!play->source && !play->ep && !loop->idle && play->rate > 0)
+		us = (unsigned long long)(play->queued > 0 ? play->queued : 0) *
+		     1000000 / play->rate;
+	else if (capt->rate > 0)
+		us = (unsigned long long)capt->period_size * 1000000 /
+		     capt->rate;
+	loop->deadline = monotonic_us() + us;
+}
+
 static int getcurtimestamp(snd_timestamp_t *ts)
 {
 	struct timeval tv;
@@ -367,12 +600,106 @@ static int getcurtimestamp(snd_timestamp_t *ts)
 	return 0;
 }
 
+/*
+ * Device queries. One snd_pcm_status() per pass gives the avail, delay,
+ * state and timestamp of a device; readit(), writeit(), the xrun
+ * profile and the drift controller use this snapshot instead of own
+ * queries. The avail and delay are moved by the frames transferred
+ * since, so they stay consistent with the timestamp of the snapshot.
+ * The read and write calls of alsa-lib update the pointers themselves.
+ * Without a valid snapshot the devices are asked directly; all queries
+ * are counted.
+ */
+static int status_query(struct loopback_handle *lhandle)
+{
+	int err;
+
+	lhandle->status_valid = 0;
+	if (lhandle->status == NULL &&
+	    (err = snd_pcm_status_malloc(&lhandle->status)) < 0)
+		return err;
+	lhandle->status_calls++;
+	if ((err = snd_pcm_status(lhandle->handle, lhandle->status)) < 0)
+		return err;
+	lhandle->status_state = snd_pcm_status_get_state(lhandle->status);
+	lhandle->status_avail = snd_pcm_status_get_avail(lhandle->status);
+	lhandle->status_delay = snd_pcm_status_get_delay(lhandle->status);
+	lhandle->status_valid = 1;
+	return 0;
+}
+
+static void status_take(struct loopback_handle *lhandle)
+{
+	lhandle->status_valid = 0;
+	if (lhandle->handle == NULL || lhandle->ep || lhandle->source ||
+	    lhandle->loopback->zerocopy ||
+	    (workarounds & WORKAROUND_NOSNAPSHOT))
+		return;
+	status_query(lhandle);
+}
+
+static inline void status_moved(struct loopback_handle *lhandle,
+				snd_pcm_sframes_t frames)
+{
+	if (!lhandle->status_valid)
+		return;
+	lhandle->status_avail -= frames;
+	if (lhandle == lhandle->loopback->play)
+		lhandle->status_delay += frames;
+	else
+		lhandle->status_delay -= frames;
+}
+
+static inline snd_pcm_sframes_t pcm_avail_update(struct loopback_handle *lhandle)
+{
+	lhandle->avail_calls++;
+	return snd_pcm_avail_update(lhandle->handle);
+}
+
+static snd_pcm_sframes_t pcm_avail(struct loopback_handle *lhandle)
+{
+	if (!lhandle->status_valid)
+		return pcm_avail_update(lhandle);
+	switch (lhandle->status_state) {
+	case SND_PCM_STATE_XRUN:
+		return -EPIPE;
+	case SND_PCM_STATE_SUSPENDED:
+		return -ESTRPIPE;
+	case SND_PCM_STATE_DISCONNECTED:
+		return -ENODEV;
+	default:
+		return lhandle->status_avail;
+	}
+}
+
+static int pcm_delay(struct loopback_handle *lhandle, snd_pcm_sframes_t *delay)
+{
+	if (lhandle->status_valid &&
+	    lhandle->status_state != SND_PCM_STATE_XRUN &&
+	    lhandle->status_state != SND_PCM_STATE_SUSPENDED) {
+		*delay = lhandle->status_delay;
+		return 0;
+	}
+	lhandle->delay_calls++;
+	return snd_pcm_delay(lhandle->handle, delay);
+}
+
+static snd_pcm_state_t pcm_state(struct loopback_handle *lhandle)
+{
+	if (lhandle->status_valid)
+		return lhandle->status_state;
+	lhandle->state_calls++;
+	return snd_pcm_state(lhandle->handle);
+}
+
 static void xrun_profile0(struct loopback *loop)
 {
 	snd_pcm_sframes_t pdelay, cdelay;
 
-	if (snd_pcm_delay(loop->play->handle, &pdelay) >= 0 &&
-	    snd_pcm_delay(loop->capt->handle, &cdelay) >= 0) {
+	if (loop->play->ep || loop->capt->ep)
+		return;
+	if (pcm_delay(loop->play, &pdelay) >= 0 &&
+	    pcm_delay(loop->capt, &cdelay) >= 0) {
 		getcurtimestamp(&loop->xrun_last_update);
 		loop->xrun_last_pdelay = pdelay;
 		loop->xrun_last_cdelay = cdelay;
@@ -440,6 +767,103 @@ static inline void xrun_stats(struct loopback *loop)
 		xrun_stats0(loop);
 }
 
+/*
+ * Adaptive latency (-L). The loop starts at the lowest latency. After
+ * an xrun the goal grows at once and the xrun recovery refills the
+ * buffers to it. A pass which found less than a quarter period queued
+ * for the playback is a near miss; a few of them grow the goal, too.
+ * After ADAPT_STABLE seconds without an event the goal shrinks a bit.
+ * Except after an xrun, the latency is ramped to the goal and the
+ * drift controller moves the buffer fill along, so no reinit is needed.
+ * The hw buffers are sized for the highest latency in setparams(),
+ * the periods for the lowest one.
+ */
+static snd_pcm_uframes_t latency_init(struct loopback *loop)
+{
+	unsigned int rate = loop->play->rate_req;
+	snd_pcm_uframes_t min = time_to_frames(rate, loop->latency_mintime);
+	snd_pcm_uframes_t max = time_to_frames(rate, loop->latency_maxtime);
+
+	/* the goal is kept in latency_reqtime over the restarts */
+	if (loop->latency < min)
+		loop->latency = min;
+	if (loop->latency > max)
+		loop->latency = max;
+	loop->latency_reqtime = frames_to_time(rate, loop->latency);
+	loop->latency_room = max * 2;
+	loop->adapt_target = loop->latency;
+	loop->adapt_latency = loop->latency;
+	loop->adapt_time = loop->adapt_ramp = monotonic_us();
+	loop->adapt_pdelay = -1;
+	loop->adapt_near = 0;
+	loop->adapt_nearcount = 0;
+	return min / 2;
+}
+
+static void latency_step(struct loopback *loop, double factor,
+			 const char *reason, int now)
+{
+	unsigned int rate = loop->play->rate_req;
+	snd_pcm_uframes_t min = time_to_frames(rate, loop->latency_mintime);
+	snd_pcm_uframes_t max = time_to_frames(rate, loop->latency_maxtime);
+	snd_pcm_uframes_t target = loop->adapt_target * factor + 0.5;
+
+	loop->adapt_time = monotonic_us();
+	loop->adapt_nearcount = 0;
+	if (target < min)
+		target = min;
+	if (target > max)
+		target = max;
+	if (target == loop->adapt_target)
+		return;
+	logit(LOG_INFO, "%s: latency %.3fms -> %.3fms (%s)\n", loop->id, loop->adapt_target * 1000.0 / rate, target * 1000.0 / rate, reason);
+	loop->adapt_target = target;
+	loop->latency_reqtime = frames_to_time(rate, target);
+	loop->adapt_changes++;
+	if (now) {
+		loop->adapt_latency = target;
+		loop->latency = target;
+	}
+}
+
+static void latency_adapt(struct loopback *loop)
+{
+	unsigned long long now = monotonic_us();
+	double step;
+
+	if (loop->adapt_pdelay >= 0) {
+		if (loop->adapt_pdelay < (snd_pcm_sframes_t)loop->play->period_size / 4) {
+			if (!loop->adapt_near) {
+				loop->adapt_nearmisses++;
+				loop->adapt_time = now;
+				if (verbose > 1)
+					snd_output_printf(loop->output, "%s: near miss, %li frames queued\n", loop->id, (long)loop->adapt_pdelay);
+				if (++loop->adapt_nearcount >= ADAPT_NEAR_COUNT)
+					latency_step(loop, ADAPT_NEAR_GROW, "near misses", 0);
+			}
+			loop->adapt_near = 1;
+		} else {
+			loop->adapt_near = 0;
+		}
+		loop->adapt_pdelay = -1;
+	}
+	if (now - loop->adapt_time >= ADAPT_STABLE * 1000000ULL)
+		latency_step(loop, ADAPT_SHRINK, "stable", 0);
+	step = (now - loop->adapt_ramp) / 1000000.0 *
+	       loop->play->rate_req * ADAPT_SLEW;
+	loop->adapt_ramp = now;
+	if (loop->adapt_latency < loop->adapt_target) {
+		loop->adapt_latency += step;
+		if (loop->adapt_latency > loop->adapt_target)
+			loop->adapt_latency = loop->adapt_target;
+	} else if (loop->adapt_latency > loop->adapt_target) {
+		loop->adapt_latency -= step;
+		if (loop->adapt_latency < loop->adapt_target)
+			loop->adapt_latency = loop->adapt_target;
+	}
+	loop->latency = loop->adapt_latency + 0.5;
+}
+
 static inline snd_pcm_uframes_t buf_avail(struct loopback_handle *lhandle)
 {
 	return lhandle->buf_size - lhandle->buf_count;
@@ -458,7 +882,6 @@ static void buf_remove(struct loopback *loop, snd_pcm_uframes_t count)
 	}
 }
 
-#if 0
 static void buf_add_copy(struct loopback *loop)
 {
 	struct loopback_handle *capt = loop->capt;
@@ -492,9 +915,419 @@ static void buf_add_copy(struct loopback *loop)
 		count -= count1;
 	}
 }
-#endif
+
+/*
+ * Mixing: the loops created with the -i option capture from their own
+ * device and queue the frames converted to the playback parameters in
+ * their playback buffer. The loop owning the playback device adds them
+ * with the input gain to the frames just captured from its own device.
+ * The sums saturate.
+ */
+static void mix_s16(void *dst, const void *src, unsigned int count, float gain)
+{
+	int16_t *d = dst;
+	const int16_t *s = src;
+	unsigned int i;
+	float v;
+
+	for (i = 0; i < count; i++) {
+		v = d[i] + s[i] * gain;
+		if (v > 32767.0f)
+			v = 32767.0f;
+		else if (v < -32768.0f)
+			v = -32768.0f;
+		d[i] = (int16_t)v;
+	}
+}
+
+static void mix_s24(void *dst, const void *src, unsigned int count, float gain)
+{
+	int32_t *d = dst;
+	const uint32_t *s = src;
+	unsigned int i;
+	float v;
+
+	for (i = 0; i < count; i++) {
+		v = ((int32_t)((uint32_t)d[i] << 8) >> 8) +
+		    ((int32_t)(s[i] << 8) >> 8) * gain;
+		if (v > 8388607.0f)
+			v = 8388607.0f;
+		else if (v < -8388608.0f)
+			v = -8388608.0f;
+		d[i] = (int32_t)v;
+	}
+}
+
+static void mix_s24_3le(void *dst, const void *src, unsigned int count,
+			float gain)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	unsigned int i;
+	int32_t x;
+	float v;
+
+	for (i = 0; i < count; i++, d += 3, s += 3) {
+		v = ((int32_t)(((uint32_t)d[0] << 8) | ((uint32_t)d[1] << 16) |
+			       ((uint32_t)d[2] << 24)) >> 8) +
+		    ((int32_t)(((uint32_t)s[0] << 8) | ((uint32_t)s[1] << 16) |
+			       ((uint32_t)s[2] << 24)) >> 8) * gain;
+		if (v > 8388607.0f)
+			v = 8388607.0f;
+		else if (v < -8388608.0f)
+			v = -8388608.0f;
+		x = (int32_t)v;
+		d[0] = x;
+		d[1] = x >> 8;
+		d[2] = x >> 16;
+	}
+}
+
+static void mix_s32(void *dst, const void *src, unsigned int count, float gain)
+{
+	int32_t *d = dst;
+	const int32_t *s = src;
+	unsigned int i;
+	double v;
+
+	for (i = 0; i < count; i++) {
+		v = d[i] + s[i] * (double)gain;
+		if (v > 2147483647.0)
+			v = 2147483647.0;
+		else if (v < -2147483648.0)
+			v = -2147483648.0;
+		d[i] = (int32_t)v;
+	}
+}
+
+static void mix_float(void *dst, const void *src, unsigned int count,
+		      float gain)
+{
+	float *d = dst;
+	const float *s = src;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		d[i] += s[i] * gain;
+}
+
+static void samples_mix(snd_pcm_format_t format, void *dst, const void *src,
+			unsigned int count, float gain)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		mix_s16(dst, src, count, gain);
+		break;
+	case SND_PCM_FORMAT_S24:
+		mix_s24(dst, src, count, gain);
+		break;
+	case SND_PCM_FORMAT_S24_3LE:
+		mix_s24_3le(dst, src, count, gain);
+		break;
+	case SND_PCM_FORMAT_S32:
+		mix_s32(dst, src, count, gain);
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		mix_float(dst, src, count, gain);
+		break;
+	default:
+		break;
+	}
+}
+
+/* add the queued input frames to the count frames just added */
+static void buf_add_mix(struct loopback *loop, snd_pcm_uframes_t count)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *in;
+	snd_pcm_uframes_t pos, left, count1;
+
+	for (in = play->mix; in; in = in->mix) {
+		if (!in->loopback->running || in->buf_count == 0)
+			continue;
+		left = count < in->buf_count ? count : in->buf_count;
+		pos = (play->buf_pos + play->buf_count - count) % play->buf_size;
+		while (left > 0) {
+			count1 = left;
+			if (count1 + pos > play->buf_size)
+				count1 = play->buf_size - pos;
+			if (count1 + in->buf_pos > in->buf_size)
+				count1 = in->buf_size - in->buf_pos;
+			samples_mix(play->format,
+				    play->buf + pos * play->frame_size,
+				    in->buf + in->buf_pos * in->frame_size,
+				    count1 * play->channels, in->mix_gain);
+			in->buf_pos += count1;
+			in->buf_pos %= in->buf_size;
+			in->buf_count -= count1;
+			pos += count1;
+			pos %= play->buf_size;
+			left -= count1;
+		}
+	}
+}
 
 #ifdef USE_SAMPLERATE
+/*
+ * Sample conversion between the PCM formats and the float samples used
+ * by the sample rate converter. Each format has its own plain loop.
+ */
+static void s16_to_float(const void *src, float *dst, unsigned int count)
+{
+	const int16_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = s[i] * (1.0f / 0x8000);
+}
+
+static void s24_to_float(const void *src, float *dst, unsigned int count)
+{
+	const uint32_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = ((int32_t)(s[i] << 8) >> 8) * (1.0f / 0x800000);
+}
+
+static void s24_3le_to_float(const void *src, float *dst, unsigned int count)
+{
+	const uint8_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i < count; i++, s += 3)
+		dst[i] = (int32_t)(((uint32_t)s[0] << 8) |
+				   ((uint32_t)s[1] << 16) |
+				   ((uint32_t)s[2] << 24)) * (1.0f / 0x80000000U);
+}
+
+static void s32_to_float(const void *src, float *dst, unsigned int count)
+{
+	const int32_t *s = src;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = s[i] * (1.0 / 0x80000000U);
+}
+
+static void float_to_s16(const float *src, void *dst, unsigned int count)
+{
+	int16_t *d = dst;
+	unsigned int i;
+	float v;
+
+	for (i = 0; i < count; i++) {
+		v = src[i] * 0x8000;
+		if (v > 32767.0f)
+			v = 32767.0f;
+		else if (v < -32768.0f)
+			v = -32768.0f;
+		d[i] = lrintf(v);
+	}
+}
+
+static void float_to_s24(const float *src, void *dst, unsigned int count)
+{
+	int32_t *d = dst;
+	unsigned int i;
+	float v;
+
+	for (i = 0; i < count; i++) {
+		v = src[i] * 0x800000;
+		if (v > 8388607.0f)
+			v = 8388607.0f;
+		else if (v < -8388608.0f)
+			v = -8388608.0f;
+		d[i] = lrintf(v);
+	}
+}
+
+static void float_to_s24_3le(const float *src, void *dst, unsigned int count)
+{
+	uint8_t *d = dst;
+	unsigned int i;
+	int32_t x;
+	float v;
+
+	for (i = 0; i < count; i++, d += 3) {
+		v = src[i] * 0x800000;
+		if (v > 8388607.0f)
+			v = 8388607.0f;
+		else if (v < -8388608.0f)
+			v = -8388608.0f;
+		x = lrintf(v);
+		d[0] = x;
+		d[1] = x >> 8;
+		d[2] = x >> 16;
+	}
+}
+
+static void float_to_s32(const float *src, void *dst, unsigned int count)
+{
+	int32_t *d = dst;
+	unsigned int i;
+	double v;
+
+	for (i = 0; i < count; i++) {
+		v = src[i] * (double)0x80000000U;
+		if (v > 2147483647.0)
+			v = 2147483647.0;
+		else if (v < -2147483648.0)
+			v = -2147483648.0;
+		d[i] = lrint(v);
+	}
+}
+
+static void samples_to_float(snd_pcm_format_t format, const void *src,
+			     float *dst, unsigned int count)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		s16_to_float(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_S24:
+		s24_to_float(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_S24_3LE:
+		s24_3le_to_float(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_S32:
+		s32_to_float(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		memcpy(dst, src, count * sizeof(float));
+		break;
+	default:
+		break;
+	}
+}
+
+static void samples_from_float(snd_pcm_format_t format, const float *src,
+			       void *dst, unsigned int count)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		float_to_s16(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_S24:
+		float_to_s24(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_S24_3LE:
+		float_to_s24_3le(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_S32:
+		float_to_s32(src, dst, count);
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		memcpy(dst, src, count * sizeof(float));
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Float pipeline (-D): the capture frames are converted to float once,
+ * routed, resampled, mixed and processed by the effects as float, and
+ * converted to the playback format in one dithered pass at the end.
+ */
+
+/* add the queued input frames to the block of frames */
+static void float_add_mix(struct loopback *loop, float *buf,
+			  snd_pcm_uframes_t frames)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *in;
+	snd_pcm_uframes_t left, count1;
+	float *dst;
+
+	for (in = play->mix; in; in = in->mix) {
+		if (!in->loopback->running || in->buf_count == 0)
+			continue;
+		left = frames < in->buf_count ? frames : in->buf_count;
+		dst = buf;
+		while (left > 0) {
+			count1 = left;
+			if (count1 + in->buf_pos > in->buf_size)
+				count1 = in->buf_size - in->buf_pos;
+			samples_to_float(play->format,
+					 in->buf + in->buf_pos * in->frame_size,
+					 loop->float_mix, count1 * play->channels);
+			mix_float(dst, loop->float_mix,
+				  count1 * play->channels, in->mix_gain);
+			in->buf_pos += count1;
+			in->buf_pos %= in->buf_size;
+			in->buf_count -= count1;
+			dst += count1 * play->channels;
+			left -= count1;
+		}
+	}
+}
+
+/* finish a block of at most EFFECT_BLOCK frames at ppos of the playback */
+static void float_put(struct loopback *loop, float *buf,
+		      snd_pcm_uframes_t frames, snd_pcm_uframes_t ppos)
+{
+	struct loopback_handle *play = loop->play;
+	char *dst = play->buf + ppos * play->frame_size;
+
+	if (play->mix)
+		float_add_mix(loop, buf, frames);
+	if (loop->effects)
+		effect_process(loop, buf, frames);
+	if (loop->volume)
+		volume_process(loop->volume, buf, frames);
+	if (loop->dither.type != DITHER_NONE)
+		dither_process(&loop->dither, buf, dst, frames);
+	else
+		samples_from_float(play->format, buf, dst,
+				   frames * play->channels);
+}
+
+static void buf_add_float(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t count, count1, cpos, ppos;
+	float *buf;
+
+	count = capt->buf_count;
+	cpos = capt->buf_pos - count;
+	if (cpos > capt->buf_size)
+		cpos += capt->buf_size;
+	ppos = (play->buf_pos + play->buf_count) % play->buf_size;
+	while (count > 0) {
+		count1 = count;
+		if (count1 > EFFECT_BLOCK)
+			count1 = EFFECT_BLOCK;
+		if (count1 + cpos > capt->buf_size)
+			count1 = capt->buf_size - cpos;
+		if (count1 > buf_avail(play))
+			count1 = buf_avail(play);
+		if (count1 + ppos > play->buf_size)
+			count1 = play->buf_size - ppos;
+		if (count1 == 0)
+			break;
+		samples_to_float(capt->format,
+				 capt->buf + cpos * capt->frame_size,
+				 loop->float_in, count1 * capt->channels);
+		buf = loop->float_in;
+		if (loop->route) {
+			route_float(loop->route, buf, capt->channels,
+				    loop->float_out, count1);
+			buf = loop->float_out;
+		}
+		float_put(loop, buf, count1, ppos);
+		play->buf_count += count1;
+		capt->buf_count -= count1;
+		ppos += count1;
+		ppos %= play->buf_size;
+		cpos += count1;
+		cpos %= capt->buf_size;
+		count -= count1;
+	}
+}
+
 static void buf_add_src(struct loopback *loop)
 {
 	struct loopback_handle *capt = loop->capt;
@@ -510,18 +1343,22 @@ static void buf_add_src(struct loopback *loop)
 		count1 = count;
 		if (count1 + pos1 > capt->buf_size)
 			count1 = capt->buf_size - pos1;
-		if (capt->format == SND_PCM_FORMAT_S32)
-			src_int_to_float_array((int *)(capt->buf +
-						pos1 * capt->frame_size),
-					 loop->src_data.data_in +
-					   pos * capt->channels,
+		if (loop->route) {
+			if (count1 > ROUTE_BLOCK)
+				count1 = ROUTE_BLOCK;
+			samples_to_float(capt->format,
+					 capt->buf + pos1 * capt->frame_size,
+					 loop->route->in,
 					 count1 * capt->channels);
-		else
-			src_short_to_float_array((short *)(capt->buf +
-						pos1 * capt->frame_size),
-					 loop->src_data.data_in +
-					   pos * capt->channels,
+			route_float(loop->route, loop->route->in, capt->channels,
+				    (float *)loop->src_data.data_in + pos * play->channels,
+				    count1);
+		} else {
+			samples_to_float(capt->format,
+					 capt->buf + pos1 * capt->frame_size,
+					 (float *)loop->src_data.data_in + pos * capt->channels,
 					 count1 * capt->channels);
+		}
 		count -= count1;
 		pos += count1;
 		pos1 += count1;
@@ -548,18 +1385,18 @@ static void buf_add_src(struct loopback *loop)
 			count1 = buf_avail(play);
 		if (count1 == 0)
 			break;
-		if (capt->format == SND_PCM_FORMAT_S32)
-			src_float_to_int_array(loop->src_data.data_out +
-					   pos * play->channels,
-					 (int *)(play->buf +
-					   pos1 * play->frame_size),
-					 count1 * play->channels);
-		else
-			src_float_to_short_array(loop->src_data.data_out +
-					   pos * play->channels,
-					 (short *)(play->buf +
-					   pos1 * play->frame_size),
-					 count1 * play->channels);
+		if (loop->float_pipe) {
+			if (count1 > EFFECT_BLOCK)
+				count1 = EFFECT_BLOCK;
+			float_put(loop,
+				  loop->src_data.data_out + pos * play->channels,
+				  count1, pos1);
+		} else {
+			samples_from_float(play->format,
+					   loop->src_data.data_out + pos * play->channels,
+					   play->buf + pos1 * play->frame_size,
+					   count1 * play->channels);
+		}
 		play->buf_count += count1;
 		count -= count1;
 		pos += count1;
@@ -579,36 +1416,139 @@ static void buf_add_src(struct loopback *loop)
 			loop->src_out_frames * play->channels * sizeof(float));
 	}
 }
-#else
-static void buf_add_src(struct loopback *loop)
+
+/*
+ * Routing: the sparse maps of one source channel per playback channel
+ * copy the samples when both formats are equal, everything else goes
+ * through the float matrix in ROUTE_BLOCK frame blocks.
+ */
+static void buf_add_route(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_handle *play = loop->play;
+	struct loopback_route *route = loop->route;
+	snd_pcm_uframes_t count, count1, cpos, ppos;
+	unsigned int width = snd_pcm_format_physical_width(play->format) / 8;
+
+	count = capt->buf_count;
+	cpos = capt->buf_pos - count;
+	if (cpos > capt->buf_size)
+		cpos += capt->buf_size;
+	ppos = (play->buf_pos + play->buf_count) % play->buf_size;
+	while (count > 0) {
+		count1 = count;
+		if (count1 + cpos > capt->buf_size)
+			count1 = capt->buf_size - cpos;
+		if (count1 > buf_avail(play))
+			count1 = buf_avail(play);
+		if (count1 + ppos > play->buf_size)
+			count1 = play->buf_size - ppos;
+		if (count1 == 0)
+			break;
+		if (route->native) {
+			route_select(route, capt->buf + cpos * capt->frame_size,
+				     capt->channels,
+				     play->buf + ppos * play->frame_size,
+				     count1, width);
+		} else {
+			if (count1 > ROUTE_BLOCK)
+				count1 = ROUTE_BLOCK;
+			samples_to_float(capt->format,
+					 capt->buf + cpos * capt->frame_size,
+					 route->in, count1 * capt->channels);
+			route_float(route, route->in, capt->channels,
+				    route->out, count1);
+			samples_from_float(play->format, route->out,
+					   play->buf + ppos * play->frame_size,
+					   count1 * play->channels);
+		}
+		play->buf_count += count1;
+		capt->buf_count -= count1;
+		ppos += count1;
+		ppos %= play->buf_size;
+		cpos += count1;
+		cpos %= capt->buf_size;
+		count -= count1;
+	}
+}
+
+/* run the effect chain and the volume on the frames just queued for playback */
+static void buf_add_effects(struct loopback *loop, snd_pcm_uframes_t count)
 {
+	struct loopback_handle *play = loop->play;
+	snd_pcm_uframes_t pos, count1;
+	float *buf = loop->effect_buf ? loop->effect_buf : loop->volume->buf;
+	char *ptr;
+
+	pos = (play->buf_pos + play->buf_count - count) % play->buf_size;
+	while (count > 0) {
+		count1 = count;
+		if (count1 > EFFECT_BLOCK)
+			count1 = EFFECT_BLOCK;
+		if (count1 + pos > play->buf_size)
+			count1 = play->buf_size - pos;
+		ptr = play->buf + pos * play->frame_size;
+		samples_to_float(play->format, ptr, buf,
+				 count1 * play->channels);
+		if (loop->effects)
+			effect_process(loop, buf, count1);
+		if (loop->volume)
+			volume_process(loop->volume, buf, count1);
+		samples_from_float(play->format, buf, ptr,
+				   count1 * play->channels);
+		count -= count1;
+		pos += count1;
+		pos %= play->buf_size;
+	}
 }
 #endif
 
 static void buf_add(struct loopback *loop, snd_pcm_uframes_t count)
 {
+	snd_pcm_uframes_t pcount = loop->play->buf_count;
+
 	/* copy samples from capture to playback buffer */
 	if (count <= 0)
 		return;
 	if (loop->play->buf == loop->capt->buf) {
 		loop->play->buf_count += count;
-	} else {
+	} else if (loop->use_samplerate) {
 		buf_add_src(loop);
+	} else if (loop->float_pipe) {
+		buf_add_float(loop);
+	} else if (loop->route) {
+		buf_add_route(loop);
+	} else {
+		buf_add_copy(loop);
 	}
+	/* the float pipeline mixes and runs the effects itself */
+	if (loop->play->buf_count <= pcount || loop->float_pipe)
+		return;
+	if (loop->play->mix)
+		buf_add_mix(loop, loop->play->buf_count - pcount);
+	/* a volume at 0dB keeps the samples bit exact */
+	if (loop->effect_buf ||
+	    (loop->volume && loop->volume->cur &&
+	     (loop->volume->left || !loop->volume->unity)))
+		buf_add_effects(loop, loop->play->buf_count - pcount);
 }
 
 static int xrun(struct loopback_handle *lhandle)
 {
 	int err;
 
+	lhandle->status_valid = 0;
 	if (lhandle == lhandle->loopback->play) {
 		logit(LOG_DEBUG, "underrun for %s\n", lhandle->id);
+		lhandle->xruns++;
+		lhandle->queued = 0;
 		xrun_stats(lhandle->loopback);
 		if ((err = snd_pcm_prepare(lhandle->handle)) < 0)
 			return err;
 		lhandle->xrun_pending = 1;
 	} else {
 		logit(LOG_DEBUG, "overrun for %s\n", lhandle->id);
+		lhandle->xruns++;
 		xrun_stats(lhandle->loopback);
 		if ((err = snd_pcm_prepare(lhandle->handle)) < 0)
 			return err;
@@ -621,6 +1561,7 @@ static int suspend(struct loopback_handle *lhandle)
 {
 	int err;
 
+	lhandle->status_valid = 0;
 	while ((err = snd_pcm_resume(lhandle->handle)) == -EAGAIN)
 		usleep(1);
 	if (err < 0)
@@ -628,38 +1569,188 @@ static int suspend(struct loopback_handle *lhandle)
 	return 0;
 }
 
+/*
+ * Fan-out: the loops created with the -o option share the capture device
+ * of the first loop. Their capture handles are views to the source ring
+ * buffer with own read positions (buf_count frames before buf_pos). The
+ * source reads all available frames; a reader which is too slow loses
+ * its oldest frames, so it cannot stall the others.
+ */
+static void fanout_add(struct loopback_handle *capt, snd_pcm_uframes_t count)
+{
+	struct loopback_handle *lhandle;
+
+	for (lhandle = capt; lhandle; lhandle = lhandle->fanout) {
+		lhandle->buf_count += count;
+		if (lhandle->buf_count > capt->buf_size) {
+			lhandle->buf_over += lhandle->buf_count - capt->buf_size;
+			lhandle->buf_count = capt->buf_size;
+		}
+		lhandle->buf_pos = capt->buf_pos;
+		lhandle->fanout_new += count;
+	}
+}
+
+/*
+ * Silence detection: the peak of each captured block. The loops keep
+ * the maximum and the minimum separately, so they have no branches.
+ */
+static float peak_s16(const void *buf, unsigned int count)
+{
+	const int16_t *s = buf;
+	int max = 0, min = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		v = s[i];
+		max = v > max ? v : max;
+		min = v < min ? v : min;
+	}
+	return (max > -min ? max : -min) * (1.0f / 0x8000);
+}
+
+static float peak_s24(const void *buf, unsigned int count)
+{
+	const uint32_t *s = buf;
+	int32_t max = 0, min = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		v = (int32_t)(s[i] << 8) >> 8;
+		max = v > max ? v : max;
+		min = v < min ? v : min;
+	}
+	return (max > -min ? max : -min) * (1.0f / 0x800000);
+}
+
+static float peak_s24_3le(const void *buf, unsigned int count)
+{
+	const uint8_t *s = buf;
+	int32_t max = 0, min = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < count; i++, s += 3) {
+		v = (int32_t)(((uint32_t)s[0] << 8) | ((uint32_t)s[1] << 16) |
+			      ((uint32_t)s[2] << 24)) >> 8;
+		max = v > max ? v : max;
+		min = v < min ? v : min;
+	}
+	return (max > -min ? max : -min) * (1.0f / 0x800000);
+}
+
+static float peak_s32(const void *buf, unsigned int count)
+{
+	const int32_t *s = buf;
+	int32_t max = 0, min = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		v = s[i];
+		max = v > max ? v : max;
+		min = v < min ? v : min;
+	}
+	return (max > -(long long)min ? max : -(long long)min) *
+	       (1.0 / 0x80000000U);
+}
+
+static float peak_float(const void *buf, unsigned int count)
+{
+	const float *s = buf;
+	float max = 0, v;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		v = fabsf(s[i]);
+		max = v > max ? v : max;
+	}
+	return max;
+}
+
+/* the other formats are never silent */
+static float samples_peak(snd_pcm_format_t format, const void *buf,
+			  unsigned int count)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+		return peak_s16(buf, count);
+	case SND_PCM_FORMAT_S24:
+		return peak_s24(buf, count);
+	case SND_PCM_FORMAT_S24_3LE:
+		return peak_s24_3le(buf, count);
+	case SND_PCM_FORMAT_S32:
+		return peak_s32(buf, count);
+	case SND_PCM_FORMAT_FLOAT:
+		return peak_float(buf, count);
+	default:
+		return 1.0f;
+	}
+}
+
+static inline void idle_scan(struct loopback_handle *lhandle,
+			     const char *buf, snd_pcm_uframes_t frames)
+{
+	struct loopback *loop = lhandle->loopback;
+
+	if (samples_peak(lhandle->format, buf, frames * lhandle->channels) >
+	    loop->idle_level)
+		loop->idle_signal = monotonic_us();
+}
+
 static int readit(struct loopback_handle *lhandle)
 {
 	snd_pcm_sframes_t r, res = 0;
 	snd_pcm_sframes_t avail;
 	int err;
 
-	avail = snd_pcm_avail_update(lhandle->handle);
+	if (lhandle->source) {
+		/* the frames were read by the source loop */
+		r = lhandle->fanout_new ? lhandle->buf_count : 0;
+		lhandle->fanout_new = 0;
+		return r;
+	}
+	if (lhandle->ep)
+		avail = lhandle->ep->avail(lhandle);
+	else
+		avail = pcm_avail(lhandle);
 	if (avail == -EPIPE) {
 		return xrun(lhandle);
 	} else if (avail == -ESTRPIPE) {
 		if ((err = suspend(lhandle)) < 0)
 			return err;
 	}
-	if (avail > buf_avail(lhandle)) {
+	if (lhandle->fanout) {
+		if (avail > (snd_pcm_sframes_t)lhandle->buf_size)
+			avail = lhandle->buf_size;
+	} else if (avail > buf_avail(lhandle)) {
 		lhandle->buf_over += avail - buf_avail(lhandle);
 		avail = buf_avail(lhandle);
-	} else if (avail == 0) {
-		if (snd_pcm_state(lhandle->handle) == SND_PCM_STATE_DRAINING) {
+	} else if (avail == 0 && lhandle->handle) {
+		if (pcm_state(lhandle) == SND_PCM_STATE_DRAINING) {
 			lhandle->loopback->reinit = 1;
 			return 0;
 		}
 	}
 	while (avail > 0) {
-		r = buf_avail(lhandle);
+		r = lhandle->fanout ? lhandle->buf_size : buf_avail(lhandle);
 		if (r + lhandle->buf_pos > lhandle->buf_size)
 			r = lhandle->buf_size - lhandle->buf_pos;
 		if (r > avail)
 			r = avail;
-		r = snd_pcm_readi(lhandle->handle,
-				  lhandle->buf +
-				  lhandle->buf_pos *
-				  lhandle->frame_size, r);
+		if (lhandle->ep)
+			r = lhandle->ep->read(lhandle,
+					      lhandle->buf +
+					      lhandle->buf_pos *
+					      lhandle->frame_size, r);
+		else if (lhandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+			r = snd_pcm_mmap_readi(lhandle->handle,
+					       lhandle->buf +
+					       lhandle->buf_pos *
+					       lhandle->frame_size, r);
+		else
+			r = snd_pcm_readi(lhandle->handle,
+					  lhandle->buf +
+					  lhandle->buf_pos *
+					  lhandle->frame_size, r);
 		if (r == 0)
 			return res;
 		if (r < 0) {
@@ -674,31 +1765,57 @@ static int readit(struct loopback_handle *lhandle)
 				return res > 0 ? res : r;
 			}
 		}
-#ifdef FILE_CWRITE
-		if (lhandle->loopback->cfile)
-			fwrite(lhandle->buf + lhandle->buf_pos * lhandle->frame_size,
-			       r, lhandle->frame_size, lhandle->loopback->cfile);
-#endif
+		if (lhandle->tap)
+			tap_push(lhandle->tap, lhandle,
+				 lhandle->buf + lhandle->buf_pos *
+				 lhandle->frame_size, r);
+		if (lhandle->loopback->idle_hold)
+			idle_scan(lhandle, lhandle->buf + lhandle->buf_pos *
+				  lhandle->frame_size, r);
+		status_moved(lhandle, r);
 		res += r;
 		if (lhandle->max < res)
 			lhandle->max = res;
 		lhandle->counter += r;
-		lhandle->buf_count += r;
 		lhandle->buf_pos += r;
 		lhandle->buf_pos %= lhandle->buf_size;
+		if (lhandle->fanout)
+			fanout_add(lhandle, r);
+		else
+			lhandle->buf_count += r;
 		avail -= r;
 	}
 	return res;
 }
 
+static int stop_check(struct loopback_handle *lhandle, snd_pcm_sframes_t r)
+{
+	struct loopback *loop = lhandle->loopback;
+
+	if (!loop->stop_pending)
+		return 0;
+	loop->stop_count += r;
+	if (loop->stop_count * lhandle->pitch > loop->latency * 3) {
+		loop->stop_pending = 0;
+		loop->reinit = 1;
+		return 1;
+	}
+	return 0;
+}
+
 static int writeit(struct loopback_handle *lhandle)
 {
 	snd_pcm_sframes_t avail;
 	snd_pcm_sframes_t r, res = 0;
 	int err;
 
+	if (lhandle->source)	/* mix input, see buf_add_mix() */
+		return 0;
       __again:
-	avail = snd_pcm_avail_update(lhandle->handle);
+	if (lhandle->ep)
+		avail = lhandle->ep->avail(lhandle);
+	else
+		avail = pcm_avail(lhandle);
 	if (avail == -EPIPE) {
 		if ((err = xrun(lhandle)) < 0)
 			return err;
@@ -708,16 +1825,36 @@ static int writeit(struct loopback_handle *lhandle)
 			return err;
 		goto __again;
 	}
+	if (lhandle->loopback->latency_maxtime && !lhandle->ep &&
+	    lhandle->loopback->running && avail >= 0 &&
+	    avail <= (snd_pcm_sframes_t)lhandle->buffer_size) {
+		struct loopback *loop = lhandle->loopback;
+		snd_pcm_sframes_t delay = lhandle->buffer_size - avail;
+
+		if (loop->adapt_pdelay < 0 || delay < loop->adapt_pdelay)
+			loop->adapt_pdelay = delay;
+	}
 	while (avail > 0 && lhandle->buf_count > 0) {
 		r = lhandle->buf_count;
 		if (r + lhandle->buf_pos > lhandle->buf_size)
 			r = lhandle->buf_size - lhandle->buf_pos;
 		if (r > avail)
 			r = avail;
-		r = snd_pcm_writei(lhandle->handle,
-				   lhandle->buf +
-				   lhandle->buf_pos *
-				   lhandle->frame_size, r);
+		if (lhandle->ep)
+			r = lhandle->ep->write(lhandle,
+					       lhandle->buf +
+					       lhandle->buf_pos *
+					       lhandle->frame_size, r);
+		else if (lhandle->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+			r = snd_pcm_mmap_writei(lhandle->handle,
+						lhandle->buf +
+						lhandle->buf_pos *
+						lhandle->frame_size, r);
+		else
+			r = snd_pcm_writei(lhandle->handle,
+					   lhandle->buf +
+					   lhandle->buf_pos *
+					   lhandle->frame_size, r);
 		if (r <= 0) {
 			if (r == -EPIPE) {
 				if ((err = xrun(lhandle)) < 0)
@@ -727,28 +1864,117 @@ static int writeit(struct loopback_handle *lhandle)
 			}
 			return res > 0 ? res : r;
 		}
-#ifdef FILE_PWRITE
-		if (lhandle->loopback->pfile)
-			fwrite(lhandle->buf + lhandle->buf_pos * lhandle->frame_size,
-			       r, lhandle->frame_size, lhandle->loopback->pfile);
-#endif
-		res += r;
-		lhandle->counter += r;
-		lhandle->buf_count -= r;
-		lhandle->buf_pos += r;
-		lhandle->buf_pos %= lhandle->buf_size;
-		xrun_profile(lhandle->loopback);
-		if (lhandle->loopback->stop_pending) {
-			lhandle->loopback->stop_count += r;
-			if (lhandle->loopback->stop_count * lhandle->pitch >
-			    lhandle->loopback->latency * 3) {
-				lhandle->loopback->stop_pending = 0;
-				lhandle->loopback->reinit = 1;
-				break;
-			}
+		if (lhandle->tap)
+			tap_push(lhandle->tap, lhandle,
+				 lhandle->buf + lhandle->buf_pos *
+				 lhandle->frame_size, r);
+		status_moved(lhandle, r);
+		res += r;
+		lhandle->counter += r;
+		lhandle->buf_count -= r;
+		lhandle->buf_pos += r;
+		lhandle->buf_pos %= lhandle->buf_size;
+		xrun_profile(lhandle->loopback);
+		if (stop_check(lhandle, r))
+			break;
+	}
+	if (avail >= 0)
+		lhandle->queued = lhandle->buffer_size - (avail - res);
+	return res;
+}
+
+static int avail_check(struct loopback_handle *lhandle,
+		       snd_pcm_sframes_t *avail)
+{
+	int err;
+
+	*avail = pcm_avail_update(lhandle);
+	if (*avail == -EPIPE) {
+		*avail = 0;
+		return xrun(lhandle);
+	} else if (*avail == -ESTRPIPE) {
+		*avail = 0;
+		return suspend(lhandle);
+	} else if (*avail < 0) {
+		err = *avail;
+		*avail = 0;
+		return err;
+	}
+	return 0;
+}
+
+static int mmap_error(struct loopback_handle *lhandle, int err)
+{
+	if (err == -EPIPE)
+		return xrun(lhandle);
+	if (err == -ESTRPIPE)
+		return suspend(lhandle);
+	return err;
+}
+
+/*
+ * Copy the samples directly from the capture to the playback ring buffer
+ * using the mmap areas. The streams must share access, format, rate and
+ * channels and the intermediate buffer must be empty.
+ */
+static snd_pcm_sframes_t copyit(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	const snd_pcm_channel_area_t *careas, *pareas;
+	snd_pcm_uframes_t coffset, poffset, frames, pframes;
+	snd_pcm_sframes_t cavail, pavail, r, res = 0;
+	int err;
+
+	if ((err = avail_check(capt, &cavail)) < 0)
+		return err;
+	if (cavail == 0) {
+		if (pcm_state(capt) == SND_PCM_STATE_DRAINING)
+			loop->reinit = 1;
+		return 0;
+	}
+	if ((err = avail_check(play, &pavail)) < 0)
+		return err;
+	while (cavail > 0 && pavail > 0) {
+		frames = cavail < pavail ? cavail : pavail;
+		err = snd_pcm_mmap_begin(capt->handle, &careas, &coffset, &frames);
+		if (err < 0) {
+			err = mmap_error(capt, err);
+			break;
+		}
+		pframes = frames;
+		err = snd_pcm_mmap_begin(play->handle, &pareas, &poffset, &pframes);
+		if (err < 0) {
+			snd_pcm_mmap_commit(capt->handle, coffset, 0);
+			err = mmap_error(play, err);
+			break;
+		}
+		snd_pcm_areas_copy(pareas, poffset, careas, coffset,
+				   play->channels, pframes, play->format);
+		r = snd_pcm_mmap_commit(play->handle, poffset, pframes);
+		if (r < 0 || (snd_pcm_uframes_t)r != pframes) {
+			snd_pcm_mmap_commit(capt->handle, coffset, 0);
+			err = mmap_error(play, r < 0 ? r : -EPIPE);
+			break;
 		}
+		r = snd_pcm_mmap_commit(capt->handle, coffset, pframes);
+		if (r < 0 || (snd_pcm_uframes_t)r != pframes) {
+			err = mmap_error(capt, r < 0 ? r : -EPIPE);
+			break;
+		}
+		res += r;
+		if (capt->max < res)
+			capt->max = res;
+		capt->counter += r;
+		play->counter += r;
+		cavail -= r;
+		pavail -= r;
+		xrun_profile(loop);
+		if (stop_check(play, r))
+			break;
 	}
-	return res;
+	play->queued = play->buffer_size - pavail;
+	return res > 0 ? res : err;
 }
 
 static snd_pcm_sframes_t remove_samples(struct loopback *loop,
@@ -789,12 +2015,19 @@ static int xrun_sync(struct loopback *loop)
 	snd_pcm_sframes_t pdelay, cdelay, delay1, pdelay1, cdelay1, diff;
 	int err;
 
+	/* the recovery needs the current delays */
+	play->status_valid = 0;
+	capt->status_valid = 0;
       __again:
 	if (verbose > 5)
 		snd_output_printf(loop->output, "%s: xrun sync %i %i\n", loop->id, capt->xrun_pending, play->xrun_pending);
 	if (capt->xrun_pending) {
 	      __pagain:
 		capt->xrun_pending = 0;
+		if (capt->source)	/* restarted by the source loop */
+			goto __pdelay;
+		if (capt->ep)
+			goto __pdelay;
 		if ((err = snd_pcm_prepare(capt->handle)) < 0) {
 			logit(LOG_CRIT, "%s prepare failed: %s\n", capt->id, snd_strerror(err));
 			return err;
@@ -809,8 +2042,19 @@ static int xrun_sync(struct loopback *loop)
 		if (capt->xrun_pending)
 			goto __pagain;
 	}
+      __pdelay:
 	/* skip additional playback samples */
-	if ((err = snd_pcm_delay(capt->handle, &cdelay)) < 0) {
+	if (capt->ep) {
+		cdelay = capt->ep->delay(capt);
+		if (cdelay < 0)
+			cdelay = 0;
+		goto __play;
+	}
+	if ((err = pcm_delay(capt, &cdelay)) < 0) {
+		if (capt->source) {
+			cdelay = 0;
+			goto __play;
+		}
 		if (err == -EPIPE) {
 			capt->xrun_pending = 1;
 			goto __again;
@@ -824,7 +2068,15 @@ static int xrun_sync(struct loopback *loop)
 		logit(LOG_CRIT, "%s capture delay failed: %s\n", capt->id, snd_strerror(err));
 		return err;
 	}
-	if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0) {
+      __play:
+	if (play->source) {
+		/* the mix input only queues, the job owns the device */
+		pdelay = 0;
+		play->xrun_pending = 0;
+	} else if (play->ep) {
+		pdelay = play->ep->delay(play);
+		play->xrun_pending = 0;
+	} else if ((err = pcm_delay(play, &pdelay)) < 0) {
 		if (err == -EPIPE) {
 			pdelay = 0;
 			play->xrun_pending = 1;
@@ -849,9 +2101,8 @@ static int xrun_sync(struct loopback *loop)
 	cdelay1 = cdelay * capt->pitch;
 	pdelay1 = pdelay * play->pitch;
 	delay1 = cdelay1 + pdelay1;
-	capt->total_queued = 0;
-	play->total_queued = 0;
-	loop->total_queued_count = 0;
+	loop->sync_time = 0;
+	loop->sync_error = 0;
 	loop->pitch_diff = loop->pitch_diff_min = loop->pitch_diff_max = 0;
 	if (verbose > 6) {
 		snd_output_printf(loop->output,
@@ -870,7 +2121,8 @@ static int xrun_sync(struct loopback *loop)
 			"sync: cbufcount=%li, pbufcount=%li\n",
 			(long)capt->buf_count, (long)play->buf_count);
 	}
-	if (delay1 > fill && capt->counter > 0) {
+	if (delay1 > fill && capt->counter > 0 && !capt->source &&
+	    !capt->ep) {
 		if ((err = snd_pcm_drop(capt->handle)) < 0)
 			return err;
 		if ((err = snd_pcm_prepare(capt->handle)) < 0)
@@ -970,9 +2222,13 @@ static int xrun_sync(struct loopback *loop)
 	if (verbose > 5) {
 		snd_output_printf(loop->output, "%s: xrun sync ok\n", loop->id);
 		if (verbose > 6) {
-			if (snd_pcm_delay(capt->handle, &cdelay) < 0)
+			if (capt->ep)
+				cdelay = capt->ep->delay(capt);
+			else if (pcm_delay(capt, &cdelay) < 0)
 				cdelay = -1;
-			if (snd_pcm_delay(play->handle, &pdelay) < 0)
+			if (play->ep)
+				pdelay = play->ep->delay(play);
+			else if (pcm_delay(play, &pdelay) < 0)
 				pdelay = -1;
 			if (play->buf != capt->buf)
 				cdelay += capt->buf_count;
@@ -1061,7 +2317,8 @@ void update_pitch(struct loopback *loop)
 		}
 #endif
 	}
-	if (verbose)
+	loop->sync_pitch = pitch;
+	if (verbose > 1)
 		snd_output_printf(loop->output, "New pitch for %s: %.8f (min/max samples = %li/%li)\n", loop->id, pitch, loop->pitch_diff_min, loop->pitch_diff_max);
 }
 
@@ -1150,7 +2407,7 @@ static int openctl(struct loopback_handle *lhandle, int device, int subdevice)
 
 	lhandle->ctl_rate_shift = NULL;
 	if (lhandle->loopback->play == lhandle) {
-		if (lhandle->loopback->controls)
+		if (lhandle->loopback->controls || lhandle->loopback->volume)
 			goto __events;
 		return 0;
 	}
@@ -1171,7 +2428,7 @@ static int openctl(struct loopback_handle *lhandle, int device, int subdevice)
 	     lhandle->ctl_format &&
 	     lhandle->ctl_rate &&
 	     lhandle->ctl_channels) ||
-	    lhandle->loopback->controls) {
+	    lhandle->loopback->controls || lhandle->loopback->volume) {
 	      __events:
 		if ((err = snd_ctl_poll_descriptors_count(lhandle->ctl)) < 0)
 			lhandle->ctl_pollfd_count = 0;
@@ -1183,6 +2440,25 @@ static int openctl(struct loopback_handle *lhandle, int device, int subdevice)
 	return 0;
 }
 
+static const struct loopback_endpoint_ops *endpoint_ops[] = {
+	&endpoint_udp,
+	&endpoint_shm,
+	NULL
+};
+
+/* the devices with a known prefix are not PCMs */
+static const struct loopback_endpoint_ops *endpoint_find(const char *device)
+{
+	const struct loopback_endpoint_ops **ops;
+
+	if (device == NULL)
+		return NULL;
+	for (ops = endpoint_ops; *ops; ops++)
+		if (strncmp(device, (*ops)->prefix, strlen((*ops)->prefix)) == 0)
+			return *ops;
+	return NULL;
+}
+
 static int openit(struct loopback_handle *lhandle)
 {
 	snd_pcm_info_t *info;
@@ -1190,6 +2466,9 @@ static int openit(struct loopback_handle *lhandle)
 				SND_PCM_STREAM_PLAYBACK :
 				SND_PCM_STREAM_CAPTURE;
 	int err, card, device, subdevice;
+
+	if ((lhandle->ep = endpoint_find(lhandle->device)) != NULL)
+		return lhandle->ep->open(lhandle);
 	pcm_open_lock();
 	err = snd_pcm_open(&lhandle->handle, lhandle->device, stream, SND_PCM_NONBLOCK);
 	pcm_open_unlock();
@@ -1232,6 +2511,7 @@ static int freeit(struct loopback_handle *lhandle)
 {
 	free(lhandle->buf);
 	lhandle->buf = NULL;
+	lhandle->buf_bytes = 0;
 	return 0;
 }
 
@@ -1249,48 +2529,72 @@ static int closeit(struct loopback_handle *lhandle)
 	if (lhandle->handle)
 		err = snd_pcm_close(lhandle->handle);
 	lhandle->handle = NULL;
+	if (lhandle->ep && lhandle->ep_data)
+		lhandle->ep->close(lhandle);
+	hwcache_free(lhandle);
+	if (lhandle->status)
+		snd_pcm_status_free(lhandle->status);
+	lhandle->status = NULL;
+	lhandle->status_valid = 0;
 	return err;
 }
 
 static int init_handle(struct loopback_handle *lhandle, int alloc)
 {
 	snd_pcm_uframes_t lat;
+	size_t bytes;
+
 	lhandle->frame_size = (snd_pcm_format_physical_width(lhandle->format) 
 						/ 8) * lhandle->channels;
-	lhandle->sync_point = lhandle->rate * 15;	/* every 15 seconds */
 	lat = lhandle->loopback->latency;
 	if (lhandle->buffer_size > lat)
 		lat = lhandle->buffer_size;
 	lhandle->buf_size = lat * 2;
-	if (alloc) {
-		lhandle->buf = calloc(1, lhandle->buf_size * lhandle->frame_size);
-		if (lhandle->buf == NULL)
-			return -ENOMEM;
-	}
+	if (!alloc)
+		return 0;
+	bytes = lhandle->buf_size * lhandle->frame_size;
+	if (lhandle->buf && lhandle->buf_bytes == bytes)
+		return 0;	/* kept from the previous run */
+	freeit(lhandle);
+	lhandle->buf = calloc(1, bytes);
+	if (lhandle->buf == NULL)
+		return -ENOMEM;
+	lhandle->buf_bytes = bytes;
 	return 0;
 }
 
 int pcmjob_init(struct loopback *loop)
 {
+	unsigned long long t = monotonic_us();
 	int err;
 	char id[128];
 
-#ifdef FILE_CWRITE
-	loop->cfile = fopen(FILE_CWRITE, "w+");
-#endif
-#ifdef FILE_PWRITE
-	loop->pfile = fopen(FILE_PWRITE, "w+");
-#endif
-	if ((err = openit(loop->play)) < 0)
+	if (loop->play->source) {
+		/* the device was opened by the loop owning the mixer */
+		loop->play->handle = loop->play->source->handle;
+		loop->play->card_number = loop->play->source->card_number;
+		if (loop->sync == SYNC_TYPE_PLAYRATESHIFT)
+			loop->sync = SYNC_TYPE_AUTO;
+	} else if ((err = openit(loop->play)) < 0)
 		goto __error;
-	if ((err = openit(loop->capt)) < 0)
+	if (loop->capt->source) {
+		/* the device was opened by the fan-out source loop */
+		loop->capt->handle = loop->capt->source->handle;
+		loop->capt->card_number = loop->capt->source->card_number;
+		loop->slave = SLAVE_TYPE_OFF;
+		if (loop->sync == SYNC_TYPE_CAPTRATESHIFT)
+			loop->sync = SYNC_TYPE_AUTO;
+	} else if ((err = openit(loop->capt)) < 0)
 		goto __error;
 	snprintf(id, sizeof(id), "%s/%s", loop->play->id, loop->capt->id);
 	id[sizeof(id)-1] = '\0';
 	loop->id = strdup(id);
-	if (loop->sync == SYNC_TYPE_AUTO && loop->capt->ctl_rate_shift)
+	/* the capture rate is shared by all fan-out loops */
+	if (loop->sync == SYNC_TYPE_AUTO && loop->capt->ctl_rate_shift &&
+	    loop->capt->fanout == NULL)
 		loop->sync = SYNC_TYPE_CAPTRATESHIFT;
-	if (loop->sync == SYNC_TYPE_AUTO && loop->play->ctl_rate_shift)
+	if (loop->sync == SYNC_TYPE_AUTO && loop->play->ctl_rate_shift &&
+	    loop->play->mix == NULL)
 		loop->sync = SYNC_TYPE_PLAYRATESHIFT;
 #ifdef USE_SAMPLERATE
 	if (loop->sync == SYNC_TYPE_AUTO && loop->src_enable)
@@ -1298,6 +2602,15 @@ int pcmjob_init(struct loopback *loop)
 #endif
 	if (loop->sync == SYNC_TYPE_AUTO)
 		loop->sync = SYNC_TYPE_SIMPLE;
+	/* the UDP sender has no clock, the receiver follows the capture */
+	if (loop->play->ep == &endpoint_udp)
+		loop->sync = SYNC_TYPE_NONE;
+	/* nothing would move the buffer fill to a new latency */
+	if (loop->sync == SYNC_TYPE_NONE && loop->latency_maxtime) {
+		logit(LOG_WARNING, "%s: adaptive latency needs a sync mode, using the fixed %uus\n", loop->id, loop->latency_maxtime);
+		loop->latency_reqtime = loop->latency_maxtime;
+		loop->latency_maxtime = 0;
+	}
 	if (loop->slave == SLAVE_TYPE_AUTO &&
 	    loop->capt->ctl_notify &&
 	    loop->capt->ctl_active &&
@@ -1319,6 +2632,10 @@ int pcmjob_init(struct loopback *loop)
 	err = control_init(loop);
 	if (err < 0)
 		goto __error;
+	if (loop->volume && (err = volume_init(loop)) < 0)
+		goto __error;
+	if (verbose)
+		snd_output_printf(loop->output, "%s: opened in %lluus\n", loop->id, monotonic_us() - t);
 	return 0;
       __error:
 	pcmjob_done(loop);
@@ -1327,6 +2644,15 @@ int pcmjob_init(struct loopback *loop)
 
 static void freeloop(struct loopback *loop)
 {
+	effect_done(loop);
+	if (loop->volume)
+		volume_stop(loop);
+	dither_free(&loop->dither);
+	free(loop->float_in);
+	loop->float_in = loop->float_out = loop->float_mix = NULL;
+	loop->float_pipe = 0;
+	if (loop->route)
+		route_done(loop->route);
 #ifdef USE_SAMPLERATE
 	if (loop->use_samplerate) {
 		if (loop->src_state)
@@ -1338,6 +2664,16 @@ static void freeloop(struct loopback *loop)
 		loop->src_data.data_out = NULL;
 	}
 #endif
+	if (loop->capt->source)
+		loop->capt->buf = NULL;
+	if (loop->restart) {
+		/* the I/O buffers are reused by pcmjob_start() */
+		if (loop->play->buf == loop->capt->buf) {
+			loop->capt->buf = NULL;
+			loop->capt->buf_bytes = 0;
+		}
+		return;
+	}
 	if (loop->play->buf == loop->capt->buf)
 		loop->play->buf = NULL;
 	freeit(loop->play);
@@ -1347,23 +2683,19 @@ static void freeloop(struct loopback *loop)
 int pcmjob_done(struct loopback *loop)
 {
 	control_done(loop);
+	if (loop->volume)
+		volume_done(loop);
+	free(loop->pollfds);
+	loop->pollfds = NULL;
+	if (loop->play->source)
+		loop->play->handle = NULL;
 	closeit(loop->play);
+	if (loop->capt->source)
+		loop->capt->handle = NULL;
 	closeit(loop->capt);
 	freeloop(loop);
 	free(loop->id);
 	loop->id = NULL;
-#ifdef FILE_PWRITE
-	if (loop->pfile) {
-		fclose(loop->pfile);
-		loop->pfile = NULL;
-	}
-#endif
-#ifdef FILE_CWRITE
-	if (loop->cfile) {
-		fclose(loop->cfile);
-		loop->cfile = NULL;
-	}
-#endif
 	return 0;
 }
 
@@ -1372,41 +2704,183 @@ static void lhandle_start(struct loopback_handle *lhandle)
 	lhandle->buf_pos = 0;
 	lhandle->buf_count = 0;
 	lhandle->counter = 0;
-	lhandle->total_queued = 0;
 }
 
-static void fix_format(struct loopback *loop, int force)
+/* formats handled by the samplerate conversion */
+static int src_format_supported(snd_pcm_format_t format)
 {
-	snd_pcm_format_t format = loop->capt->format;
+	switch (format) {
+	case SND_PCM_FORMAT_S16:
+	case SND_PCM_FORMAT_S24:
+	case SND_PCM_FORMAT_S24_3LE:
+	case SND_PCM_FORMAT_S32:
+	case SND_PCM_FORMAT_FLOAT:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-	if (!force && loop->sync != SYNC_TYPE_SAMPLERATE)
-		return;
-	if (format == SND_PCM_FORMAT_S16 ||
-	    format == SND_PCM_FORMAT_S32)
+static void fix_handle_format(struct loopback_handle *lhandle)
+{
+	if (src_format_supported(lhandle->format))
 		return;
-	if (snd_pcm_format_width(format) > 16)
-		format = SND_PCM_FORMAT_S32;
+	if (snd_pcm_format_width(lhandle->format) > 16)
+		lhandle->format = SND_PCM_FORMAT_S32;
 	else
-		format = SND_PCM_FORMAT_S16;
-	loop->capt->format = format;
-	loop->play->format = format;
+		lhandle->format = SND_PCM_FORMAT_S16;
+}
+
+static void fix_format(struct loopback *loop, int force)
+{
+	if (!force && loop->sync != SYNC_TYPE_SAMPLERATE)
+		return;
+	fix_handle_format(loop->capt);
+	fix_handle_format(loop->play);
+}
+
+/*
+ * The float pipeline is used only when the samples are processed, a plain
+ * copy stays bit exact. The queue of a mixed input is not dithered, the
+ * playback loop dithers the sum.
+ */
+static int float_init(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	struct loopback_handle *play = loop->play;
+	int err;
+
+	if (!loop->float_req || play->buf == capt->buf ||
+	    (!loop->use_samplerate && loop->effects == NULL &&
+	     loop->volume == NULL && play->mix == NULL && capt->format == play->format &&
+	     (loop->route == NULL || loop->route->native)))
+		return 0;
+	if (!src_format_supported(capt->format) ||
+	    !src_format_supported(play->format)) {
+		logit(LOG_CRIT, "%s: float pipeline supports only %s, %s, %s, %s or %s formats (play=%s, capt=%s)\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S24), snd_pcm_format_name(SND_PCM_FORMAT_S24_3LE), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT), snd_pcm_format_name(play->format), snd_pcm_format_name(capt->format));
+		return -EIO;
+	}
+	loop->float_in = malloc(EFFECT_BLOCK * (capt->channels +
+						2 * play->channels) *
+				sizeof(float));
+	if (loop->float_in == NULL)
+		return -ENOMEM;
+	loop->float_out = loop->float_in + EFFECT_BLOCK * capt->channels;
+	loop->float_mix = loop->float_out + EFFECT_BLOCK * play->channels;
+	if (play->source == NULL) {
+		err = dither_init(&loop->dither, loop->dither_type,
+				  play->format, play->channels);
+		if (err < 0 && err != -EINVAL)
+			return err;
+	}
+	loop->float_pipe = 1;
+	if (verbose > 1)
+		snd_output_printf(loop->output, "%s: float pipeline, dither %s\n", loop->id, loop->dither.type != DITHER_NONE ? dither_name(loop->dither.type) : "none");
+	return 0;
+}
+
+/* the view follows the parameters and the buffer of the source */
+static void fanout_view_init(struct loopback_handle *capt)
+{
+	struct loopback_handle *source = capt->source;
+
+	capt->access = source->access;
+	capt->format = source->format;
+	capt->rate = source->rate;
+	capt->rate_req = source->rate_req;
+	capt->channels = source->channels;
+	capt->buffer_size = source->buffer_size;
+	capt->period_size = source->period_size;
+	capt->frame_size = source->frame_size;
+	capt->pitch = source->pitch;
+	capt->buf = source->buf;
+	capt->buf_size = source->buf_size;
+}
+
+static void mix_view_init(struct loopback_handle *play)
+{
+	struct loopback_handle *source = play->source;
+
+	play->access = source->access;
+	play->format = source->format;
+	play->rate = source->rate;
+	play->rate_req = source->rate_req;
+	play->channels = source->channels;
+	play->buffer_size = source->buffer_size;
+	play->period_size = source->period_size;
+	play->pitch = 1.0;
+}
+
+/* start the fan-out and mix loops when the owner loop is running */
+static void views_start(struct loopback *loop)
+{
+	struct loopback_handle *lhandle;
+
+	for (lhandle = loop->capt->fanout; lhandle; lhandle = lhandle->fanout) {
+		if (lhandle->loopback->running)
+			continue;
+		if (pcmjob_start(lhandle->loopback) < 0)
+			logit(LOG_WARNING, "%s: fan-out start failed\n", lhandle->loopback->id);
+	}
+	for (lhandle = loop->play->mix; lhandle; lhandle = lhandle->mix) {
+		if (lhandle->loopback->running)
+			continue;
+		if (pcmjob_start(lhandle->loopback) < 0)
+			logit(LOG_WARNING, "%s: mix input start failed\n", lhandle->loopback->id);
+	}
+}
+
+static void views_stop(struct loopback *loop)
+{
+	struct loopback_handle *lhandle;
+
+	for (lhandle = loop->capt->fanout; lhandle; lhandle = lhandle->fanout)
+		if (lhandle->loopback->running)
+			pcmjob_stop(lhandle->loopback);
+	for (lhandle = loop->play->mix; lhandle; lhandle = lhandle->mix)
+		if (lhandle->loopback->running)
+			pcmjob_stop(lhandle->loopback);
 }
 
 int pcmjob_start(struct loopback *loop)
 {
-	snd_pcm_uframes_t count;
+	unsigned long long t = monotonic_us();
+	int reinit = loop->reinit || loop->restart;
+	snd_pcm_uframes_t count, bufsize;
 	int err;
 
+	/* the shared loops are started from the owner, see views_start() */
+	if (loop->capt->source &&
+	    (loop->running || !loop->capt->source->loopback->running))
+		return 0;
+	if (loop->play->source &&
+	    (loop->running || !loop->play->source->loopback->running))
+		return 0;
+	loop->pollfds_changed = 1;
 	loop->pollfd_count = loop->play->ctl_pollfd_count +
 			     loop->capt->ctl_pollfd_count;
-	if ((err = snd_pcm_poll_descriptors_count(loop->play->handle)) < 0)
+	if (loop->play->source)
+		err = 0;
+	else if (loop->play->ep)
+		err = loop->play->ep->poll_descriptors_count(loop->play);
+	else if ((err = snd_pcm_poll_descriptors_count(loop->play->handle)) < 0)
 		goto __error;
 	loop->play->pollfd_count = err;
 	loop->pollfd_count += err;
-	if ((err = snd_pcm_poll_descriptors_count(loop->capt->handle)) < 0)
+	if (loop->capt->source)
+		err = 0;
+	else if (loop->capt->ep)
+		err = loop->capt->ep->poll_descriptors_count(loop->capt);
+	else if ((err = snd_pcm_poll_descriptors_count(loop->capt->handle)) < 0)
 		goto __error;
 	loop->capt->pollfd_count = err;
 	loop->pollfd_count += err;
+	if (loop->play->pollfd_count + loop->capt->pollfd_count == 0 &&
+	    !loop->play->source && !loop->capt->source) {
+		logit(LOG_CRIT, "%s: no device paces the loop\n", loop->id);
+		err = -EINVAL;
+		goto __error;
+	}
 	if (loop->slave == SLAVE_TYPE_ON) {
 		err = get_active(loop->capt);
 		if (err < 0)
@@ -1425,7 +2899,21 @@ int pcmjob_start(struct loopback *loop)
 		err = get_channels(loop->capt);
 		if (err < 0)
 			goto __error;
-		loop->play->channels = loop->capt->channels = err;
+		/* the routed playback channels are fixed */
+		loop->capt->channels = err;
+		if (loop->route == NULL)
+			loop->play->channels = err;
+	}
+	if (loop->capt->source)
+		fanout_view_init(loop->capt);
+	if (loop->play->source) {
+		mix_view_init(loop->play);
+		if (loop->route == NULL &&
+		    loop->capt->channels != loop->play->channels) {
+			logit(LOG_CRIT, "%s: mix input has %u channels, playback %u\n", loop->id, loop->capt->channels, loop->play->channels);
+			err = -EINVAL;
+			goto __error;
+		}
 	}
 	loop->reinit = 0;
 	loop->use_samplerate = 0;
@@ -1436,19 +2924,36 @@ __again:
 		loop->latency_req = 0;
 	}
 	loop->latency = time_to_frames(loop->play->rate_req, loop->latency_reqtime);
-	if ((err = setparams(loop, loop->latency/2)) < 0)
+	bufsize = loop->latency / 2;
+	if (loop->latency_maxtime)
+		bufsize = latency_init(loop);
+	if ((err = setparams(loop, bufsize)) < 0)
 		goto __error;
 	if (verbose)
 		showlatency(loop->output, loop->latency, loop->play->rate_req, "Latency");
 	if (loop->play->access == loop->capt->access &&
 	    loop->play->format == loop->capt->format &&
 	    loop->play->rate == loop->capt->rate &&
-	    loop->play->channels == loop->play->channels &&
-	    loop->sync != SYNC_TYPE_SAMPLERATE) {
+	    loop->play->channels == loop->capt->channels &&
+	    loop->sync != SYNC_TYPE_SAMPLERATE &&
+	    loop->capt->source == NULL && loop->capt->fanout == NULL &&
+	    loop->play->source == NULL && loop->route == NULL &&
+	    (!loop->float_req ||
+	     (loop->effects == NULL && loop->volume == NULL &&
+	      loop->play->mix == NULL))) {
 		if (verbose > 1)
 			snd_output_printf(loop->output, "shared buffer!!!\n");
+		/* the effects work on the intermediate buffer */
+		loop->zerocopy = loop->play->access == SND_PCM_ACCESS_MMAP_INTERLEAVED &&
+				 loop->effects == NULL && loop->play->mix == NULL &&
+				 loop->play->tap == NULL && loop->capt->tap == NULL &&
+				 loop->idle_hold == 0 && loop->volume == NULL;
+		if (verbose > 1 && loop->zerocopy)
+			snd_output_printf(loop->output, "%s: zero-copy mmap transfers\n", loop->id);
 		if ((err = init_handle(loop->play, 1)) < 0)
 			goto __error;
+		/* a buffer kept from a run with separated buffers */
+		freeit(loop->capt);
 		if ((err = init_handle(loop->capt, 0)) < 0)
 			goto __error;
 		if (loop->play->buf_size < loop->capt->buf_size) {
@@ -1461,25 +2966,25 @@ __again:
 			}
 			loop->play->buf = nbuf;
 			loop->play->buf_size = loop->capt->buf_size;
+			loop->play->buf_bytes = loop->play->buf_size *
+						loop->play->frame_size;
 		} else if (loop->capt->buf_size < loop->play->buf_size) {
-			char *nbuf = realloc(loop->capt->buf,
-					     loop->play->buf_size *
-					       loop->play->frame_size);
-			if (nbuf == NULL) {
-				err = -ENOMEM;
-				goto __error;
-			}
-			loop->capt->buf = nbuf;
 			loop->capt->buf_size = loop->play->buf_size;
 		}
 		loop->capt->buf = loop->play->buf;
 	} else {
+		loop->zerocopy = 0;
 		if ((err = init_handle(loop->play, 1)) < 0)
 			goto __error;
-		if ((err = init_handle(loop->capt, 1)) < 0)
+		if (!loop->capt->source &&
+		    (err = init_handle(loop->capt, 1)) < 0)
 			goto __error;
+		/* plain copy when only the buffers are separated,
+		   the router converts the formats itself */
 		if (loop->play->rate_req != loop->play->rate ||
-                    loop->capt->rate_req != loop->capt->rate) {
+                    loop->capt->rate_req != loop->capt->rate ||
+		    (loop->play->format != loop->capt->format &&
+		     loop->route == NULL)) {
                         snd_pcm_format_t format1, format2;
 			loop->use_samplerate = 1;
                         format1 = loop->play->format;
@@ -1502,18 +3007,22 @@ __again:
 		goto __error;		
 	}
 	if (loop->use_samplerate) {
-		if ((loop->capt->format != SND_PCM_FORMAT_S16 ||
-		    loop->play->format != SND_PCM_FORMAT_S16) &&
-		    (loop->capt->format != SND_PCM_FORMAT_S32 ||
-		     loop->play->format != SND_PCM_FORMAT_S32)) {
-			logit(LOG_CRIT, "samplerate conversion supports only %s or %s formats (play=%s, capt=%s)\n", snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(loop->play->format), snd_pcm_format_name(loop->capt->format));
+		if (!src_format_supported(loop->capt->format) ||
+		    !src_format_supported(loop->play->format)) {
+			logit(LOG_CRIT, "samplerate conversion supports only %s, %s, %s, %s or %s formats (play=%s, capt=%s)\n", snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S24), snd_pcm_format_name(SND_PCM_FORMAT_S24_3LE), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT), snd_pcm_format_name(loop->play->format), snd_pcm_format_name(loop->capt->format));
 			loop->use_samplerate = 0;
 			err = -EIO;
 			goto __error;		
 		}
 		loop->src_state = src_new(loop->src_converter_type,
 					  loop->play->channels, &err);
-		loop->src_data.data_in = calloc(1, sizeof(float)*loop->capt->channels*loop->capt->buf_size);
+		if (loop->src_state == NULL) {
+			logit(LOG_CRIT, "%s: samplerate converter error: %s\n", loop->id, src_strerror(err));
+			err = -EIO;
+			goto __error;
+		}
+		/* the input is routed to the playback channels */
+		loop->src_data.data_in = calloc(1, sizeof(float)*loop->play->channels*loop->capt->buf_size);
 		if (loop->src_data.data_in == NULL) {
 			err = -ENOMEM;
 			goto __error;
@@ -1530,13 +3039,48 @@ __again:
 	} else {
 		loop->src_state = NULL;
 	}
-#else
-	if (loop->sync == SYNC_TYPE_SAMPLERATE || loop->use_samplerate) {
-		logit(LOG_CRIT, "alsaloop is compiled without libsamplerate support\n");
+#endif
+	if (loop->route) {
+		err = route_init(loop->route, loop->capt, loop->play);
+		if (err == -EINVAL) {
+			logit(LOG_CRIT, "%s: route requires %u capture channels (have %u) and %u playback channels (have %u)\n", loop->id, loop->route->capt_channels, loop->capt->channels, loop->route->channels, loop->play->channels);
+			goto __error;
+		}
+		if (err < 0)
+			goto __error;
+		if (!loop->route->native &&
+		    (!src_format_supported(loop->capt->format) ||
+		     !src_format_supported(loop->play->format))) {
+			logit(LOG_CRIT, "%s: routing matrix supports only %s, %s, %s, %s or %s formats (play=%s, capt=%s)\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S24), snd_pcm_format_name(SND_PCM_FORMAT_S24_3LE), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT), snd_pcm_format_name(loop->play->format), snd_pcm_format_name(loop->capt->format));
+			err = -EIO;
+			goto __error;
+		}
+	}
+	if (loop->play->mix && !src_format_supported(loop->play->format)) {
+		logit(LOG_CRIT, "%s: mixing supports only %s, %s, %s, %s or %s formats (play=%s)\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S24), snd_pcm_format_name(SND_PCM_FORMAT_S24_3LE), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT), snd_pcm_format_name(loop->play->format));
 		err = -EIO;
 		goto __error;
 	}
-#endif
+	if (loop->effects) {
+		if (!src_format_supported(loop->play->format)) {
+			logit(LOG_CRIT, "%s: effects support only %s, %s, %s, %s or %s formats (play=%s)\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S24), snd_pcm_format_name(SND_PCM_FORMAT_S24_3LE), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT), snd_pcm_format_name(loop->play->format));
+			err = -EIO;
+			goto __error;
+		}
+		if ((err = effect_init(loop)) < 0)
+			goto __error;
+	}
+	if (loop->volume) {
+		if (!src_format_supported(loop->play->format)) {
+			logit(LOG_CRIT, "%s: volume supports only %s, %s, %s, %s or %s formats (play=%s)\n", loop->id, snd_pcm_format_name(SND_PCM_FORMAT_S16), snd_pcm_format_name(SND_PCM_FORMAT_S24), snd_pcm_format_name(SND_PCM_FORMAT_S24_3LE), snd_pcm_format_name(SND_PCM_FORMAT_S32), snd_pcm_format_name(SND_PCM_FORMAT_FLOAT), snd_pcm_format_name(loop->play->format));
+			err = -EIO;
+			goto __error;
+		}
+		if ((err = volume_start(loop)) < 0)
+			goto __error;
+	}
+	if ((err = float_init(loop)) < 0)
+		goto __error;
 	if (verbose) {
 		snd_output_printf(loop->output, "%s sync type: %s", loop->id, sync_types[loop->sync]);
 #ifdef USE_SAMPLERATE
@@ -1547,6 +3091,12 @@ __again:
 	}
 	lhandle_start(loop->play);
 	lhandle_start(loop->capt);
+	if (loop->capt->ep)
+		loop->capt->ep->start(loop->capt);
+	if (loop->capt->source) {
+		loop->capt->buf_pos = loop->capt->source->buf_pos;
+		loop->capt->fanout_new = 0;
+	}
 	if ((err = snd_pcm_format_set_silence(loop->play->format,
 					      loop->play->buf,
 					      loop->play->buf_size * loop->play->channels)) < 0) {
@@ -1555,12 +3105,20 @@ __again:
 	}
 	if (verbose > 4)
 		snd_output_printf(loop->output, "%s: capt->buffer_size = %li, play->buffer_size = %li\n", loop->id, loop->capt->buf_size, loop->play->buf_size);
-	loop->pitch = 1.0;
+	/* the clock drift of the devices does not depend on the parameters */
+	if (!loop->restart)
+		loop->sync_integral = 0;
+	loop->pitch = 1.0 + loop->sync_integral;
 	update_pitch(loop);
 	loop->pitch_delta = 1.0 / ((double)loop->capt->rate * 4);
-	loop->total_queued_count = 0;
 	loop->pitch_diff = 0;
-	count = get_whole_latency(loop) / loop->play->pitch;
+	loop->sync_error = 0;
+	loop->sync_time = 0;
+	/* the receiver queues the latency, the sender sends at once */
+	if (loop->play->ep == &endpoint_udp)
+		count = 0;
+	else
+		count = get_whole_latency(loop) / loop->play->pitch;
 	loop->play->buf_count = count;
 	if (loop->play->buf == loop->capt->buf)
 		loop->capt->buf_pos = count;
@@ -1569,29 +3127,41 @@ __again:
 		snd_output_printf(loop->output, "%s: silence queued %i samples\n", loop->id, err);
 	if (count > loop->play->buffer_size)
 		count = loop->play->buffer_size;
-	if (err != count) {
+	if (err != count && !loop->play->source) {
 		logit(LOG_CRIT, "%s: initial playback fill error (%i/%i/%i)\n", loop->id, err, (int)count, loop->play->buffer_size);
 		err = -EIO;
 		goto __error;
 	}
 	loop->running = 1;
+	/* read by pool_balance() */
+	__atomic_store_n(&loop->period_time, loop->play->rate ?
+			 (unsigned long long)loop->play->period_size * 1000000 /
+			 loop->play->rate : 0, __ATOMIC_RELAXED);
 	loop->stop_pending = 0;
+	loop->idle_signal = monotonic_us();
 	if (loop->xrun) {
 		getcurtimestamp(&loop->xrun_last_update);
 		loop->xrun_last_pdelay = XRUN_PROFILE_UNKNOWN;
 		loop->xrun_last_cdelay = XRUN_PROFILE_UNKNOWN;
 		loop->xrun_max_proctime = 0;
 	}
-	if ((err = snd_pcm_start(loop->capt->handle)) < 0) {
+	if (!loop->capt->source && !loop->capt->ep &&
+	    (err = snd_pcm_start(loop->capt->handle)) < 0) {
 		logit(LOG_CRIT, "pcm start %s error: %s\n", loop->capt->id, snd_strerror(err));
 		goto __error;
 	}
-	if (!loop->linked) {
+	if (!loop->linked && !loop->play->source && !loop->play->ep) {
 		if ((err = snd_pcm_start(loop->play->handle)) < 0) {
 			logit(LOG_CRIT, "pcm start %s error: %s\n", loop->play->id, snd_strerror(err));
 			goto __error;
 		}
 	}
+	update_deadline(loop);
+	if (loop->stats)
+		stats_update(loop);
+	if (verbose)
+		snd_output_printf(loop->output, "%s: %s in %lluus\n", loop->id, reinit ? "reinitialized" : "started", monotonic_us() - t);
+	views_start(loop);
 	return 0;
       __error:
 	pcmjob_stop(loop);
@@ -1602,44 +3172,209 @@ int pcmjob_stop(struct loopback *loop)
 {
 	int err;
 
+	loop->pollfds_changed = 1;
+	loop->play->status_valid = 0;
+	loop->capt->status_valid = 0;
+	/* the fan-out and mix loops use the devices of this loop */
+	views_stop(loop);
 	if (loop->running) {
-		if ((err = snd_pcm_drop(loop->capt->handle)) < 0)
+		if (!loop->capt->source && !loop->capt->ep &&
+		    (err = snd_pcm_drop(loop->capt->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_drop(loop->play->handle)) < 0)
+		if (!loop->play->source && !loop->play->ep &&
+		    (err = snd_pcm_drop(loop->play->handle)) < 0)
 			logit(LOG_WARNING, "pcm drop %s error: %s\n", loop->play->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->capt->handle)) < 0)
-			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->capt->id, snd_strerror(err));
-		if ((err = snd_pcm_hw_free(loop->play->handle)) < 0)
-			logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->play->id, snd_strerror(err));
+		/* a partial restart decides in setparams_keep() */
+		if (!loop->restart && !loop->capt->source && !loop->capt->ep) {
+			loop->capt->hwconfig = NULL;
+			if ((err = snd_pcm_hw_free(loop->capt->handle)) < 0)
+				logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->capt->id, snd_strerror(err));
+		}
+		if (!loop->restart && !loop->play->source && !loop->play->ep) {
+			loop->play->hwconfig = NULL;
+			if ((err = snd_pcm_hw_free(loop->play->handle)) < 0)
+				logit(LOG_WARNING, "pcm hw_free %s error: %s\n", loop->play->id, snd_strerror(err));
+		}
 		loop->running = 0;
+		__atomic_store_n(&loop->period_time, 0, __ATOMIC_RELAXED);
+	}
+	if (loop->idle) {
+		loop->idle_time += monotonic_us() - loop->idle_start;
+		loop->idle = 0;
 	}
 	freeloop(loop);
+	if (loop->stats)
+		stats_update(loop);
+	return 0;
+}
+
+/*
+ * Restart after a change of the slave parameters or a drained stream.
+ * Unlike pcmjob_stop() with pcmjob_start(), the hw parameters of a device
+ * stay installed when its request did not change, the I/O buffers of the
+ * same size are reused and the learned drift is carried over.
+ */
+static int pcmjob_restart(struct loopback *loop)
+{
+	int err;
+
+	loop->restart = 1;
+	pcmjob_stop(loop);
+	err = pcmjob_start(loop);
+	loop->restart = 0;
+	return err;
+}
+
+/*
+ * Idle playback (-I): after the hold time of silence on the capture side
+ * (and on the mixed inputs), the playback device is stopped and only
+ * the capture wakes the loop. The captured frames are still scanned and
+ * dropped. The first block with a signal is kept and the playback
+ * is restarted like after an underrun, within the same pass.
+ */
+static unsigned long long idle_signal(struct loopback *loop)
+{
+	struct loopback_handle *in;
+	unsigned long long t;
+
+	t = loop->capt->source ? loop->capt->source->loopback->idle_signal :
+				 loop->idle_signal;
+	for (in = loop->play->mix; in; in = in->mix)
+		if (in->loopback->running && in->loopback->idle_signal > t)
+			t = in->loopback->idle_signal;
+	return t;
+}
+
+/* the queued frames are silence */
+static void idle_drop(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *in;
+
+	play->buf_pos = (play->buf_pos + play->buf_count) % play->buf_size;
+	play->buf_count = 0;
+	loop->capt->buf_count = 0;
+	for (in = play->mix; in; in = in->mix) {
+		in->buf_pos = (in->buf_pos + in->buf_count) % in->buf_size;
+		in->buf_count = 0;
+	}
+}
+
+static int idle_enter(struct loopback *loop, unsigned long long now)
+{
+	struct loopback_handle *play = loop->play;
+	int err;
+
+	if ((err = snd_pcm_drop(play->handle)) < 0 ||
+	    (err = snd_pcm_prepare(play->handle)) < 0) {
+		logit(LOG_CRIT, "%s idle stop failed: %s\n", play->id, snd_strerror(err));
+		return err;
+	}
+	idle_drop(loop);
+	play->queued = 0;
+	play->status_valid = 0;
+	loop->idle = 1;
+	loop->idle_start = now;
+	loop->idle_count++;
+	/* no wakeups from the stopped playback */
+	loop->pollfds_changed = 1;
+	if (verbose)
+		snd_output_printf(loop->output, "%s: silence, playback stopped\n", loop->id);
+	return 0;
+}
+
+static void idle_leave(struct loopback *loop, unsigned long long now)
+{
+	loop->idle = 0;
+	loop->idle_time += now - loop->idle_start;
+	loop->pollfds_changed = 1;
+	/* xrun_sync() fills the latency and starts the playback */
+	loop->play->xrun_pending = 1;
+	if (verbose)
+		snd_output_printf(loop->output, "%s: signal, playback restarted after %.1fs\n", loop->id, (now - loop->idle_start) / 1000000.0);
+}
+
+/* after the transfers, returns a negative error code */
+static int idle_update(struct loopback *loop)
+{
+	struct loopback_handle *play = loop->play;
+	unsigned long long now;
+
+	if (play->source || play->ep || loop->linked || loop->idle ||
+	    play->xrun_pending || loop->capt->xrun_pending)
+		return 0;
+	now = monotonic_us();
+	if (now - idle_signal(loop) < loop->idle_hold * 1000ULL)
+		return 0;
+	return idle_enter(loop, now);
+}
+
+/* while idle, returns 1 when the captured frames are kept */
+static int idle_check(struct loopback *loop)
+{
+	unsigned long long now;
+
+	if (idle_signal(loop) <= loop->idle_start) {
+		idle_drop(loop);
+		return 0;
+	}
+	now = monotonic_us();
+	idle_leave(loop, now);
+	return 1;
+}
+
+/* the capture is restarted, the playback stays stopped */
+static int idle_xrun(struct loopback *loop)
+{
+	struct loopback_handle *capt = loop->capt;
+	int err;
+
+	capt->xrun_pending = 0;
+	if (capt->source || capt->ep)
+		return 0;
+	if ((err = snd_pcm_prepare(capt->handle)) < 0 ||
+	    (err = snd_pcm_start(capt->handle)) < 0) {
+		logit(LOG_CRIT, "%s restart failed: %s\n", capt->id, snd_strerror(err));
+		return err;
+	}
 	return 0;
 }
 
 int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 {
+	unsigned int i;
 	int err, idx = 0;
 
 	if (loop->running) {
-		err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
-		if (err < 0)
-			return err;
+		if (loop->play->pollfd_count > 0 && loop->play->ep) {
+			loop->play->ep->poll_descriptors(loop->play, fds + idx, loop->play->pollfd_count);
+		} else if (loop->play->pollfd_count > 0) {
+			err = snd_pcm_poll_descriptors(loop->play->handle, fds + idx, loop->play->pollfd_count);
+			if (err < 0)
+				return err;
+			if (loop->idle)
+				for (i = 0; i < loop->play->pollfd_count; i++)
+					fds[idx + i].events = 0;
+		}
 		idx += loop->play->pollfd_count;
-		err = snd_pcm_poll_descriptors(loop->capt->handle, fds + idx, loop->capt->pollfd_count);
-		if (err < 0)
-			return err;
+		if (loop->capt->pollfd_count > 0 && loop->capt->ep) {
+			loop->capt->ep->poll_descriptors(loop->capt, fds + idx, loop->capt->pollfd_count);
+		} else if (loop->capt->pollfd_count > 0) {
+			err = snd_pcm_poll_descriptors(loop->capt->handle, fds + idx, loop->capt->pollfd_count);
+			if (err < 0)
+				return err;
+		}
 		idx += loop->capt->pollfd_count;
 	}
 	if (loop->play->ctl_pollfd_count > 0 &&
-	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
+	    (loop->slave == SLAVE_TYPE_ON || loop->controls || loop->volume)) {
 		err = snd_ctl_poll_descriptors(loop->play->ctl, fds + idx, loop->play->ctl_pollfd_count);
 		if (err < 0)
 			return err;
 		idx += loop->play->ctl_pollfd_count;
 	}
 	if (loop->capt->ctl_pollfd_count > 0 &&
-	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
+	    (loop->slave == SLAVE_TYPE_ON || loop->controls || loop->volume)) {
 		err = snd_ctl_poll_descriptors(loop->capt->ctl, fds + idx, loop->capt->ctl_pollfd_count);
 		if (err < 0)
 			return err;
@@ -1649,31 +3384,102 @@ int pcmjob_pollfds_init(struct loopback *loop, struct pollfd *fds)
 	return idx;
 }
 
-static snd_pcm_sframes_t get_queued_playback_samples(struct loopback *loop)
+static inline double htstamp_to_sec(const snd_htimestamp_t *ts)
 {
-	snd_pcm_sframes_t delay;
-	int err;
-
-	if ((err = snd_pcm_delay(loop->play->handle, &delay)) < 0)
-		return 0;
-	loop->play->last_delay = delay;
-	delay += loop->play->buf_count;
-#ifdef USE_SAMPLERATE
-	delay += loop->src_out_frames;
-#endif
-	return delay;
+	return ts->tv_sec + ts->tv_nsec / 1000000000.0;
 }
 
-static snd_pcm_sframes_t get_queued_capture_samples(struct loopback *loop)
+/*
+ * Drift controller. The queued samples of both streams are taken from
+ * the status snapshots and the capture delay is moved to the time of the
+ * playback timestamp. The latency error is low-pass filtered and fed to
+ * a PI controller (damping 0.707) which steers the pitch. Its gains are
+ * derived from the loop bandwidth (sync_bw) and the measured interval.
+ */
+static void sync_update(struct loopback *loop)
 {
-	snd_pcm_sframes_t delay;
-	int err;
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+	snd_htimestamp_t pts, cts;
+	double pqueued, cqueued, ptime, ctime, dt, error, wn, a;
 
-	if ((err = snd_pcm_delay(loop->capt->handle, &delay)) < 0)
-		return 0;
-	loop->capt->last_delay = delay;
-	delay += loop->capt->buf_count;
-	return delay;
+	/* an endpoint has no clock, the other device is the reference */
+	if (play->ep && capt->ep)
+		return;
+	/* the shared devices have no snapshot in this loop */
+	if ((!play->ep && !play->status_valid && status_query(play) < 0) ||
+	    (!capt->ep && !capt->status_valid && status_query(capt) < 0))
+		return;
+	if ((!play->ep && play->status_state != SND_PCM_STATE_RUNNING) ||
+	    (!capt->ep && capt->status_state != SND_PCM_STATE_RUNNING))
+		return;
+	if (!play->ep)
+		snd_pcm_status_get_htstamp(play->status, &pts);
+	if (!capt->ep)
+		snd_pcm_status_get_htstamp(capt->status, &cts);
+	if (play->ep)
+		pts = cts;
+	if (capt->ep)
+		cts = pts;
+	ptime = htstamp_to_sec(&pts);
+	ctime = htstamp_to_sec(&cts);
+	pqueued = play->buf_count;
+	if (play->ep)
+		pqueued += play->ep->delay(play);
+	else if (!play->source)	/* a mix input only queues */
+		pqueued += play->status_delay;
+#ifdef USE_SAMPLERATE
+	pqueued += loop->src_out_frames;
+#endif
+	/* the frames queued in the endpoint */
+	if (capt->ep)
+		cqueued = capt->ep->delay(capt);
+	else
+		cqueued = capt->status_delay;
+	if (ptime > 0 && ctime > 0)
+		cqueued += (ptime - ctime) * capt->rate;
+	if (play->buf != capt->buf)
+		cqueued += capt->buf_count;
+	if (verbose > 4)
+		snd_output_printf(loop->output, "%s: queued %.0f/%.0f samples\n", loop->id, pqueued, cqueued);
+	error = pqueued * play->pitch + cqueued * capt->pitch -
+		(double)get_whole_latency(loop);
+	if (ptime <= 0) {
+		snd_timestamp_t t;
+		getcurtimestamp(&t);
+		ptime = t.tv_sec + t.tv_usec / 1000000.0;
+	}
+	dt = ptime - loop->sync_time;
+	if (loop->sync_time == 0 || dt <= 0 || dt > 1) {
+		/* first measurement or a gap, restart the interval */
+		loop->sync_time = ptime;
+		return;
+	}
+	loop->sync_time = ptime;
+	wn = 2 * M_PI * loop->sync_bw;
+	a = dt * wn * 4;
+	loop->sync_error += (error - loop->sync_error) * (a < 1 ? a : 1);
+	loop->sync_integral += wn * wn / play->rate_req * loop->sync_error * dt;
+	if (loop->sync_integral > SYNC_PITCH_MAX)
+		loop->sync_integral = SYNC_PITCH_MAX;
+	else if (loop->sync_integral < -SYNC_PITCH_MAX)
+		loop->sync_integral = -SYNC_PITCH_MAX;
+	loop->pitch = 1.0 + loop->sync_integral +
+		      2 * 0.7071 * wn / play->rate_req * loop->sync_error;
+	if (loop->pitch > 1.0 + 2 * SYNC_PITCH_MAX)
+		loop->pitch = 1.0 + 2 * SYNC_PITCH_MAX;
+	else if (loop->pitch < 1.0 - 2 * SYNC_PITCH_MAX)
+		loop->pitch = 1.0 - 2 * SYNC_PITCH_MAX;
+	loop->pitch_diff = loop->sync_error;
+	if (loop->pitch_diff_min > loop->pitch_diff)
+		loop->pitch_diff_min = loop->pitch_diff;
+	if (loop->pitch_diff_max < loop->pitch_diff)
+		loop->pitch_diff_max = loop->pitch_diff;
+	if (verbose > 3)
+		snd_output_printf(loop->output, "%s: sync error %.2f (raw %.2f) pitch %.8f\n", loop->id, loop->sync_error, error, loop->pitch);
+	/* avoid the control element writes for tiny changes */
+	if (fabs(loop->pitch - loop->sync_pitch) >= loop->pitch_delta)
+		update_pitch(loop);
 }
 
 static int ctl_event_check(snd_ctl_elem_value_t *val, snd_ctl_event_t *ev)
@@ -1726,8 +3532,18 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 			continue;
 		}
 	      __ctl_check:
+		if (loop->volume && volume_event(loop, lhandle->ctl, ev))
+			continue;
 		control_event(lhandle, ev);
 	}
+	/*
+	 * Without the PCM Slave Active element the events are mixer changes
+	 * (-m, -V), which do not stop the stream.
+	 */
+	if (lhandle->ctl_active == NULL && !restart)
+		return 0;
+	if (lhandle->ctl_active == NULL)
+		goto __restart;
 	err = get_active(lhandle);
 	if (verbose > 7)
 		snd_output_printf(loop->output, "%s: ctl event active %i\n", lhandle->id, err);
@@ -1741,9 +3557,9 @@ static int handle_ctl_events(struct loopback_handle *lhandle,
 		if (loop->running == 0)
 			restart = 1;
 	}
+      __restart:
 	if (restart) {
-		pcmjob_stop(loop);
-		err = pcmjob_start(loop);
+		err = pcmjob_restart(loop);
 		if (err < 0)
 			return err;
 	}
@@ -1756,36 +3572,52 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 	struct loopback_handle *capt = loop->capt;
 	unsigned short prevents, crevents, events;
 	snd_pcm_uframes_t ccount, pcount;
-	int err, loopcount = 10, idx;
+	snd_pcm_sframes_t copied;
+	int err, loopcount = 10, idx, idle = loop->idle;
 
 	if (verbose > 11)
 		snd_output_printf(loop->output, "%s: pollfds handle\n", loop->id);
-	if (verbose > 13 || loop->xrun)
+	loop->wakes++;
+	if (verbose > 13 || loop->xrun || loop->stats || loop->balance)
 		getcurtimestamp(&loop->tstamp_start);
-	if (verbose > 12) {
+	if (verbose > 12 && play->handle && capt->handle) {
 		snd_pcm_sframes_t pdelay, cdelay;
-		if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0)
+		if ((err = pcm_delay(play, &pdelay)) < 0)
 			snd_output_printf(loop->output, "%s: delay error: %s / %li / %li\n", play->id, snd_strerror(err), play->buf_size, play->buf_count);
 		else
 			snd_output_printf(loop->output, "%s: delay %li / %li / %li\n", play->id, pdelay, play->buf_size, play->buf_count);
-		if ((err = snd_pcm_delay(capt->handle, &cdelay)) < 0)
+		if ((err = pcm_delay(capt, &cdelay)) < 0)
 			snd_output_printf(loop->output, "%s: delay error: %s / %li / %li\n", capt->id, snd_strerror(err), capt->buf_size, capt->buf_count);
 		else
 			snd_output_printf(loop->output, "%s: delay %li / %li / %li\n", capt->id, cdelay, capt->buf_size, capt->buf_count);
 	}
 	idx = 0;
 	if (loop->running) {
-		err = snd_pcm_poll_descriptors_revents(play->handle, fds,
-						       play->pollfd_count,
-						       &prevents);
-		if (err < 0)
-			return err;
+		prevents = 0;
+		if (play->pollfd_count > 0 && play->ep) {
+			err = play->ep->poll_descriptors_revents(play, fds,
+								 play->pollfd_count,
+								 &prevents);
+		} else if (play->pollfd_count > 0) {
+			err = snd_pcm_poll_descriptors_revents(play->handle, fds,
+							       play->pollfd_count,
+							       &prevents);
+			if (err < 0)
+				return err;
+		}
 		idx += play->pollfd_count;
-		err = snd_pcm_poll_descriptors_revents(capt->handle, fds + idx,
-						       capt->pollfd_count,
-						       &crevents);
-		if (err < 0)
-			return err;
+		crevents = 0;
+		if (capt->pollfd_count > 0 && capt->ep) {
+			err = capt->ep->poll_descriptors_revents(capt, fds + idx,
+								 capt->pollfd_count,
+								 &crevents);
+		} else if (capt->pollfd_count > 0) {
+			err = snd_pcm_poll_descriptors_revents(capt->handle, fds + idx,
+							       capt->pollfd_count,
+							       &crevents);
+			if (err < 0)
+				return err;
+		}
 		idx += capt->pollfd_count;
 		if (loop->xrun) {
 			if (prevents || crevents) {
@@ -1799,7 +3631,7 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		prevents = crevents = 0;
 	}
 	if (play->ctl_pollfd_count > 0 &&
-	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
+	    (loop->slave == SLAVE_TYPE_ON || loop->controls || loop->volume)) {
 		err = snd_ctl_poll_descriptors_revents(play->ctl, fds + idx,
 						       play->ctl_pollfd_count,
 						       &events);
@@ -1815,7 +3647,7 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		idx += play->ctl_pollfd_count;
 	}
 	if (capt->ctl_pollfd_count > 0 &&
-	    (loop->slave == SLAVE_TYPE_ON || loop->controls)) {
+	    (loop->slave == SLAVE_TYPE_ON || loop->controls || loop->volume)) {
 		err = snd_ctl_poll_descriptors_revents(capt->ctl, fds + idx,
 						       capt->ctl_pollfd_count,
 						       &events);
@@ -1834,10 +3666,40 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 		snd_output_printf(loop->output, "%s: prevents = 0x%x, crevents = 0x%x\n", loop->id, prevents, crevents);
 	if (!loop->running)
 		goto __pcm_end;
+	if (!loop->idle)
+		status_take(play);
+	status_take(capt);
 	do {
+		if (loop->zerocopy && play->buf_count == 0) {
+			/* the intermediate buffer is empty, transfer
+			   directly and use it only when the capture
+			   ring buffer is getting full */
+			copied = copyit(loop);
+			if (copied < 0)
+				return copied;
+			ccount = pcount = copied;
+			if (capt->xrun_pending || play->xrun_pending ||
+			    loop->reinit)
+				break;
+			if (copied > 0) {
+				loopcount--;
+				continue;
+			}
+			if (pcm_avail_update(capt) <
+			    (snd_pcm_sframes_t)capt->buffer_size / 2)
+				break;
+		}
 		ccount = readit(capt);
+		if (loop->idle && !idle_check(loop)) {
+			pcount = 0;
+			if (capt->xrun_pending || loop->reinit)
+				break;
+			loopcount--;
+			continue;
+		}
 		buf_add(loop, ccount);
-		if (capt->xrun_pending || loop->reinit)
+		/* the playback is restarted by xrun_sync() */
+		if (capt->xrun_pending || play->xrun_pending || loop->reinit)
 			break;
 		/* we read new samples, if we have a room in the playback
 		   buffer, feed them there */
@@ -1847,85 +3709,68 @@ int pcmjob_pollfds_handle(struct loopback *loop, struct pollfd *fds)
 			break;
 		loopcount--;
 	} while ((ccount > 0 || pcount > 0) && loopcount > 0);
+	if (loop->idle) {
+		if (capt->xrun_pending && (err = idle_xrun(loop)) < 0)
+			return err;
+		/* nothing to drain */
+		if (loop->stop_pending) {
+			loop->stop_pending = 0;
+			loop->reinit = 1;
+		}
+		if (loop->reinit && (err = pcmjob_restart(loop)) < 0)
+			return err;
+		goto __idle;
+	}
 	if (play->xrun_pending || capt->xrun_pending) {
+		/* not an underrun when the playback was idle */
+		if (loop->latency_maxtime && !idle)
+			latency_step(loop, ADAPT_GROW, "xrun", 1);
 		if ((err = xrun_sync(loop)) < 0)
 			return err;
 	}
 	if (loop->reinit) {
-		err = pcmjob_stop(loop);
-		if (err < 0)
-			return err;
-		err = pcmjob_start(loop);
+		err = pcmjob_restart(loop);
 		if (err < 0)
 			return err;
 	}
-	if (loop->sync != SYNC_TYPE_NONE &&
-	    play->counter >= play->sync_point &&
-	    capt->counter >= play->sync_point) {
-		snd_pcm_sframes_t diff, lat = get_whole_latency(loop);
-		diff = ((double)(((double)play->total_queued * play->pitch) +
-				 ((double)capt->total_queued * capt->pitch)) /
-			(double)loop->total_queued_count) - lat;
-		/* FIXME: this algorithm may be slightly better */
-		if (verbose > 3)
-			snd_output_printf(loop->output, "%s: sync diff %li old diff %li\n", loop->id, diff, loop->pitch_diff);
-		if (diff > 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch += loop->pitch_delta;
-			else if (diff > loop->pitch_diff)
-				loop->pitch += loop->pitch_delta*2;
-		} else if (diff < 0) {
-			if (diff == loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta;
-			else if (diff < loop->pitch_diff)
-				loop->pitch -= loop->pitch_delta*2;
-		}
-		loop->pitch_diff = diff;
-		if (loop->pitch_diff_min > diff)
-			loop->pitch_diff_min = diff;
-		if (loop->pitch_diff_max < diff)
-			loop->pitch_diff_max = diff;
-		update_pitch(loop);
-		play->counter -= play->sync_point;
-		capt->counter -= play->sync_point;
-		play->total_queued = 0;
-		capt->total_queued = 0;
-		loop->total_queued_count = 0;
-	}
-	if (loop->sync != SYNC_TYPE_NONE) {
-		snd_pcm_sframes_t pqueued, cqueued;
-		pqueued = get_queued_playback_samples(loop);
-		cqueued = get_queued_capture_samples(loop);
-		if (verbose > 4)
-			snd_output_printf(loop->output, "%s: queued %li/%li samples\n", loop->id, pqueued, cqueued);
-		if (pqueued > 0)
-			play->total_queued += pqueued;
-		if (cqueued > 0)
-			capt->total_queued += cqueued;
-		if (pqueued > 0 || cqueued > 0)
-			loop->total_queued_count += 1;
-	}
-	if (verbose > 12) {
+	if (loop->latency_maxtime)
+		latency_adapt(loop);
+	if (loop->sync != SYNC_TYPE_NONE)
+		sync_update(loop);
+	if (loop->idle_hold && loop->running &&
+	    (err = idle_update(loop)) < 0)
+		return err;
+      __idle:
+	if (verbose > 12 && play->handle && capt->handle) {
 		snd_pcm_sframes_t pdelay, cdelay;
-		if ((err = snd_pcm_delay(play->handle, &pdelay)) < 0)
+		if ((err = pcm_delay(play, &pdelay)) < 0)
 			snd_output_printf(loop->output, "%s: end delay error: %s / %li / %li\n", play->id, snd_strerror(err), play->buf_size, play->buf_count);
 		else
 			snd_output_printf(loop->output, "%s: end delay %li / %li / %li\n", play->id, pdelay, play->buf_size, play->buf_count);
-		if ((err = snd_pcm_delay(capt->handle, &cdelay)) < 0)
+		if ((err = pcm_delay(capt, &cdelay)) < 0)
 			snd_output_printf(loop->output, "%s: end delay error: %s / %li / %li\n", capt->id, snd_strerror(err), capt->buf_size, capt->buf_count);
 		else
 			snd_output_printf(loop->output, "%s: end delay %li / %li / %li\n", capt->id, cdelay, capt->buf_size, capt->buf_count);
 	}
+	/* the snapshot is stale in the next pass */
+	play->status_valid = 0;
+	capt->status_valid = 0;
       __pcm_end:
-	if (verbose > 13 || loop->xrun) {
+	if (verbose > 13 || loop->xrun || loop->stats || loop->balance) {
 		long diff;
 		getcurtimestamp(&loop->tstamp_end);
 		diff = timediff(loop->tstamp_end, loop->tstamp_start);
+		/* read by pool_balance() */
+		__atomic_store_n(&loop->proc_time, loop->proc_time + diff,
+				 __ATOMIC_RELAXED);
 		if (verbose > 13)
 			snd_output_printf(loop->output, "%s: processing time %lius\n", loop->id, diff);
-		if (loop->xrun && loop->xrun_max_proctime < diff)
+		if ((loop->xrun || loop->stats) && loop->xrun_max_proctime < diff)
 			loop->xrun_max_proctime = diff;
 	}
+	update_deadline(loop);
+	if (loop->stats)
+		stats_update(loop);
 	return 0;
 }
 
@@ -1937,10 +3782,23 @@ static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
 static void show_handle(struct loopback_handle *lhandle, const char *id)
 {
 	struct loopback *loop = lhandle->loopback;
+	unsigned long long queries;
 
 	OUT("  %s: %s:\n", id, lhandle->id);
 	OUT("    device = '%s', ctldev '%s'\n", lhandle->device, lhandle->ctldev);
 	OUT("    card_number = %i\n", lhandle->card_number);
+	if (lhandle->source)
+		OUT("    shares '%s'\n", lhandle->source->id);
+	if (lhandle->source && lhandle == loop->play)
+		OUT("    mix_gain = %.4f\n", lhandle->mix_gain);
+	if (lhandle->ep)
+		lhandle->ep->state(lhandle, loop->state);
+	if (lhandle->tap)
+		tap_dump(lhandle->tap, loop->state);
+	queries = lhandle->status_calls + lhandle->avail_calls +
+		  lhandle->delay_calls + lhandle->state_calls;
+	if (queries)
+		OUT("    queries = %llu (status %llu, avail %llu, delay %llu, state %llu), %.2f per pass\n", queries, lhandle->status_calls, lhandle->avail_calls, lhandle->delay_calls, lhandle->state_calls, loop->wakes ? (double)queries / loop->wakes : 0.0);
 	if (!loop->running)
 		return;
 	OUT("    access = %s, format = %s, rate = %u, channels = %u\n", snd_pcm_access_name(lhandle->access), snd_pcm_format_name(lhandle->format), lhandle->rate, lhandle->channels);
@@ -1962,7 +3820,20 @@ void pcmjob_state(struct loopback *loop)
 		goto __skip;
 	OUT("  pollfd_count = %i\n", loop->pollfd_count);
 	OUT("  pitch = %.8f, delta = %.8f, diff = %li, min = %li, max = %li\n", loop->pitch, loop->pitch_delta, loop->pitch_diff, loop->pitch_diff_min, loop->pitch_diff_max);
+	OUT("  sync_bw = %.4f, sync_error = %.2f, sync_integral = %.8f\n", loop->sync_bw, loop->sync_error, loop->sync_integral);
+	if (loop->latency_maxtime)
+		OUT("  latency = %lu, goal = %lu, range = %u-%uus, near misses = %llu, changes = %llu\n", (unsigned long)loop->latency, (unsigned long)loop->adapt_target, loop->latency_mintime, loop->latency_maxtime, loop->adapt_nearmisses, loop->adapt_changes);
+	if (loop->idle_hold)
+		OUT("  idle = %i, stops = %llu, idle time = %.1fs\n", loop->idle, loop->idle_count, (loop->idle_time + (loop->idle ? monotonic_us() - loop->idle_start : 0)) / 1000000.0);
 	OUT("  use_samplerate = %i\n", loop->use_samplerate);
+	OUT("  zerocopy = %i\n", loop->zerocopy);
+	if (loop->route)
+		OUT("  route = %u -> %u channels, %s\n", loop->capt->channels, loop->route->channels, loop->route->native ? "native" : (loop->route->sparse ? "sparse" : "matrix"));
+	if (loop->float_pipe)
+		OUT("  float pipeline, dither = %s, clipped = %llu\n", loop->dither.type != DITHER_NONE ? dither_name(loop->dither.type) : "none", loop->dither.clipped);
+	if (loop->volume && loop->volume->cur)
+		volume_state(loop, loop->state);
+	effect_state(loop, loop->state);
       __skip:
 	show_handle(loop->play, "playback");
 	show_handle(loop->capt, "capture");
@@ -0,0 +1,341 @@
+/*
+ *  A simple PCM loopback utility
+ *  Built-in sample rate converter (libsamplerate compatible subset)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "resample.h"
+
+#define SRC_MIN_RATIO		(1.0 / 256.0)
+#define SRC_MAX_RATIO		256.0
+
+enum {
+	SRC_ERR_NONE = 0,
+	SRC_ERR_NOMEM,
+	SRC_ERR_BAD_STATE,
+	SRC_ERR_BAD_DATA,
+	SRC_ERR_BAD_RATIO,
+	SRC_ERR_BAD_CHANNELS,
+	SRC_ERR_BAD_CONVERTER,
+	SRC_ERR_LAST
+};
+
+static const char *src_errors[] = {
+	[SRC_ERR_NONE] = "No error",
+	[SRC_ERR_NOMEM] = "Not enough memory",
+	[SRC_ERR_BAD_STATE] = "Converter state is NULL",
+	[SRC_ERR_BAD_DATA] = "Data pointer is NULL",
+	[SRC_ERR_BAD_RATIO] = "Conversion ratio out of range",
+	[SRC_ERR_BAD_CHANNELS] = "Bad channel count",
+	[SRC_ERR_BAD_CONVERTER] = "Bad converter type",
+};
+
+/* windowed-sinc filter presets */
+static const struct src_sinc_preset {
+	int zero_crossings;	/* filter half length */
+	int phases;		/* table entries per zero crossing */
+	double cutoff;		/* relative to the Nyquist frequency */
+	double beta;		/* Kaiser window shape */
+} src_sinc_presets[] = {
+	[SRC_SINC_BEST_QUALITY]		= { 64, 512, 0.97, 10.0 },
+	[SRC_SINC_MEDIUM_QUALITY]	= { 32, 256, 0.95, 9.0 },
+	[SRC_SINC_FASTEST]		= { 12, 128, 0.90, 7.0 },
+};
+
+struct SRC_STATE_tag {
+	int converter;
+	int channels;
+	int zero_crossings;
+	int phases;
+	float *table;		/* right half of the filter kernel */
+	float *coefs;		/* coefficients for one output frame */
+	long coefs_size;
+	float *buf;		/* buffered input frames */
+	long buf_size;		/* in frames */
+	long buf_frames;	/* filled frames */
+	double pos;		/* position of the next output frame in buf */
+	int primed;
+};
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1, k = 1;
+
+	do {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		k++;
+	} while (term > sum * 1e-12);
+	return sum;
+}
+
+static int src_init_table(SRC_STATE *st)
+{
+	const struct src_sinc_preset *p = &src_sinc_presets[st->converter];
+	long i, len = p->zero_crossings * p->phases;
+	double x, u, w, s, i0beta = bessel_i0(p->beta);
+
+	st->zero_crossings = p->zero_crossings;
+	st->phases = p->phases;
+	/* two extra entries for the interpolation at the filter end */
+	st->table = calloc(len + 2, sizeof(float));
+	if (st->table == NULL)
+		return -SRC_ERR_NOMEM;
+	for (i = 0; i < len; i++) {
+		x = (double)i / p->phases;
+		u = x / p->zero_crossings;
+		w = bessel_i0(p->beta * sqrt(1 - u * u)) / i0beta;
+		s = x > 0 ? sin(M_PI * p->cutoff * x) / (M_PI * x) : p->cutoff;
+		st->table[i] = s * w;
+	}
+	return 0;
+}
+
+static int src_resize(float **ptr, long *size, long nsize, int channels)
+{
+	float *n;
+
+	if (nsize <= *size)
+		return 0;
+	n = realloc(*ptr, nsize * channels * sizeof(float));
+	if (n == NULL)
+		return -SRC_ERR_NOMEM;
+	*ptr = n;
+	*size = nsize;
+	return 0;
+}
+
+SRC_STATE *src_new(int converter_type, int channels, int *error)
+{
+	SRC_STATE *st;
+	int err = SRC_ERR_NONE;
+
+	if (converter_type < SRC_SINC_BEST_QUALITY ||
+	    converter_type > SRC_LINEAR) {
+		err = SRC_ERR_BAD_CONVERTER;
+		goto __error;
+	}
+	if (channels < 1) {
+		err = SRC_ERR_BAD_CHANNELS;
+		goto __error;
+	}
+	st = calloc(1, sizeof(*st));
+	if (st == NULL) {
+		err = SRC_ERR_NOMEM;
+		goto __error;
+	}
+	st->converter = converter_type;
+	st->channels = channels;
+	if (converter_type <= SRC_SINC_FASTEST) {
+		if (src_init_table(st) < 0 ||
+		    src_resize(&st->coefs, &st->coefs_size,
+			       2 * st->zero_crossings + 2, 1) < 0) {
+			src_delete(st);
+			err = SRC_ERR_NOMEM;
+			goto __error;
+		}
+	}
+	if (src_resize(&st->buf, &st->buf_size,
+		       4 * st->zero_crossings + 1024, channels) < 0) {
+		src_delete(st);
+		err = SRC_ERR_NOMEM;
+		goto __error;
+	}
+	if (error)
+		*error = 0;
+	return st;
+      __error:
+	if (error)
+		*error = err;
+	return NULL;
+}
+
+SRC_STATE *src_delete(SRC_STATE *st)
+{
+	if (st) {
+		free(st->table);
+		free(st->coefs);
+		free(st->buf);
+		free(st);
+	}
+	return NULL;
+}
+
+int src_reset(SRC_STATE *st)
+{
+	if (st == NULL)
+		return SRC_ERR_BAD_STATE;
+	st->buf_frames = 0;
+	st->pos = 0;
+	st->primed = 0;
+	return 0;
+}
+
+const char *src_strerror(int error)
+{
+	if (error < 0 || error >= SRC_ERR_LAST)
+		return "Unknown error";
+	return src_errors[error];
+}
+
+/* drop the input frames which are no longer referenced */
+static void src_compact(SRC_STATE *st, double radius)
+{
+	long drop = (long)floor(st->pos - radius);
+
+	if (drop > st->buf_frames)
+		drop = st->buf_frames;
+	if (drop <= 0)
+		return;
+	memmove(st->buf, st->buf + drop * st->channels,
+		(st->buf_frames - drop) * st->channels * sizeof(float));
+	st->buf_frames -= drop;
+	st->pos -= drop;
+}
+
+/*
+ * The coefficients are computed once per output frame and the inner
+ * loop runs over the channels of an interleaved frame, so the per frame
+ * overhead is shared by all channels.
+ */
+static void src_sinc_frame(SRC_STATE *st, float *dst, long first, long last,
+			   double scale)
+{
+	const int channels = st->channels;
+	const long len = (long)st->zero_crossings * st->phases;
+	const float *src;
+	double x, f;
+	long t, i, taps = last - first + 1;
+	int c;
+
+	for (t = 0; t < taps; t++) {
+		x = fabs((first + t - st->pos) * scale) * st->phases;
+		i = (long)x;
+		if (i >= len) {
+			st->coefs[t] = 0;
+			continue;
+		}
+		f = x - i;
+		st->coefs[t] = scale * (st->table[i] +
+					f * (st->table[i + 1] - st->table[i]));
+	}
+	for (c = 0; c < channels; c++)
+		dst[c] = 0;
+	src = st->buf + first * channels;
+	for (t = 0; t < taps; t++, src += channels) {
+		float k = st->coefs[t];
+		for (c = 0; c < channels; c++)
+			dst[c] += k * src[c];
+	}
+}
+
+static void src_linear_frame(SRC_STATE *st, float *dst)
+{
+	const int channels = st->channels;
+	long i = (long)st->pos;
+	float f = st->pos - i;
+	const float *a = st->buf + i * channels;
+	const float *b = a + channels;
+	int c;
+
+	for (c = 0; c < channels; c++)
+		dst[c] = a[c] + f * (b[c] - a[c]);
+}
+
+int src_process(SRC_STATE *st, SRC_DATA *data)
+{
+	const int channels = st ? st->channels : 0;
+	double ratio, step, scale, radius;
+	long in_used = 0, out_gen = 0, need, first, n;
+	float *dst;
+
+	if (st == NULL)
+		return SRC_ERR_BAD_STATE;
+	if (data == NULL)
+		return SRC_ERR_BAD_DATA;
+	ratio = data->src_ratio;
+	if (ratio < SRC_MIN_RATIO || ratio > SRC_MAX_RATIO)
+		return SRC_ERR_BAD_RATIO;
+	step = 1.0 / ratio;
+	scale = ratio < 1.0 ? ratio : 1.0;
+	if (st->converter <= SRC_SINC_FASTEST)
+		radius = st->zero_crossings / scale;
+	else if (st->converter == SRC_LINEAR)
+		radius = 1;
+	else
+		radius = 0;
+	if (!st->primed) {
+		/* the history before the first sample is silence */
+		n = (long)ceil(radius);
+		if (src_resize(&st->buf, &st->buf_size, n + 1024, channels) < 0)
+			return SRC_ERR_NOMEM;
+		memset(st->buf, 0, n * channels * sizeof(float));
+		st->buf_frames = n;
+		st->pos = n;
+		st->primed = 1;
+	}
+	src_compact(st, radius);
+	while (out_gen < data->output_frames) {
+		need = (long)floor(st->pos + radius) + 1;
+		if (need > st->buf_frames) {
+			if (in_used >= data->input_frames)
+				break;
+			n = need - st->buf_frames;
+			if (n > data->input_frames - in_used)
+				n = data->input_frames - in_used;
+			if (st->buf_frames + n > st->buf_size)
+				src_compact(st, radius);
+			if (st->buf_frames + n > st->buf_size &&
+			    src_resize(&st->buf, &st->buf_size,
+				       (st->buf_frames + n) * 2, channels) < 0)
+				return SRC_ERR_NOMEM;
+			memcpy(st->buf + st->buf_frames * channels,
+			       data->data_in + in_used * channels,
+			       n * channels * sizeof(float));
+			st->buf_frames += n;
+			in_used += n;
+			continue;
+		}
+		dst = data->data_out + out_gen * channels;
+		switch (st->converter) {
+		case SRC_ZERO_ORDER_HOLD:
+			memcpy(dst, st->buf + (long)st->pos * channels,
+			       channels * sizeof(float));
+			break;
+		case SRC_LINEAR:
+			src_linear_frame(st, dst);
+			break;
+		default:
+			first = (long)floor(st->pos - radius) + 1;
+			if (first < 0)
+				first = 0;
+			if (src_resize(&st->coefs, &st->coefs_size,
+				       need - first, 1) < 0)
+				return SRC_ERR_NOMEM;
+			src_sinc_frame(st, dst, first, need - 1, scale);
+			break;
+		}
+		st->pos += step;
+		out_gen++;
+	}
+	data->input_frames_used = in_used;
+	data->output_frames_gen = out_gen;
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ *  A simple PCM loopback utility
+ *  Built-in sample rate converter (libsamplerate compatible subset)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * Only the parts of the libsamplerate API used by alsaloop are provided.
+ * The converter types have the same meaning: the SINC types use
+ * a windowed-sinc polyphase filter with decreasing length, the other
+ * two are the trivial zero order hold and linear interpolators.
+ * The conversion ratio may be changed between src_process() calls.
+ */
+
+enum {
+	SRC_SINC_BEST_QUALITY	= 0,
+	SRC_SINC_MEDIUM_QUALITY	= 1,
+	SRC_SINC_FASTEST	= 2,
+	SRC_ZERO_ORDER_HOLD	= 3,
+	SRC_LINEAR		= 4
+};
+
+typedef struct SRC_STATE_tag SRC_STATE;
+
+typedef struct {
+	float *data_in;
+	float *data_out;
+	long input_frames;
+	long output_frames;
+	long input_frames_used;
+	long output_frames_gen;
+	int end_of_input;
+	double src_ratio;		/* output rate / input rate */
+} SRC_DATA;
+
+SRC_STATE *src_new(int converter_type, int channels, int *error);
+SRC_STATE *src_delete(SRC_STATE *state);
+int src_process(SRC_STATE *state, SRC_DATA *data);
+int src_reset(SRC_STATE *state);
+const char *src_strerror(int error);
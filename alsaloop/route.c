@@ -0,0 +1,233 @@
+/*
+ *  A simple PCM loopback utility
+ *  Channel routing matrix
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define ROUTE_MAX_CHANNELS	256
+#define ROUTE_MAX_ENTRIES	1024
+
+struct route_entry {
+	int play, capt;
+	float gain;
+};
+
+/*
+ * The specification is a comma separated list of PCH=CCH[*GAIN][+CCH...]
+ * with the channels counted from one. The playback channels which are
+ * not listed are silent.
+ */
+int route_parse(const char *spec, struct loopback_route **_route)
+{
+	struct loopback_route *route;
+	struct route_entry *entries, *e;
+	const char *str = spec;
+	char *end;
+	int i, count = 0, pmax = 0, cmax = 0, play;
+
+	entries = calloc(ROUTE_MAX_ENTRIES, sizeof(*entries));
+	if (entries == NULL)
+		return -ENOMEM;
+	while (*str) {
+		play = strtol(str, &end, 10);
+		if (end == str || *end != '=' ||
+		    play < 1 || play > ROUTE_MAX_CHANNELS)
+			goto __syntax;
+		str = end;
+		do {
+			if (count >= ROUTE_MAX_ENTRIES)
+				goto __syntax;
+			e = &entries[count++];
+			e->play = play - 1;
+			e->capt = strtol(++str, &end, 10) - 1;
+			if (end == str || e->capt < 0 ||
+			    e->capt >= ROUTE_MAX_CHANNELS)
+				goto __syntax;
+			str = end;
+			e->gain = 1;
+			if (*str == '*') {
+				e->gain = strtod(++str, &end);
+				if (end == str)
+					goto __syntax;
+				str = end;
+			}
+			if (e->play >= pmax)
+				pmax = e->play + 1;
+			if (e->capt >= cmax)
+				cmax = e->capt + 1;
+		} while (*str == '+');
+		if (*str == ',')
+			str++;
+		else if (*str)
+			goto __syntax;
+	}
+	if (count == 0)
+		goto __syntax;
+	route = calloc(1, sizeof(*route));
+	if (route == NULL)
+		goto __nomem;
+	route->channels = pmax;
+	route->capt_channels = cmax;
+	route->select = malloc(pmax * sizeof(int));
+	route->matrix = calloc(pmax * cmax, sizeof(float));
+	if (route->select == NULL || route->matrix == NULL) {
+		route_free(route);
+		goto __nomem;
+	}
+	for (i = 0; i < pmax; i++)
+		route->select[i] = -1;
+	route->sparse = 1;
+	for (i = 0, e = entries; i < count; i++, e++) {
+		route->matrix[e->capt * pmax + e->play] += e->gain;
+		if (route->select[e->play] >= 0 || e->gain != 1)
+			route->sparse = 0;
+		route->select[e->play] = e->capt;
+	}
+	free(entries);
+	*_route = route;
+	return 0;
+      __syntax:
+	logit(LOG_CRIT, "Wrong route syntax '%s'\n", spec);
+	free(entries);
+	return -EINVAL;
+      __nomem:
+	free(entries);
+	return -ENOMEM;
+}
+
+void route_free(struct loopback_route *route)
+{
+	if (route == NULL)
+		return;
+	route_done(route);
+	free(route->select);
+	free(route->matrix);
+	free(route);
+}
+
+int route_init(struct loopback_route *route,
+	       struct loopback_handle *capt,
+	       struct loopback_handle *play)
+{
+	uint64_t silence;
+
+	if (capt->channels < route->capt_channels ||
+	    play->channels != route->channels)
+		return -EINVAL;
+	route->native = route->sparse && capt->format == play->format;
+	silence = snd_pcm_format_silence_64(play->format);
+	memcpy(route->silence, &silence, sizeof(route->silence));
+	route->in = malloc(ROUTE_BLOCK * capt->channels * sizeof(float));
+	route->out = malloc(ROUTE_BLOCK * play->channels * sizeof(float));
+	if (route->in == NULL || route->out == NULL) {
+		route_done(route);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void route_done(struct loopback_route *route)
+{
+	free(route->in);
+	route->in = NULL;
+	free(route->out);
+	route->out = NULL;
+}
+
+/* sparse routing, the samples are copied without conversion */
+void route_select(struct loopback_route *route, const void *src,
+		  unsigned int src_channels, void *dst,
+		  snd_pcm_uframes_t frames, unsigned int width)
+{
+	const unsigned int channels = route->channels;
+	const int *select = route->select;
+	snd_pcm_uframes_t i;
+	unsigned int c;
+
+	if (width == 2) {
+		const int16_t *s = src;
+		int16_t *d = dst, z;
+
+		memcpy(&z, route->silence, sizeof(z));
+		for (i = 0; i < frames; i++, s += src_channels, d += channels)
+			for (c = 0; c < channels; c++)
+				d[c] = select[c] >= 0 ? s[select[c]] : z;
+	} else if (width == 4) {
+		const int32_t *s = src;
+		int32_t *d = dst, z;
+
+		memcpy(&z, route->silence, sizeof(z));
+		for (i = 0; i < frames; i++, s += src_channels, d += channels)
+			for (c = 0; c < channels; c++)
+				d[c] = select[c] >= 0 ? s[select[c]] : z;
+	} else {
+		const uint8_t *s = src;
+		uint8_t *d = dst;
+
+		for (i = 0; i < frames; i++, s += src_channels * width) {
+			for (c = 0; c < channels; c++, d += width) {
+				if (select[c] >= 0)
+					memcpy(d, s + select[c] * width, width);
+				else
+					memcpy(d, route->silence, width);
+			}
+		}
+	}
+}
+
+/*
+ * Matrix routing of float samples. The matrix is stored per capture
+ * channel, so the inner loop runs over the contiguous playback channels
+ * of one frame.
+ */
+void route_float(struct loopback_route *route, const float *src,
+		 unsigned int src_channels, float *dst,
+		 snd_pcm_uframes_t frames)
+{
+	const unsigned int channels = route->channels;
+	const unsigned int capt_channels = route->capt_channels;
+	const float *m;
+	snd_pcm_uframes_t i;
+	unsigned int c, k;
+	float x;
+
+	if (route->sparse) {
+		const int *select = route->select;
+		for (i = 0; i < frames; i++, src += src_channels, dst += channels)
+			for (c = 0; c < channels; c++)
+				dst[c] = select[c] >= 0 ? src[select[c]] : 0;
+		return;
+	}
+	for (i = 0; i < frames; i++, src += src_channels, dst += channels) {
+		for (c = 0; c < channels; c++)
+			dst[c] = 0;
+		for (k = 0, m = route->matrix; k < capt_channels; k++, m += channels) {
+			x = src[k];
+			for (c = 0; c < channels; c++)
+				dst[c] += m[c] * x;
+		}
+	}
+}
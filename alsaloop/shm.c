@@ -0,0 +1,342 @@
+/*
+ *  A simple PCM loopback utility
+ *  Shared memory endpoint (a ring shared with an application)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+#include "shmring.h"
+
+#define SHM_PREFIX		"shm:"
+#define SHM_MODE		0660	/* the application maps the ring read-write */
+
+struct loopback_shm {
+	char *name;
+	int fd;
+	int producer;			/* alsaloop writes (playback) */
+	struct alsaloop_ring *ring;
+	size_t bytes;			/* mapped */
+	/* the header can be written by the application, see shmep_count() */
+	snd_pcm_format_t format;
+	unsigned int rate;
+	unsigned int channels;
+	uint32_t frame_size;		/* bytes */
+	uint32_t size;			/* frames */
+	uint32_t data;			/* offset of the frames */
+	unsigned long long full;	/* frames dropped on a full ring */
+};
+
+/*
+ * The device is shm:NAME. The segment is created here and configured
+ * in setparams(), so the application may attach once the loop runs.
+ */
+static int shmep_open(struct loopback_handle *lhandle)
+{
+	struct loopback_shm *shm;
+	const char *name = lhandle->device + strlen(SHM_PREFIX);
+	int err;
+
+	if (name[0] == '\0' || strchr(name + 1, '/')) {
+		logit(LOG_CRIT, "%s: wrong shared memory name (use %sNAME)\n", lhandle->id, SHM_PREFIX);
+		return -EINVAL;
+	}
+	shm = calloc(1, sizeof(*shm));
+	if (shm == NULL)
+		return -ENOMEM;
+	shm->name = malloc(strlen(name) + 2);
+	if (shm->name == NULL) {
+		free(shm);
+		return -ENOMEM;
+	}
+	sprintf(shm->name, "%s%s", name[0] == '/' ? "" : "/", name);
+	shm->producer = lhandle == lhandle->loopback->play;
+	shm->fd = shm_open(shm->name, O_RDWR | O_CREAT, SHM_MODE);
+	if (shm->fd < 0) {
+		err = -errno;
+		logit(LOG_CRIT, "%s: shared memory %s: %s\n", lhandle->id, shm->name, strerror(-err));
+		free(shm->name);
+		free(shm);
+		return err;
+	}
+	lhandle->ep_data = shm;
+	lhandle->handle = NULL;
+	lhandle->card_number = -1;
+	lhandle->ctl = NULL;
+	return 0;
+}
+
+static void shmep_unmap(struct loopback_shm *shm)
+{
+	if (shm->ring == NULL)
+		return;
+	/* tell the attached application to go away */
+	__atomic_store_n(&shm->ring->magic, 0, __ATOMIC_RELEASE);
+	munmap(shm->ring, shm->bytes);
+	shm->ring = NULL;
+	shm->bytes = 0;
+}
+
+static void shmep_close(struct loopback_handle *lhandle)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+
+	if (shm == NULL)
+		return;
+	shmep_unmap(shm);
+	close(shm->fd);
+	shm_unlink(shm->name);
+	free(shm->name);
+	free(shm);
+	lhandle->ep_data = NULL;
+}
+
+/*
+ * A bigger ring is a new segment under the same name, the mappings
+ * of the application keep the old one until it attaches again.
+ */
+static int shmep_map(struct loopback_handle *lhandle, size_t bytes)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+	void *ring;
+	int fd, err;
+
+	if (shm->ring) {
+		shmep_unmap(shm);
+		shm_unlink(shm->name);
+		fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, SHM_MODE);
+		if (fd < 0)
+			goto __error;
+		close(shm->fd);
+		shm->fd = fd;
+	}
+	if (ftruncate(shm->fd, bytes) < 0)
+		goto __error;
+	ring = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+	if (ring == MAP_FAILED)
+		goto __error;
+	shm->ring = ring;
+	shm->bytes = bytes;
+	return 0;
+      __error:
+	err = -errno;
+	logit(LOG_CRIT, "%s: shared memory %s: %s\n", lhandle->id, shm->name, strerror(-err));
+	return err;
+}
+
+/*
+ * The ring carries the loop format, so the application must follow
+ * the format, rate and channels given on the command line.
+ */
+static int shmep_setparams(struct loopback_handle *lhandle,
+			   snd_pcm_uframes_t bufsize)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+	struct alsaloop_ring *r;
+	unsigned int frame_size, size;
+	size_t data, bytes;
+	int err;
+
+	frame_size = snd_pcm_format_physical_width(lhandle->format) / 8 *
+		     lhandle->channels;
+	if (frame_size == 0) {
+		logit(LOG_CRIT, "%s: unsupported frame size\n", lhandle->id);
+		return -EINVAL;
+	}
+	lhandle->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	lhandle->rate = lhandle->rate_req;
+	lhandle->pitch = 1.0;
+	lhandle->buffer_size = bufsize;
+	lhandle->period_size = lhandle->period_size_req ?
+				lhandle->period_size_req : bufsize / 2;
+	if (lhandle->period_size == 0)
+		lhandle->period_size = 1;
+	lhandle->avail_min = lhandle->period_size;
+	/* room for the application to fall behind by a few buffers */
+	for (size = 1; size < bufsize * 4; size <<= 1)
+		;
+	data = sizeof(*r);
+	bytes = data + (size_t)size * frame_size;
+	if (shm->ring && shm->format == lhandle->format &&
+	    shm->rate == lhandle->rate && shm->channels == lhandle->channels &&
+	    shm->size == size)
+		return 0;
+	if (bytes > shm->bytes && (err = shmep_map(lhandle, bytes)) < 0)
+		return err;
+	r = shm->ring;
+	shm->format = lhandle->format;
+	shm->rate = lhandle->rate;
+	shm->channels = lhandle->channels;
+	shm->frame_size = frame_size;
+	shm->size = size;
+	shm->data = data;
+	__atomic_store_n(&r->magic, 0, __ATOMIC_RELEASE);
+	r->version = ALSALOOP_RING_VERSION;
+	r->generation++;
+	r->direction = shm->producer ? ALSALOOP_RING_PLAYBACK :
+				       ALSALOOP_RING_CAPTURE;
+	r->format = lhandle->format;
+	r->rate = lhandle->rate;
+	r->channels = lhandle->channels;
+	r->frame_size = frame_size;
+	r->size = size;
+	r->data = data;
+	r->bytes = shm->bytes;
+	r->head = r->tail = 0;
+	r->head_waiters = r->tail_waiters = 0;
+	__atomic_store_n(&r->magic, ALSALOOP_RING_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* the frames written while the loop was stopped are stale */
+static void shmep_start(struct loopback_handle *lhandle)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+	struct alsaloop_ring *r = shm->ring;
+
+	if (shm->producer)
+		return;
+	__atomic_store_n(&r->tail, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELEASE);
+	alsaloop_ring_wake(&r->tail, &r->tail_waiters);
+}
+
+/* nothing to poll, the device on the other side paces the loop */
+static int shmep_poll_descriptors_count(struct loopback_handle *lhandle)
+{
+	return 0;
+}
+
+static int shmep_poll_descriptors(struct loopback_handle *lhandle,
+				  struct pollfd *pfds, unsigned int count)
+{
+	return 0;
+}
+
+static int shmep_poll_descriptors_revents(struct loopback_handle *lhandle,
+					  struct pollfd *pfds, unsigned int count,
+					  unsigned short *revents)
+{
+	*revents = 0;
+	return 0;
+}
+
+/*
+ * The application can write to the whole segment. The copies use only
+ * the ring geometry kept here and the queued frames are clamped to the
+ * ring size, so a broken header cannot move them out of the mapping.
+ */
+static uint32_t shmep_count(struct loopback_shm *shm)
+{
+	uint32_t count = alsaloop_ring_count(shm->ring);
+
+	return count > shm->size ? shm->size : count;
+}
+
+static snd_pcm_sframes_t shmep_avail(struct loopback_handle *lhandle)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+
+	/* writing never waits for the application */
+	if (shm->producer)
+		return lhandle->buffer_size;
+	return shmep_count(shm);
+}
+
+/* the frames queued in the ring */
+static snd_pcm_sframes_t shmep_delay(struct loopback_handle *lhandle)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+
+	return shmep_count(shm);
+}
+
+static snd_pcm_sframes_t shmep_read(struct loopback_handle *lhandle,
+				    void *buf, snd_pcm_uframes_t frames)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+	struct alsaloop_ring *r = shm->ring;
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	uint32_t count = shmep_count(shm);
+
+	if (frames > count)
+		frames = count;
+	if (frames == 0)
+		return 0;
+	alsaloop_ring_copy_frames((char *)r + shm->data, shm->size,
+				  shm->frame_size, tail, buf, frames, 0);
+	__atomic_store_n(&r->tail, tail + frames, __ATOMIC_RELEASE);
+	alsaloop_ring_wake(&r->tail, &r->tail_waiters);
+	return frames;
+}
+
+/* the frames over a full ring are dropped, the reader is gone */
+static snd_pcm_sframes_t shmep_write(struct loopback_handle *lhandle,
+				     const void *buf, snd_pcm_uframes_t frames)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+	struct alsaloop_ring *r = shm->ring;
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	uint32_t room = shm->size - shmep_count(shm);
+	snd_pcm_uframes_t count = frames;
+
+	if (count > room)
+		count = room;
+	shm->full += frames - count;
+	if (count == 0)
+		return frames;
+	alsaloop_ring_copy_frames((char *)r + shm->data, shm->size,
+				  shm->frame_size, head, (void *)buf, count, 1);
+	__atomic_store_n(&r->head, head + count, __ATOMIC_RELEASE);
+	alsaloop_ring_wake(&r->head, &r->head_waiters);
+	return frames;
+}
+
+static void shmep_state(struct loopback_handle *lhandle, snd_output_t *out)
+{
+	struct loopback_shm *shm = lhandle->ep_data;
+	struct alsaloop_ring *r = shm->ring;
+
+	snd_output_printf(out, "    shm: %s generation = %u, size = %u, queued = %u frames\n", shm->name, r->generation, shm->size, shmep_count(shm));
+	if (shm->producer)
+		snd_output_printf(out, "    shm: dropped = %llu frames (ring full)\n", shm->full);
+}
+
+const struct loopback_endpoint_ops endpoint_shm = {
+	.prefix = SHM_PREFIX,
+	.open = shmep_open,
+	.close = shmep_close,
+	.setparams = shmep_setparams,
+	.start = shmep_start,
+	.poll_descriptors_count = shmep_poll_descriptors_count,
+	.poll_descriptors = shmep_poll_descriptors,
+	.poll_descriptors_revents = shmep_poll_descriptors_revents,
+	.avail = shmep_avail,
+	.delay = shmep_delay,
+	.read = shmep_read,
+	.write = shmep_write,
+	.state = shmep_state,
+};
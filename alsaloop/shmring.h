@@ -0,0 +1,239 @@
+/*
+ *  A simple PCM loopback utility
+ *  Shared memory ring (shm:NAME devices) for the applications
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * alsaloop creates the POSIX shared memory segment for a shm:NAME device
+ * and fills the header when the stream parameters are known. The header
+ * is followed by a ring of interleaved frames in the loop format.
+ *
+ * The ring has one producer and one consumer. A capture device is written
+ * by the application and read by alsaloop, a playback device the other
+ * way round. The head and the tail are free running frame counters, each
+ * written only by its side and kept in its own cache line. No locks are
+ * used; a side which wants to sleep sets its waiters flag and waits on
+ * the futex of the other counter, which is woken after the next update.
+ *
+ * The generation changes when alsaloop sets new parameters in place;
+ * the application should check the format again. When the ring must
+ * grow, alsaloop clears the magic and creates a new segment under the
+ * same name, so the application detaches and attaches again.
+ */
+
+#ifndef __ALSALOOP_SHMRING_H
+#define __ALSALOOP_SHMRING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define ALSALOOP_RING_MAGIC	0x474e5241	/* "ARNG" */
+#define ALSALOOP_RING_VERSION	1
+#define ALSALOOP_RING_CACHELINE	64
+
+#define ALSALOOP_RING_CAPTURE	0	/* the application writes */
+#define ALSALOOP_RING_PLAYBACK	1	/* the application reads */
+
+struct alsaloop_ring {
+	/* written by alsaloop before the magic */
+	uint32_t magic;
+	uint32_t version;
+	uint32_t generation;
+	uint32_t direction;
+	uint32_t format;		/* snd_pcm_format_t */
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t frame_size;		/* bytes */
+	uint32_t size;			/* frames, a power of two */
+	uint32_t data;			/* offset of the frames */
+	uint32_t bytes;			/* size of the segment */
+	uint8_t pad0[ALSALOOP_RING_CACHELINE - 11 * 4];
+	/* written by the producer */
+	uint32_t head;			/* frames written */
+	uint8_t pad1[ALSALOOP_RING_CACHELINE - 4];
+	/* written by the consumer */
+	uint32_t tail;			/* frames read */
+	uint8_t pad2[ALSALOOP_RING_CACHELINE - 4];
+	/* set by the side going to sleep */
+	uint32_t head_waiters;		/* the consumer waits for frames */
+	uint32_t tail_waiters;		/* the producer waits for room */
+	uint8_t pad3[ALSALOOP_RING_CACHELINE - 2 * 4];
+};
+
+/* frames ready for the consumer */
+static inline uint32_t alsaloop_ring_count(struct alsaloop_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/* room for the producer */
+static inline uint32_t alsaloop_ring_room(struct alsaloop_ring *r)
+{
+	return r->size - alsaloop_ring_count(r);
+}
+
+static inline void alsaloop_ring_wake(uint32_t *counter, uint32_t *waiters)
+{
+	/* the counter store must be visible before the flag is checked */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED)) {
+		__atomic_store_n(waiters, 0, __ATOMIC_RELAXED);
+		syscall(SYS_futex, counter, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/* frames must not exceed size, size is a power of two */
+static inline void alsaloop_ring_copy_frames(char *ring, uint32_t size,
+					     uint32_t frame_size, uint32_t pos,
+					     void *buf, uint32_t frames, int in)
+{
+	uint32_t count1;
+
+	pos &= size - 1;
+	while (frames > 0) {
+		count1 = frames;
+		if (count1 > size - pos)
+			count1 = size - pos;
+		if (in)
+			memcpy(ring + pos * frame_size, buf,
+			       count1 * frame_size);
+		else
+			memcpy(buf, ring + pos * frame_size,
+			       count1 * frame_size);
+		buf = (char *)buf + count1 * frame_size;
+		pos = 0;
+		frames -= count1;
+	}
+}
+
+static inline void alsaloop_ring_copy(struct alsaloop_ring *r, uint32_t pos,
+				      void *buf, uint32_t frames, int in)
+{
+	alsaloop_ring_copy_frames((char *)r + r->data, r->size, r->frame_size,
+				  pos, buf, frames, in);
+}
+
+/* producer, returns the frames written (less when the ring is full) */
+static inline uint32_t alsaloop_ring_write(struct alsaloop_ring *r,
+					   const void *buf, uint32_t frames)
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	uint32_t room = alsaloop_ring_room(r);
+
+	if (frames > room)
+		frames = room;
+	if (frames == 0)
+		return 0;
+	alsaloop_ring_copy(r, head, (void *)buf, frames, 1);
+	__atomic_store_n(&r->head, head + frames, __ATOMIC_RELEASE);
+	alsaloop_ring_wake(&r->head, &r->head_waiters);
+	return frames;
+}
+
+/* consumer, returns the frames read (less when the ring is empty) */
+static inline uint32_t alsaloop_ring_read(struct alsaloop_ring *r,
+					  void *buf, uint32_t frames)
+{
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	uint32_t count = alsaloop_ring_count(r);
+
+	if (frames > count)
+		frames = count;
+	if (frames == 0)
+		return 0;
+	alsaloop_ring_copy(r, tail, buf, frames, 0);
+	__atomic_store_n(&r->tail, tail + frames, __ATOMIC_RELEASE);
+	alsaloop_ring_wake(&r->tail, &r->tail_waiters);
+	return frames;
+}
+
+/*
+ * Wait for frames (consumer) or room (producer). The timeout is in
+ * milliseconds, a negative value waits forever. Returns -ETIMEDOUT
+ * when nothing changed.
+ */
+static inline int alsaloop_ring_wait(struct alsaloop_ring *r, int producer,
+				     int timeout)
+{
+	uint32_t *counter = producer ? &r->tail : &r->head;
+	uint32_t *waiters = producer ? &r->tail_waiters : &r->head_waiters;
+	struct timespec ts, *pts = NULL;
+	uint32_t val;
+
+	__atomic_store_n(waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	val = __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+	if (producer ? alsaloop_ring_room(r) > 0 : alsaloop_ring_count(r) > 0)
+		return 0;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		pts = &ts;
+	}
+	if (syscall(SYS_futex, counter, FUTEX_WAIT, val, pts, NULL, 0) < 0 &&
+	    errno != EAGAIN && errno != EINTR)
+		return -errno;
+	return 0;
+}
+
+/* map the ring of an alsaloop shm:NAME device, NULL and errno on error */
+static inline struct alsaloop_ring *alsaloop_ring_attach(const char *name)
+{
+	struct alsaloop_ring *r;
+	struct stat st;
+	int fd, err;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*r)) {
+		err = errno ? errno : EAGAIN;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED)
+		return NULL;
+	if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != ALSALOOP_RING_MAGIC ||
+	    r->version != ALSALOOP_RING_VERSION ||
+	    r->bytes > (uint32_t)st.st_size) {
+		munmap(r, st.st_size);
+		errno = EAGAIN;		/* not configured yet */
+		return NULL;
+	}
+	return r;
+}
+
+static inline void alsaloop_ring_detach(struct alsaloop_ring *r)
+{
+	munmap(r, r->bytes);
+}
+
+#endif /* __ALSALOOP_SHMRING_H */
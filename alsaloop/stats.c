@@ -0,0 +1,142 @@
+/*
+ *  A simple PCM loopback utility
+ *  Statistics published in shared memory
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+#include "stats.h"
+
+static char *stats_name;
+static void *stats_area;
+static size_t stats_size;
+
+/* create the segment and assign one block to each loop */
+int stats_open(const char *name, struct loopback **loops, int count)
+{
+	struct alsaloop_stats_header *hdr;
+	struct alsaloop_stats *block;
+	int fd, i;
+
+	/* the POSIX shared memory names start with a slash */
+	stats_name = malloc(strlen(name) + 2);
+	if (stats_name == NULL)
+		return -ENOMEM;
+	sprintf(stats_name, "%s%s", name[0] == '/' ? "" : "/", name);
+	stats_size = sizeof(*hdr) + count * sizeof(*block);
+	fd = shm_open(stats_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		logit(LOG_CRIT, "Unable to create statistics segment %s: %s\n", stats_name, strerror(errno));
+		goto __error;
+	}
+	if (ftruncate(fd, stats_size) < 0) {
+		logit(LOG_CRIT, "Unable to size statistics segment %s: %s\n", stats_name, strerror(errno));
+		close(fd);
+		shm_unlink(stats_name);
+		goto __error;
+	}
+	stats_area = mmap(NULL, stats_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	close(fd);
+	if (stats_area == MAP_FAILED) {
+		logit(LOG_CRIT, "Unable to map statistics segment %s: %s\n", stats_name, strerror(errno));
+		stats_area = NULL;
+		shm_unlink(stats_name);
+		goto __error;
+	}
+	hdr = stats_area;
+	block = (struct alsaloop_stats *)(hdr + 1);
+	for (i = 0; i < count; i++, block++)
+		loops[i]->stats = block;
+	hdr->magic = ALSALOOP_STATS_MAGIC;
+	hdr->version = ALSALOOP_STATS_VERSION;
+	hdr->size = sizeof(*block);
+	hdr->count = count;
+	hdr->pid = getpid();
+	return 0;
+      __error:
+	free(stats_name);
+	stats_name = NULL;
+	return -EIO;
+}
+
+void stats_close(void)
+{
+	if (stats_area == NULL)
+		return;
+	munmap(stats_area, stats_size);
+	stats_area = NULL;
+	shm_unlink(stats_name);
+	free(stats_name);
+	stats_name = NULL;
+}
+
+/* called from the loop thread only, see stats.h for the protocol */
+void stats_update(struct loopback *loop)
+{
+	struct alsaloop_stats *s = loop->stats;
+	struct loopback_handle *play = loop->play;
+	struct loopback_handle *capt = loop->capt;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+#else
+	struct timeval tv;
+#endif
+
+	s->seq++;
+	__sync_synchronize();
+	/* the id is known after pcmjob_init() */
+	if (s->id[0] == '\0' && loop->id)
+		strncpy(s->id, loop->id, sizeof(s->id) - 1);
+	s->running = loop->running;
+#ifdef HAVE_CLOCK_GETTIME
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	s->tstamp = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	gettimeofday(&tv, NULL);
+	s->tstamp = tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+	s->rate = play->rate;
+	s->latency = loop->latency;
+	s->pitch = loop->pitch;
+	s->pitch_diff = loop->pitch_diff;
+	s->pitch_diff_min = loop->pitch_diff_min;
+	s->pitch_diff_max = loop->pitch_diff_max;
+	s->underruns = play->xruns;
+	s->overruns = capt->xruns;
+	s->xrun_max_proctime = loop->xrun_max_proctime;
+	s->play_buf_count = play->buf_count;
+	s->play_buf_size = play->buf_size;
+	s->capt_buf_count = capt->buf_count;
+	s->capt_buf_size = capt->buf_size;
+	s->wakes = loop->wakes;
+	s->idle_time = loop->idle_time;
+	s->idle = loop->idle;
+	__sync_synchronize();
+	s->seq++;
+}
@@ -0,0 +1,63 @@
+/*
+ *  A simple PCM loopback utility
+ *  Layout of the shared memory statistics (-Z option)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The segment starts with the header followed by one block per loop.
+ * Each block is written only by the thread running the loop. The writer
+ * makes the sequence number odd before the update and even after it,
+ * so a reader copies the block and retries when the sequence number
+ * was odd or changed during the copy. The writers never wait.
+ */
+
+#include <stdint.h>
+
+#define ALSALOOP_STATS_MAGIC	0x54534c41	/* "ALST" */
+#define ALSALOOP_STATS_VERSION	1
+
+struct alsaloop_stats_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			/* size of one block */
+	uint32_t count;			/* number of blocks */
+	int64_t pid;
+};
+
+struct alsaloop_stats {
+	uint32_t seq;			/* odd while updated */
+	uint32_t running;
+	char id[64];			/* loop id */
+	uint64_t tstamp;		/* last update in us (monotonic) */
+	uint32_t rate;			/* playback rate */
+	uint32_t latency;		/* requested latency in frames */
+	double pitch;
+	int64_t pitch_diff;		/* latency error in frames */
+	int64_t pitch_diff_min;
+	int64_t pitch_diff_max;
+	uint64_t underruns;
+	uint64_t overruns;
+	int64_t xrun_max_proctime;	/* us, reset by the xrun report */
+	uint64_t play_buf_count;	/* queued frames */
+	uint64_t play_buf_size;
+	uint64_t capt_buf_count;
+	uint64_t capt_buf_size;
+	uint64_t wakes;			/* processing passes */
+	uint64_t idle_time;		/* us with the playback stopped (-I) */
+	uint32_t idle;			/* the playback is stopped now */
+};
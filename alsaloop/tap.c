@@ -0,0 +1,376 @@
+/*
+ *  A simple PCM loopback utility
+ *  Recording taps (the loop audio written to files)
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The loop thread copies each transferred block with a small header
+ * into the ring of the tap and never waits: a block which does not fit
+ * is dropped and counted. One writer thread drains the rings of all
+ * taps to the files, so the disk latency stays out of the loops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+#include "shmring.h"
+
+#define TAP_RING_SIZE		(4 * 1024 * 1024)	/* bytes, a power of two */
+#define TAP_INTERVAL		20000	/* writer wakeup in us */
+#define TAP_WAV_HEADER		44
+
+struct tap_block {
+	uint32_t bytes;
+	uint32_t format;
+	uint32_t rate;
+	uint32_t channels;
+};
+
+struct loopback_tap {
+	char *path;
+	int wav;			/* the name asks for WAV files */
+	unsigned int rotate;		/* seconds per file, 0 = no rotation */
+	struct alsaloop_ring *ring;	/* bytes, the loop thread produces */
+	unsigned long long dropped;	/* blocks, written by the loop thread */
+	unsigned int failed;		/* the writer gave up */
+	/* the writer thread only */
+	FILE *file;
+	int header;			/* the current file has a WAV header */
+	unsigned int index;
+	struct tap_block params;	/* of the current file */
+	unsigned long long frames;	/* in the current file */
+	unsigned long long data;	/* bytes in the current file */
+	unsigned long long dropped_seen;
+	struct loopback_tap *next;
+};
+
+static struct loopback_tap *taps;
+static pthread_t tap_thread;
+static int tap_running;
+static int tap_quit;
+
+static void tap_free(struct loopback_tap *tap)
+{
+	free(tap->ring);
+	free(tap->path);
+	free(tap);
+}
+
+/* a repeated option replaces the tap of the handle */
+static void tap_remove(struct loopback_tap *tap)
+{
+	struct loopback_tap **prev;
+
+	for (prev = &taps; *prev; prev = &(*prev)->next) {
+		if (*prev == tap) {
+			*prev = tap->next;
+			break;
+		}
+	}
+	tap_free(tap);
+}
+
+/*
+ * The argument is FILE[@SECONDS]. A name ending with .wav gets a WAV
+ * header, other files get the raw samples.
+ */
+int tap_add(struct loopback_handle *lhandle, const char *arg)
+{
+	struct loopback_tap *tap;
+	const char *ext;
+	char *at;
+
+	tap = calloc(1, sizeof(*tap));
+	if (tap == NULL)
+		return -ENOMEM;
+	tap->path = strdup(arg);
+	if (tap->path == NULL)
+		goto __nomem;
+	at = strrchr(tap->path, '@');
+	if (at) {
+		*at++ = '\0';
+		tap->rotate = atoi(at);
+	}
+	if (tap->path[0] == '\0') {
+		logit(LOG_CRIT, "Wrong tap file name '%s'\n", arg);
+		free(tap->path);
+		free(tap);
+		return -EINVAL;
+	}
+	ext = strrchr(tap->path, '.');
+	tap->wav = ext && strcasecmp(ext, ".wav") == 0;
+	tap->ring = calloc(1, sizeof(*tap->ring) + TAP_RING_SIZE);
+	if (tap->ring == NULL)
+		goto __nomem;
+	tap->ring->frame_size = 1;
+	tap->ring->size = TAP_RING_SIZE;
+	tap->ring->data = sizeof(*tap->ring);
+	if (lhandle->tap)
+		tap_remove(lhandle->tap);
+	tap->next = taps;
+	taps = tap;
+	lhandle->tap = tap;
+	return 0;
+      __nomem:
+	free(tap->path);
+	free(tap);
+	return -ENOMEM;
+}
+
+/* called from the loop thread, never blocks */
+void tap_push(struct loopback_tap *tap, struct loopback_handle *lhandle,
+	      const char *buf, snd_pcm_uframes_t frames)
+{
+	struct alsaloop_ring *r = tap->ring;
+	struct tap_block b;
+	uint32_t head;
+
+	if (frames == 0 || __atomic_load_n(&tap->failed, __ATOMIC_RELAXED))
+		return;
+	b.bytes = frames * lhandle->frame_size;
+	b.format = lhandle->format;
+	b.rate = lhandle->rate;
+	b.channels = lhandle->channels;
+	if (alsaloop_ring_room(r) < sizeof(b) + b.bytes) {
+		__atomic_store_n(&tap->dropped, tap->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	alsaloop_ring_copy(r, head, &b, sizeof(b), 1);
+	alsaloop_ring_copy(r, head + sizeof(b), (void *)buf, b.bytes, 1);
+	__atomic_store_n(&r->head, head + sizeof(b) + b.bytes,
+			 __ATOMIC_RELEASE);
+}
+
+void tap_dump(struct loopback_tap *tap, snd_output_t *out)
+{
+	snd_output_printf(out, "    tap: %s, queued = %u bytes, dropped = %llu blocks\n", tap->path, alsaloop_ring_count(tap->ring), __atomic_load_n(&tap->dropped, __ATOMIC_RELAXED));
+}
+
+static void put_le(unsigned char *p, uint32_t val, int bytes)
+{
+	while (bytes-- > 0) {
+		*p++ = val;
+		val >>= 8;
+	}
+}
+
+/* the sizes are patched when the file is closed */
+static int tap_wav_header(struct loopback_tap *tap)
+{
+	struct tap_block *b = &tap->params;
+	snd_pcm_format_t format = b->format;
+	unsigned char h[TAP_WAV_HEADER];
+	int width = snd_pcm_format_physical_width(format);
+	unsigned int block = width / 8 * b->channels;
+	uint32_t data = tap->data > 0xffffffffULL - 36 ? 0xffffffff - 36 : tap->data;
+
+	/* the 16 byte fmt chunk cannot describe padded samples (S24_LE, S20_LE) */
+	if ((!snd_pcm_format_linear(format) && !snd_pcm_format_float(format)) ||
+	    snd_pcm_format_width(format) != width ||
+	    (width > 8 && !snd_pcm_format_little_endian(format)) ||
+	    (width == 8 && snd_pcm_format_signed(format)) ||
+	    (width > 8 && !snd_pcm_format_signed(format)))
+		return -EINVAL;
+	memcpy(h, "RIFF", 4);
+	put_le(h + 4, data + 36, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 16, 4);
+	put_le(h + 20, snd_pcm_format_float(format) ? 3 : 1, 2);
+	put_le(h + 22, b->channels, 2);
+	put_le(h + 24, b->rate, 4);
+	put_le(h + 28, b->rate * block, 4);
+	put_le(h + 32, block, 2);
+	put_le(h + 34, width, 2);
+	memcpy(h + 36, "data", 4);
+	put_le(h + 40, data, 4);
+	if (fwrite(h, sizeof(h), 1, tap->file) != 1)
+		return -errno;
+	return 0;
+}
+
+static void tap_file_close(struct loopback_tap *tap)
+{
+	if (tap->file == NULL)
+		return;
+	if (tap->header && fseek(tap->file, 0, SEEK_SET) == 0)
+		tap_wav_header(tap);
+	fclose(tap->file);
+	tap->file = NULL;
+}
+
+/*
+ * Without rotation the first file uses the given name. The following
+ * files (rotation or new stream parameters) get a counter before the
+ * extension.
+ */
+static int tap_file_open(struct loopback_tap *tap, struct tap_block *b)
+{
+	char name[PATH_MAX];
+	const char *ext = strrchr(tap->path, '.');
+	const char *slash = strrchr(tap->path, '/');
+	int err;
+
+	if (ext == NULL || (slash && ext < slash))
+		ext = tap->path + strlen(tap->path);
+	if (tap->rotate == 0 && tap->index == 0)
+		snprintf(name, sizeof(name), "%s", tap->path);
+	else
+		snprintf(name, sizeof(name), "%.*s.%04u%s", (int)(ext - tap->path), tap->path, tap->index, ext);
+	tap->index++;
+	tap->params = *b;
+	tap->frames = 0;
+	tap->data = 0;
+	tap->file = fopen(name, "w");
+	if (tap->file == NULL) {
+		err = -errno;
+		logit(LOG_CRIT, "Unable to create tap file %s: %s\n", name, strerror(-err));
+		return err;
+	}
+	/* decided for each file, the next one may have another format */
+	tap->header = tap->wav;
+	if (tap->header && (err = tap_wav_header(tap)) < 0) {
+		if (err == -EINVAL)
+			logit(LOG_WARNING, "%s: no WAV header for %s, writing raw samples\n", name, snd_pcm_format_name(b->format));
+		tap->header = 0;
+		if (err != -EINVAL)
+			return err;
+	}
+	if (verbose > 1)
+		logit(LOG_INFO, "Tap file %s\n", name);
+	return 0;
+}
+
+static int tap_drain(struct loopback_tap *tap)
+{
+	struct alsaloop_ring *r = tap->ring;
+	struct tap_block b;
+	uint32_t tail, pos, count1;
+	unsigned int frame_size;
+	int err;
+
+	while (alsaloop_ring_count(r) >= sizeof(b)) {
+		tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		alsaloop_ring_copy(r, tail, &b, sizeof(b), 0);
+		frame_size = snd_pcm_format_physical_width(b.format) / 8 *
+			     b.channels;
+		if (tap->file &&
+		    (b.format != tap->params.format ||
+		     b.rate != tap->params.rate ||
+		     b.channels != tap->params.channels ||
+		     (tap->rotate &&
+		      tap->frames >= (unsigned long long)tap->rotate * b.rate)))
+			tap_file_close(tap);
+		if (tap->file == NULL && (err = tap_file_open(tap, &b)) < 0)
+			return err;
+		pos = (tail + sizeof(b)) & (r->size - 1);
+		count1 = b.bytes;
+		if (count1 > r->size - pos)
+			count1 = r->size - pos;
+		if (fwrite((char *)r + r->data + pos, 1, count1, tap->file) != count1 ||
+		    fwrite((char *)r + r->data, 1, b.bytes - count1, tap->file) != b.bytes - count1) {
+			err = -errno;
+			logit(LOG_CRIT, "Tap %s write error: %s\n", tap->path, strerror(-err));
+			return err;
+		}
+		tap->data += b.bytes;
+		if (frame_size)
+			tap->frames += b.bytes / frame_size;
+		__atomic_store_n(&r->tail, tail + sizeof(b) + b.bytes,
+				 __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static void tap_drain_all(void)
+{
+	struct loopback_tap *tap;
+	unsigned long long dropped;
+
+	for (tap = taps; tap; tap = tap->next) {
+		if (tap->failed)
+			continue;
+		if (tap_drain(tap) < 0) {
+			tap_file_close(tap);
+			__atomic_store_n(&tap->failed, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		dropped = __atomic_load_n(&tap->dropped, __ATOMIC_RELAXED);
+		if (dropped != tap->dropped_seen) {
+			logit(LOG_WARNING, "Tap %s: %llu blocks dropped (disk too slow)\n", tap->path, dropped - tap->dropped_seen);
+			tap->dropped_seen = dropped;
+		}
+	}
+}
+
+static void *tap_writer(void *arg)
+{
+	while (!__atomic_load_n(&tap_quit, __ATOMIC_RELAXED)) {
+		tap_drain_all();
+		usleep(TAP_INTERVAL);
+	}
+	tap_drain_all();
+	return NULL;
+}
+
+int tap_start(void)
+{
+	sigset_t mask, omask;
+	int err;
+
+	if (taps == NULL)
+		return 0;
+	/* the signals are handled by the loop threads */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &omask);
+	err = pthread_create(&tap_thread, NULL, tap_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	if (err) {
+		logit(LOG_CRIT, "Unable to create the tap writer thread: %s\n", strerror(err));
+		return -err;
+	}
+	tap_running = 1;
+	return 0;
+}
+
+/* at exit, the queued blocks are written and the files completed */
+void tap_close(void)
+{
+	struct loopback_tap *tap;
+
+	if (tap_running) {
+		__atomic_store_n(&tap_quit, 1, __ATOMIC_RELAXED);
+		pthread_join(tap_thread, NULL);
+		tap_running = 0;
+	}
+	while (taps) {
+		tap = taps;
+		taps = tap->next;
+		tap_file_close(tap);
+		tap_free(tap);
+	}
+}
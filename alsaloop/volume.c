@@ -0,0 +1,332 @@
+/*
+ *  A simple PCM loopback utility
+ *  Software volume driven by a user control
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ */
+
+/*
+ * The loop creates an integer control with one value per playback
+ * channel in 0.5dB steps, the lowest value mutes. It is created on the
+ * capture card like the redirected mixer controls, so the application
+ * playing to the loopback device sees it as its own volume.
+ *
+ * A change of the control ramps linearly to the new gain in VOLUME_RAMP
+ * milliseconds, which avoids the zipper noise of a stepped volume. The
+ * steady state is a flat multiply, skipped when the gain is 0dB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <syslog.h>
+#include <alsa/asoundlib.h>
+#include "alsaloop.h"
+
+#define VOLUME_RAMP	10		/* ms */
+#define VOLUME_MIN_DB	-60.0
+#define VOLUME_MAX_DB	0.0
+#define VOLUME_TLV_MUTE	0x10000		/* the lowest value mutes */
+
+/* NAME[@MIN_DB:MAX_DB], the name can be a full id like in -m */
+int volume_parse(const char *arg, struct loopback_volume **volume)
+{
+	struct loopback_volume *g;
+	char name[64], *str;
+	size_t len;
+	int err;
+
+	str = strchr(arg, '@');
+	len = str ? (size_t)(str - arg) : strlen(arg);
+	if (len == 0 || len >= sizeof(name)) {
+		logit(LOG_CRIT, "Wrong volume control name '%s'\n", arg);
+		return -EINVAL;
+	}
+	memcpy(name, arg, len);
+	name[len] = '\0';
+	g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		return -ENOMEM;
+	if (snd_ctl_elem_id_malloc(&g->id) < 0 ||
+	    snd_ctl_elem_value_malloc(&g->value) < 0) {
+		err = -ENOMEM;
+		goto __error;
+	}
+	if (strchr(name, '=')) {
+		err = control_parse_id(name, g->id);
+		if (err < 0) {
+			logit(LOG_CRIT, "Wrong volume control id '%s'\n", name);
+			goto __error;
+		}
+	} else {
+		snd_ctl_elem_id_set_interface(g->id, SND_CTL_ELEM_IFACE_MIXER);
+		snd_ctl_elem_id_set_name(g->id, name);
+	}
+	g->min_db = VOLUME_MIN_DB;
+	g->max_db = VOLUME_MAX_DB;
+	if (str && sscanf(str + 1, "%f:%f", &g->min_db, &g->max_db) != 2) {
+		logit(LOG_CRIT, "Wrong volume range '%s' (MIN_DB:MAX_DB)\n", str + 1);
+		err = -EINVAL;
+		goto __error;
+	}
+	g->min_db = roundf(g->min_db * 2) / 2;
+	g->max_db = roundf(g->max_db * 2) / 2;
+	if (g->max_db <= g->min_db || g->min_db >= 0 ||
+	    g->min_db < -100 || g->max_db > 24) {
+		logit(LOG_CRIT, "Wrong volume range %.1fdB..%.1fdB\n", g->min_db, g->max_db);
+		err = -EINVAL;
+		goto __error;
+	}
+	*volume = g;
+	return 0;
+      __error:
+	volume_free(g);
+	return err;
+}
+
+void volume_free(struct loopback_volume *g)
+{
+	if (g->id)
+		snd_ctl_elem_id_free(g->id);
+	if (g->value)
+		snd_ctl_elem_value_free(g->value);
+	free(g);
+}
+
+static float volume_value(struct loopback_volume *g, long value)
+{
+	if (value <= 0)
+		return 0;
+	return pow(10.0, (g->min_db + value * 0.5) / 20.0);
+}
+
+/* create the control, called when the devices are opened */
+int volume_init(struct loopback *loop)
+{
+	struct loopback_volume *g = loop->volume;
+	unsigned int tlv[4], i;
+	long max, value;
+	int err;
+
+	g->ctl = loop->capt->ctl ? loop->capt->ctl : loop->play->ctl;
+	if (g->ctl == NULL) {
+		logit(LOG_CRIT, "%s: no ctl device for the volume control\n", loop->id);
+		return -ENODEV;
+	}
+	/* a mono control is applied to all channels */
+	g->count = loop->play->channels;
+	max = (long)((g->max_db - g->min_db) * 2);
+	value = (long)(-g->min_db * 2);
+	if (value > max)
+		value = max;
+	snd_ctl_elem_remove(g->ctl, g->id);
+	err = snd_ctl_elem_add_integer(g->ctl, g->id, g->count, 0, max, 1);
+	if (err < 0) {
+		logit(LOG_CRIT, "%s: Unable to create volume control '%s': %s\n", loop->id, snd_ctl_elem_id_get_name(g->id), snd_strerror(err));
+		return err;
+	}
+	err = snd_ctl_elem_unlock(g->ctl, g->id);
+	if (err < 0) {
+		logit(LOG_CRIT, "%s: Unable to unlock volume control '%s': %s\n", loop->id, snd_ctl_elem_id_get_name(g->id), snd_strerror(err));
+		goto __error;
+	}
+	tlv[0] = SND_CTL_TLVT_DB_SCALE;
+	tlv[1] = 2 * sizeof(unsigned int);
+	tlv[2] = (unsigned int)(int)(g->min_db * 100);
+	tlv[3] = 50 | VOLUME_TLV_MUTE;
+	err = snd_ctl_elem_tlv_write(g->ctl, g->id, tlv);
+	if (err < 0)
+		logit(LOG_WARNING, "%s: Unable to write TLV for '%s': %s\n", loop->id, snd_ctl_elem_id_get_name(g->id), snd_strerror(err));
+	snd_ctl_elem_value_clear(g->value);
+	snd_ctl_elem_value_set_id(g->value, g->id);
+	for (i = 0; i < g->count; i++)
+		snd_ctl_elem_value_set_integer(g->value, i, value);
+	err = snd_ctl_elem_write(g->ctl, g->value);
+	if (err < 0) {
+		logit(LOG_CRIT, "%s: Unable to write volume control '%s': %s\n", loop->id, snd_ctl_elem_id_get_name(g->id), snd_strerror(err));
+		goto __error;
+	}
+	return 0;
+      __error:
+	snd_ctl_elem_remove(g->ctl, g->id);
+	g->ctl = NULL;
+	return err;
+}
+
+void volume_done(struct loopback *loop)
+{
+	struct loopback_volume *g = loop->volume;
+	int err;
+
+	if (g->ctl == NULL)
+		return;
+	err = snd_ctl_elem_remove(g->ctl, g->id);
+	if (err < 0)
+		logit(LOG_WARNING, "%s: Unable to remove volume control '%s': %s\n", loop->id, snd_ctl_elem_id_get_name(g->id), snd_strerror(err));
+	g->ctl = NULL;
+}
+
+/* read the control, the new gains are reached after the ramp */
+static int volume_update(struct loopback_volume *g, int ramp)
+{
+	unsigned int c;
+	float v;
+	int err;
+
+	err = snd_ctl_elem_read(g->ctl, g->value);
+	if (err < 0)
+		return err;
+	g->unity = g->uniform = 1;
+	for (c = 0; c < g->channels; c++) {
+		v = volume_value(g, snd_ctl_elem_value_get_integer(g->value,
+				c < g->count ? c : g->count - 1));
+		g->target[c] = v;
+		if (ramp)
+			g->step[c] = (v - g->cur[c]) / g->ramp;
+		else
+			g->cur[c] = v;
+		if (v != 1.0f)
+			g->unity = 0;
+		if (v != g->target[0])
+			g->uniform = 0;
+	}
+	g->left = ramp ? g->ramp : 0;
+	return 0;
+}
+
+/* called from pcmjob_start(), the channels and the rate are known */
+int volume_start(struct loopback *loop)
+{
+	struct loopback_volume *g = loop->volume;
+	unsigned int channels = loop->play->channels;
+	int err;
+
+	if (g->ctl == NULL)
+		return 0;
+	g->cur = malloc((3 + EFFECT_BLOCK) * channels * sizeof(float));
+	if (g->cur == NULL)
+		return -ENOMEM;
+	g->target = g->cur + channels;
+	g->step = g->target + channels;
+	g->buf = g->step + channels;
+	g->channels = channels;
+	g->ramp = loop->play->rate * VOLUME_RAMP / 1000;
+	if (g->ramp == 0)
+		g->ramp = 1;
+	err = volume_update(g, 0);
+	if (err < 0) {
+		logit(LOG_CRIT, "%s: Unable to read volume control '%s': %s\n", loop->id, snd_ctl_elem_id_get_name(g->id), snd_strerror(err));
+		volume_stop(loop);
+		return err;
+	}
+	return 0;
+}
+
+void volume_stop(struct loopback *loop)
+{
+	struct loopback_volume *g = loop->volume;
+
+	free(g->cur);
+	g->cur = g->target = g->step = g->buf = NULL;
+	g->channels = 0;
+	g->left = 0;
+}
+
+/* returns 1 when the event belongs to the volume control */
+int volume_event(struct loopback *loop, snd_ctl_t *ctl, snd_ctl_event_t *ev)
+{
+	struct loopback_volume *g = loop->volume;
+	snd_ctl_elem_id_t *id;
+	int err;
+
+	if (g->ctl != ctl)
+		return 0;
+	snd_ctl_elem_id_alloca(&id);
+	snd_ctl_event_elem_get_id(ev, id);
+	if (!control_id_match(id, g->id))
+		return 0;
+	if (snd_ctl_event_elem_get_mask(ev) == SND_CTL_EVENT_MASK_REMOVE ||
+	    (snd_ctl_event_elem_get_mask(ev) & SND_CTL_EVENT_MASK_VALUE) == 0)
+		return 1;
+	/* the values are read again in volume_start() */
+	if (g->cur == NULL)
+		return 1;
+	err = volume_update(g, 1);
+	if (err < 0) {
+		logit(LOG_WARNING, "%s: Unable to read volume control '%s': %s\n", loop->id, snd_ctl_elem_id_get_name(g->id), snd_strerror(err));
+		return 1;
+	}
+	g->changes++;
+	return 1;
+}
+
+/*
+ * The ramp is per frame, as each channel has its own step. The steady
+ * state with the same gain on all channels is one loop over the samples.
+ */
+void volume_process(struct loopback_volume *g, float *buf,
+		  snd_pcm_uframes_t frames)
+{
+	const unsigned int channels = g->channels;
+	snd_pcm_uframes_t i, n;
+	unsigned int c;
+	float v;
+
+	if (g->left > 0) {
+		n = frames < g->left ? frames : g->left;
+		for (i = 0; i < n; i++, buf += channels)
+			for (c = 0; c < channels; c++) {
+				buf[c] *= g->cur[c];
+				g->cur[c] += g->step[c];
+			}
+		frames -= n;
+		g->left -= n;
+		/* no rounding error is left after the ramp */
+		if (g->left == 0)
+			memcpy(g->cur, g->target, channels * sizeof(float));
+	}
+	if (frames == 0 || g->unity)
+		return;
+	if (g->uniform) {
+		v = g->target[0];
+		n = frames * channels;
+		for (i = 0; i < n; i++)
+			buf[i] *= v;
+		return;
+	}
+	for (i = 0; i < frames; i++, buf += channels)
+		for (c = 0; c < channels; c++)
+			buf[c] *= g->target[c];
+}
+
+void volume_state(struct loopback *loop, snd_output_t *out)
+{
+	struct loopback_volume *g = loop->volume;
+	unsigned int c;
+
+	snd_output_printf(out, "  volume '%s' (%.1fdB..%.1fdB), changes = %llu:",
+			  snd_ctl_elem_id_get_name(g->id), g->min_db, g->max_db,
+			  g->changes);
+	for (c = 0; c < g->channels; c++) {
+		if (g->target[c] > 0)
+			snd_output_printf(out, " %.1fdB", 20 * log10(g->target[c]));
+		else
+			snd_output_printf(out, " mute");
+	}
+	snd_output_printf(out, "%s\n", g->left ? " (ramp)" : "");
+}
@@ -37,6 +37,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <locale.h>
 #include <alsa/asoundlib.h>
@@ -130,10 +131,16 @@ static int use_strftime = 0;
 volatile static int recycle_capture_file = 0;
 static long term_c_lflag = -1;
 static int dump_hw_params = 0;
+static int mix_mode = 0;
+static float *mix_gains = NULL;
+static unsigned int mix_gains_count = 0;
+static char *verify_pcm_name = NULL;
 
 static int fd = -1;
 static off64_t pbrec_count = LLONG_MAX, fdcount;
 static int vocmajor, vocminor;
+static u_int wav_valid_bits;		/* WAVE extensible wValidBitsPerSample */
+static u_int wav_channel_mask;		/* WAVE extensible dwChannelMask */
 
 static char *pidfile_name = NULL;
 FILE *pidf = NULL;
@@ -147,6 +154,8 @@ static void playback(char *filename);
 static void capture(char *filename);
 static void playbackv(char **filenames, unsigned int count);
 static void capturev(char **filenames, unsigned int count);
+static void playback_mix(char **filenames, unsigned int count);
+static int verify(void);
 
 static void begin_voc(int fd, size_t count);
 static void end_voc(int fd);
@@ -225,7 +234,11 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "                        for this many seconds\n"
 "    --process-id-file   write the process ID here\n"
 "    --use-strftime      apply the strftime facility to the output file name\n"
-"    --dump-hw-params    dump hw_params of the device\n")
+"    --dump-hw-params    dump hw_params of the device\n"
+"    --mix               mix all given files into one stream\n"
+"    --mix-gain=#[,#...] linear gain for each mixed file (default 1.0)\n"
+"    --verify=NAME       play a test pattern and verify it bit-exact on\n"
+"                        capture PCM NAME (loopback test)\n")
 		, command);
 	printf(_("Recognized sample formats are:"));
 	for (k = 0; k < SND_PCM_FORMAT_LAST; ++k) {
@@ -405,6 +418,39 @@ static void signal_handler_recycle (int sig)
 	recycle_capture_file = 1;
 }
 
+/* parse the comma separated list of per-file gains for --mix */
+static int parse_mix_gains(const char *arg)
+{
+	const char *p = arg;
+	char *end;
+	float gain;
+
+	free(mix_gains);
+	mix_gains = NULL;
+	mix_gains_count = 0;
+	while (*p) {
+		gain = strtod(p, &end);
+		if (end == p || !(gain >= 0 && gain <= 8)) {
+			error(_("invalid mix gain '%s' (valid range is 0 - 8)"), p);
+			return -1;
+		}
+		mix_gains = realloc(mix_gains, (mix_gains_count + 1) * sizeof(*mix_gains));
+		if (mix_gains == NULL) {
+			error(_("not enough memory"));
+			return -1;
+		}
+		mix_gains[mix_gains_count++] = gain;
+		p = end;
+		if (*p == ',')
+			p++;
+		else if (*p) {
+			error(_("invalid mix gain '%s' (valid range is 0 - 8)"), p);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 enum {
 	OPT_VERSION = 1,
 	OPT_PERIOD_SIZE,
@@ -419,7 +465,10 @@ enum {
 	OPT_MAX_FILE_TIME,
 	OPT_PROCESS_ID_FILE,
 	OPT_USE_STRFTIME,
-	OPT_DUMP_HWPARAMS
+	OPT_DUMP_HWPARAMS,
+	OPT_MIX,
+	OPT_MIX_GAIN,
+	OPT_VERIFY
 };
 
 int main(int argc, char *argv[])
@@ -465,6 +514,9 @@ int main(int argc, char *argv[])
 		{"use-strftime", 0, 0, OPT_USE_STRFTIME},
 		{"interactive", 0, 0, 'i'},
 		{"dump-hw-params", 0, 0, OPT_DUMP_HWPARAMS},
+		{"mix", 0, 0, OPT_MIX},
+		{"mix-gain", 1, 0, OPT_MIX_GAIN},
+		{"verify", 1, 0, OPT_VERIFY},
 		{0, 0, 0, 0}
 	};
 	char *pcm_name = "default";
@@ -669,6 +721,16 @@ int main(int argc, char *argv[])
 		case OPT_DUMP_HWPARAMS:
 			dump_hw_params = 1;
 			break;
+		case OPT_MIX:
+			mix_mode = 1;
+			break;
+		case OPT_MIX_GAIN:
+			if (parse_mix_gains(optarg) < 0)
+				return 1;
+			break;
+		case OPT_VERIFY:
+			verify_pcm_name = optarg;
+			break;
 		default:
 			fprintf(stderr, _("Try `%s --help' for more information.\n"), command);
 			return 1;
@@ -742,7 +804,27 @@ int main(int argc, char *argv[])
 	signal(SIGTERM, signal_handler);
 	signal(SIGABRT, signal_handler);
 	signal(SIGUSR1, signal_handler_recycle);
-	if (interleaved) {
+	if (verify_pcm_name) {
+		if (stream != SND_PCM_STREAM_PLAYBACK || !interleaved) {
+			error(_("--verify works only for interleaved playback"));
+			prg_exit(EXIT_FAILURE);
+		}
+		err = verify();
+		snd_pcm_close(handle);
+		handle = NULL;
+		free(audiobuf);
+		prg_exit(err < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	} else if (mix_mode && stream == SND_PCM_STREAM_PLAYBACK) {
+		if (!interleaved) {
+			error(_("--mix cannot be used with separate channels"));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (optind > argc - 1) {
+			error(_("--mix requires at least one file"));
+			prg_exit(EXIT_FAILURE);
+		}
+		playback_mix(&argv[optind], argc - optind);
+	} else if (interleaved) {
 		if (optind > argc - 1) {
 			if (stream == SND_PCM_STREAM_PLAYBACK)
 				playback(NULL);
@@ -850,6 +932,7 @@ static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 	WaveFmtBody *f;
 	WaveChunkHeader *c;
 	u_int type, len;
+	snd_pcm_format_t format;
 
 	if (size < sizeof(WaveHeader))
 		return -1;
@@ -887,6 +970,8 @@ static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 	check_wavefile_space(buffer, len, blimit);
 	test_wavefile_read(fd, buffer, &size, len, __LINE__);
 	f = (WaveFmtBody*) buffer;
+	wav_valid_bits = 0;
+	wav_channel_mask = 0;
 	if (LE_SHORT(f->format) == WAV_FMT_EXTENSIBLE) {
 		WaveFmtExtensibleBody *fe = (WaveFmtExtensibleBody*)buffer;
 		if (len < sizeof(WaveFmtExtensibleBody)) {
@@ -898,6 +983,13 @@ static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 			error(_("wrong format tag in extensible 'fmt ' chunk"));
 			prg_exit(EXIT_FAILURE);
 		}
+		wav_valid_bits = LE_SHORT(fe->bit_p_spl);
+		wav_channel_mask = LE_INT(fe->channel_mask);
+		if (wav_valid_bits > LE_SHORT(f->bit_p_spl)) {
+			error(_("valid bits %d exceed the %d bit sample container"),
+			      wav_valid_bits, LE_SHORT(f->bit_p_spl));
+			prg_exit(EXIT_FAILURE);
+		}
 		f->format = fe->guid_format;
 	}
         if (LE_SHORT(f->format) != WAV_FMT_PCM &&
@@ -910,32 +1002,48 @@ static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 		prg_exit(EXIT_FAILURE);
 	}
 	hwparams.channels = LE_SHORT(f->channels);
+	if (wav_channel_mask) {
+		u_int mask, n;
+		for (mask = wav_channel_mask, n = 0; mask; mask &= mask - 1)
+			n++;
+		if (n != hwparams.channels)
+			fprintf(stderr, _("Warning: channel mask 0x%x doesn't match %d channels\n"),
+				wav_channel_mask, hwparams.channels);
+		else if (verbose)
+			fprintf(stderr, _("Channel mask 0x%x\n"), wav_channel_mask);
+	}
+	if (LE_SHORT(f->format) == WAV_FMT_IEEE_FLOAT) {
+		switch (LE_SHORT(f->bit_p_spl)) {
+		case 32:
+			format = SND_PCM_FORMAT_FLOAT_LE;
+			break;
+		case 64:
+			format = SND_PCM_FORMAT_FLOAT64_LE;
+			break;
+		default:
+			error(_(" can't play WAVE-files with %d bits wide float samples"),
+			      LE_SHORT(f->bit_p_spl));
+			prg_exit(EXIT_FAILURE);
+		}
+		goto __format;
+	}
+	/* the valid bits of PCM samples are always MSB aligned in
+	   the container, so the container size selects the format */
 	switch (LE_SHORT(f->bit_p_spl)) {
 	case 8:
-		if (hwparams.format != DEFAULT_FORMAT &&
-		    hwparams.format != SND_PCM_FORMAT_U8)
-			fprintf(stderr, _("Warning: format is changed to U8\n"));
-		hwparams.format = SND_PCM_FORMAT_U8;
+		format = SND_PCM_FORMAT_U8;
 		break;
 	case 16:
-		if (hwparams.format != DEFAULT_FORMAT &&
-		    hwparams.format != SND_PCM_FORMAT_S16_LE)
-			fprintf(stderr, _("Warning: format is changed to S16_LE\n"));
-		hwparams.format = SND_PCM_FORMAT_S16_LE;
+		format = SND_PCM_FORMAT_S16_LE;
 		break;
 	case 24:
 		switch (LE_SHORT(f->byte_p_spl) / hwparams.channels) {
 		case 3:
-			if (hwparams.format != DEFAULT_FORMAT &&
-			    hwparams.format != SND_PCM_FORMAT_S24_3LE)
-				fprintf(stderr, _("Warning: format is changed to S24_3LE\n"));
-			hwparams.format = SND_PCM_FORMAT_S24_3LE;
+			format = SND_PCM_FORMAT_S24_3LE;
 			break;
 		case 4:
-			if (hwparams.format != DEFAULT_FORMAT &&
-			    hwparams.format != SND_PCM_FORMAT_S24_LE)
-				fprintf(stderr, _("Warning: format is changed to S24_LE\n"));
-			hwparams.format = SND_PCM_FORMAT_S24_LE;
+			/* legacy files with 24 bits LSB aligned in 4 bytes */
+			format = SND_PCM_FORMAT_S24_LE;
 			break;
 		default:
 			error(_(" can't play WAVE-files with sample %d bits in %d bytes wide (%d channels)"),
@@ -944,16 +1052,23 @@ static ssize_t test_wavefile(int fd, u_char *_buffer, size_t size)
 		}
 		break;
 	case 32:
-                if (LE_SHORT(f->format) == WAV_FMT_PCM)
-                        hwparams.format = SND_PCM_FORMAT_S32_LE;
-                else if (LE_SHORT(f->format) == WAV_FMT_IEEE_FLOAT)
-                        hwparams.format = SND_PCM_FORMAT_FLOAT_LE;
+		format = SND_PCM_FORMAT_S32_LE;
 		break;
 	default:
 		error(_(" can't play WAVE-files with sample %d bits wide"),
 		      LE_SHORT(f->bit_p_spl));
 		prg_exit(EXIT_FAILURE);
 	}
+      __format:
+	if (hwparams.format != DEFAULT_FORMAT &&
+	    hwparams.format != format)
+		fprintf(stderr, _("Warning: format is changed to %s\n"),
+			snd_pcm_format_name(format));
+	hwparams.format = format;
+	if (wav_valid_bits && wav_valid_bits < (u_int)snd_pcm_format_width(format) &&
+	    verbose)
+		fprintf(stderr, _("Using %s with %d valid bits\n"),
+			snd_pcm_format_name(format), wav_valid_bits);
 	hwparams.rate = LE_INT(f->sample_fq);
 	
 	if (size > len)
@@ -2258,6 +2373,9 @@ static void begin_wave(int fd, size_t cnt)
 	case SND_PCM_FORMAT_S24_3LE:
 		bits = 24;
 		break;
+	case SND_PCM_FORMAT_FLOAT64_LE:
+		bits = 64;
+		break;
 	default:
 		error(_("Wave doesn't support %s format..."), snd_pcm_format_name(hwparams.format));
 		prg_exit(EXIT_FAILURE);
@@ -2270,7 +2388,8 @@ static void begin_wave(int fd, size_t cnt)
 	cf.type = WAV_FMT;
 	cf.length = LE_INT(16);
 
-        if (hwparams.format == SND_PCM_FORMAT_FLOAT_LE)
+        if (hwparams.format == SND_PCM_FORMAT_FLOAT_LE ||
+	    hwparams.format == SND_PCM_FORMAT_FLOAT64_LE)
                 f.format = LE_SHORT(WAV_FMT_IEEE_FLOAT);
         else
                 f.format = LE_SHORT(WAV_FMT_PCM);
@@ -3003,3 +3122,741 @@ static void capturev(char **names, unsigned int count)
 	if (ret)
 		prg_exit(ret);
 }
+
+/*
+ *  software mixing of several files into one stream
+ */
+
+/* gains are applied as fixed point values for the integer formats */
+#define MIX_GAIN_SHIFT		12
+#define MIX_GAIN_ONE		(1 << MIX_GAIN_SHIFT)
+#define MIX_BUF_ALIGN		64
+
+struct mix_input {
+	char *name;
+	int fd;
+	int rtype;
+	u_char *buf;		/* chunk_bytes read buffer */
+	size_t loaded;		/* bytes already in buf (header leftover) */
+	off64_t count;		/* bytes to play */
+	off64_t written;
+	int eof;
+	int gain;		/* fixed point gain (MIX_GAIN_SHIFT) */
+	float fgain;
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int rate;
+};
+
+static void mix_open_input(struct mix_input *in, char *name)
+{
+	size_t dta;
+	ssize_t dtawave;
+
+	pbrec_count = LLONG_MAX;
+	fdcount = 0;
+	hwparams = rhwparams;
+	if (!strcmp(name, "-")) {
+		in->fd = fileno(stdin);
+		in->name = "stdin";
+	} else {
+		if ((in->fd = open64(name, O_RDONLY, 0)) == -1) {
+			perror(name);
+			prg_exit(EXIT_FAILURE);
+		}
+		in->name = name;
+	}
+	dta = sizeof(AuHeader);
+	if ((size_t)safe_read(in->fd, audiobuf, dta) != dta) {
+		error(_("read error"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (test_au(in->fd, audiobuf) >= 0) {
+		in->rtype = FORMAT_AU;
+		in->loaded = 0;
+		goto __ok;
+	}
+	dta = sizeof(VocHeader);
+	if ((size_t)safe_read(in->fd, audiobuf + sizeof(AuHeader),
+		 dta - sizeof(AuHeader)) != dta - sizeof(AuHeader)) {
+		error(_("read error"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (test_vocfile(audiobuf) >= 0) {
+		error(_("can't mix VOC file '%s'"), in->name);
+		prg_exit(EXIT_FAILURE);
+	}
+	if ((dtawave = test_wavefile(in->fd, audiobuf, dta)) >= 0) {
+		in->rtype = FORMAT_WAVE;
+		in->loaded = dtawave;
+	} else {
+		init_raw_data();
+		in->rtype = FORMAT_RAW;
+		in->loaded = dta;
+	}
+      __ok:
+	in->count = calc_count();
+	in->format = hwparams.format;
+	in->channels = hwparams.channels;
+	in->rate = hwparams.rate;
+	in->buf = malloc(in->loaded > 0 ? in->loaded : 1);
+	if (in->buf == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	memcpy(in->buf, audiobuf, in->loaded);
+}
+
+/*
+ * Accumulate and store helpers, one pair per sample format.
+ * The accumulate step has no branches, the store saturates.
+ */
+
+static void mix_add_u8(int64_t *acc, const uint8_t *src,
+		       int gain, size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		acc[i] += (int64_t)((int32_t)src[i] - 0x80) * gain;
+}
+
+static void mix_store_u8(uint8_t *dst, const int64_t *acc,
+			 size_t samples)
+{
+	size_t i;
+	int64_t v;
+
+	for (i = 0; i < samples; i++) {
+		v = acc[i] >> MIX_GAIN_SHIFT;
+		v = v < -0x80 ? -0x80 : (v > 0x7f ? 0x7f : v);
+		dst[i] = v + 0x80;
+	}
+}
+
+static void mix_add_s16(int64_t *acc, const int16_t *src,
+			int gain, size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		acc[i] += (int64_t)src[i] * gain;
+}
+
+static void mix_store_s16(int16_t *dst, const int64_t *acc,
+			  size_t samples)
+{
+	size_t i;
+	int64_t v;
+
+	for (i = 0; i < samples; i++) {
+		v = acc[i] >> MIX_GAIN_SHIFT;
+		v = v < -0x8000 ? -0x8000 : (v > 0x7fff ? 0x7fff : v);
+		dst[i] = v;
+	}
+}
+
+static void mix_add_s24(int64_t *acc, const int32_t *src,
+			int gain, size_t samples)
+{
+	size_t i;
+
+	/* 24 bit samples in the low bits of a 32 bit container */
+	for (i = 0; i < samples; i++)
+		acc[i] += (int64_t)((int32_t)((uint32_t)src[i] << 8) >> 8) * gain;
+}
+
+static void mix_store_s24(int32_t *dst, const int64_t *acc,
+			  size_t samples)
+{
+	size_t i;
+	int64_t v;
+
+	for (i = 0; i < samples; i++) {
+		v = acc[i] >> MIX_GAIN_SHIFT;
+		v = v < -0x800000 ? -0x800000 : (v > 0x7fffff ? 0x7fffff : v);
+		dst[i] = v;
+	}
+}
+
+static void mix_add_s32(int64_t *acc, const int32_t *src,
+			int gain, size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		acc[i] += (int64_t)src[i] * gain;
+}
+
+static void mix_store_s32(int32_t *dst, const int64_t *acc,
+			  size_t samples)
+{
+	size_t i;
+	int64_t v;
+
+	for (i = 0; i < samples; i++) {
+		v = acc[i] >> MIX_GAIN_SHIFT;
+		v = v < INT32_MIN ? INT32_MIN : (v > INT32_MAX ? INT32_MAX : v);
+		dst[i] = v;
+	}
+}
+
+static void mix_add_float(float *acc, const float *src,
+			  float gain, size_t samples)
+{
+	size_t i;
+
+	for (i = 0; i < samples; i++)
+		acc[i] += src[i] * gain;
+}
+
+static void mix_store_float(float *dst, const float *acc,
+			    size_t samples)
+{
+	size_t i;
+	float v;
+
+	for (i = 0; i < samples; i++) {
+		v = acc[i];
+		dst[i] = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+	}
+}
+
+static void mix_add(void *acc, struct mix_input *in, size_t samples)
+{
+	switch (in->format) {
+	case SND_PCM_FORMAT_U8:
+		mix_add_u8(acc, (uint8_t *)in->buf, in->gain, samples);
+		break;
+	case SND_PCM_FORMAT_S16:
+		mix_add_s16(acc, (int16_t *)in->buf, in->gain, samples);
+		break;
+	case SND_PCM_FORMAT_S24:
+		mix_add_s24(acc, (int32_t *)in->buf, in->gain, samples);
+		break;
+	case SND_PCM_FORMAT_S32:
+		mix_add_s32(acc, (int32_t *)in->buf, in->gain, samples);
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		mix_add_float(acc, (float *)in->buf, in->fgain, samples);
+		break;
+	default:
+		break;
+	}
+}
+
+static void mix_store(u_char *dst, const void *acc, size_t samples)
+{
+	switch (hwparams.format) {
+	case SND_PCM_FORMAT_U8:
+		mix_store_u8((uint8_t *)dst, acc, samples);
+		break;
+	case SND_PCM_FORMAT_S16:
+		mix_store_s16((int16_t *)dst, acc, samples);
+		break;
+	case SND_PCM_FORMAT_S24:
+		mix_store_s24((int32_t *)dst, acc, samples);
+		break;
+	case SND_PCM_FORMAT_S32:
+		mix_store_s32((int32_t *)dst, acc, samples);
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		mix_store_float((float *)dst, acc, samples);
+		break;
+	default:
+		break;
+	}
+}
+
+static size_t mix_acc_width(snd_pcm_format_t format)
+{
+	/* a full scale input at the maximal gain is about 2^30 */
+	switch (format) {
+	case SND_PCM_FORMAT_U8:
+	case SND_PCM_FORMAT_S16:
+	case SND_PCM_FORMAT_S24:
+	case SND_PCM_FORMAT_S32:
+		return sizeof(int64_t);
+	case SND_PCM_FORMAT_FLOAT:
+		return sizeof(float);
+	default:
+		return 0;
+	}
+}
+
+/* read one chunk from the input, returns the number of frames */
+static size_t mix_read_input(struct mix_input *in)
+{
+	off64_t c;
+	ssize_t r;
+	size_t l;
+
+	if (in->eof)
+		return 0;
+	c = in->count - in->written;
+	if (c > (off64_t)chunk_bytes)
+		c = chunk_bytes;
+	l = in->loaded;
+	in->loaded = 0;
+	if (c > (off64_t)l) {
+		r = safe_read(in->fd, in->buf + l, c - l);
+		if (r < 0) {
+			perror(in->name);
+			prg_exit(EXIT_FAILURE);
+		}
+		l += r;
+	} else {
+		l = c;
+	}
+	l = l * 8 / bits_per_frame;
+	if (l == 0) {
+		in->eof = 1;
+		return 0;
+	}
+	in->written += l * bits_per_frame / 8;
+	return l;
+}
+
+static void playback_mix(char **names, unsigned int count)
+{
+	struct mix_input *inputs;
+	void *acc;
+	size_t acc_width, frames, maxframes;
+	unsigned int i;
+
+	inputs = calloc(count, sizeof(*inputs));
+	if (inputs == NULL) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	init_stdin();
+	for (i = 0; i < count; i++) {
+		struct mix_input *in = &inputs[i];
+		mix_open_input(in, names[i]);
+		if (i > 0 && (in->format != inputs[0].format ||
+			      in->channels != inputs[0].channels ||
+			      in->rate != inputs[0].rate)) {
+			error(_("can't mix '%s': format, rate or channels differ from '%s'"),
+			      in->name, inputs[0].name);
+			prg_exit(EXIT_FAILURE);
+		}
+		in->fgain = i < mix_gains_count ? mix_gains[i] : 1.0;
+		in->gain = in->fgain * MIX_GAIN_ONE + 0.5;
+		header(in->rtype, in->name);
+	}
+	acc_width = mix_acc_width(inputs[0].format);
+	if (acc_width == 0) {
+		error(_("can't mix %s format (supported: U8, S16, S24, S32, FLOAT in native endian)"),
+		      snd_pcm_format_name(inputs[0].format));
+		prg_exit(EXIT_FAILURE);
+	}
+	hwparams.format = inputs[0].format;
+	hwparams.channels = inputs[0].channels;
+	hwparams.rate = inputs[0].rate;
+	set_params();
+
+	for (i = 0; i < count; i++) {
+		struct mix_input *in = &inputs[i];
+		in->buf = realloc(in->buf, chunk_bytes > in->loaded ?
+					   chunk_bytes : in->loaded);
+		if (in->buf == NULL) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	/* one accumulator for the whole run, no per-chunk allocations */
+	if (posix_memalign(&acc, MIX_BUF_ALIGN,
+			   chunk_size * hwparams.channels * acc_width)) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		memset(acc, 0, chunk_size * hwparams.channels * acc_width);
+		maxframes = 0;
+		for (i = 0; i < count; i++) {
+			frames = mix_read_input(&inputs[i]);
+			if (frames == 0)
+				continue;
+			mix_add(acc, &inputs[i], frames * hwparams.channels);
+			if (frames > maxframes)
+				maxframes = frames;
+		}
+		if (maxframes == 0)
+			break;
+		mix_store(audiobuf, acc, maxframes * hwparams.channels);
+		if ((size_t)pcm_write(audiobuf, maxframes) < maxframes)
+			break;
+	}
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+
+	free(acc);
+	for (i = 0; i < count; i++) {
+		if (inputs[i].fd != fileno(stdin))
+			close(inputs[i].fd);
+		free(inputs[i].buf);
+	}
+	free(inputs);
+}
+
+/*
+ *  end-to-end verify mode
+ *
+ *  A pseudo-random pattern is played on the main PCM and captured from
+ *  another PCM (for example both ends of snd-aloop).  Every sample is
+ *  a hash of its position in the stream, so any position can be
+ *  generated directly: this lets the checker find the start of the
+ *  pattern in the captured data and resynchronize after dropped or
+ *  duplicated frames without keeping the played data around.
+ */
+
+#define VERIFY_RESYNC_WINDOW	4096	/* frames */
+#define VERIFY_DEFAULT_TIME	10	/* seconds */
+#define VERIFY_SEARCH_TIME	2	/* seconds of the pattern searched for the start */
+#define VERIFY_MAX_MISSES	4096	/* unmatched frames before the search slows down */
+#define VERIFY_RETRY_INTERVAL	1024	/* frames between the searches after that */
+
+/* the first sample of a pattern frame, to find the start without a scan */
+struct verify_key {
+	uint32_t key;
+	uint32_t frame;
+};
+
+struct verify_state {
+	size_t frame_bytes;
+	size_t sample_bytes;
+	u_char *expect;			/* one generated frame */
+	u_char *silence;		/* one silent frame */
+	struct verify_key *index;	/* sorted by the key */
+	size_t index_count;
+	uint32_t key_mask;
+	unsigned int misses;		/* unmatched frames in a row */
+	unsigned long long total;	/* played frames */
+	unsigned long long position;	/* captured frames */
+	unsigned long long next;	/* next expected pattern frame */
+	unsigned long long verified;
+	unsigned long long dropped;
+	unsigned long long duplicated;
+	unsigned long long corrupted;
+	unsigned long long overruns;
+	long long latency;		/* in frames, -1 = unknown */
+	int aligned;
+};
+
+static inline uint32_t verify_hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+static void verify_pattern(struct verify_state *v, u_char *dst,
+			   unsigned long long frame, size_t frames)
+{
+	uint32_t idx = frame * hwparams.channels;
+	size_t i, samples = frames * hwparams.channels;
+	unsigned int b;
+
+	for (i = 0; i < samples; i++) {
+		uint32_t val = verify_hash(idx++ + 1);
+		for (b = 0; b < v->sample_bytes; b++, val >>= 8)
+			*dst++ = val;
+	}
+}
+
+static inline int verify_match(struct verify_state *v, const u_char *data,
+			       unsigned long long frame)
+{
+	verify_pattern(v, v->expect, frame, 1);
+	return memcmp(data, v->expect, v->frame_bytes) == 0;
+}
+
+static inline uint32_t verify_key(struct verify_state *v, const u_char *data)
+{
+	uint32_t key = 0;
+	unsigned int b;
+
+	for (b = 0; b < v->sample_bytes && b < 4; b++)
+		key |= (uint32_t)data[b] << (b * 8);
+	return key;
+}
+
+static int verify_key_cmp(const void *a, const void *b)
+{
+	const struct verify_key *k1 = a, *k2 = b;
+
+	if (k1->key != k2->key)
+		return k1->key < k2->key ? -1 : 1;
+	return k1->frame < k2->frame ? -1 : (k1->frame > k2->frame);
+}
+
+/* index the first frames of the pattern by their first sample */
+static int verify_index(struct verify_state *v)
+{
+	size_t i;
+
+	v->index_count = v->total;
+	if (v->index_count > (size_t)hwparams.rate * VERIFY_SEARCH_TIME)
+		v->index_count = (size_t)hwparams.rate * VERIFY_SEARCH_TIME;
+	v->index = malloc(v->index_count * sizeof(*v->index));
+	if (v->index == NULL)
+		return -ENOMEM;
+	v->key_mask = v->sample_bytes >= 4 ? 0xffffffffU :
+		      (1U << (v->sample_bytes * 8)) - 1;
+	for (i = 0; i < v->index_count; i++) {
+		v->index[i].key = verify_hash(i * hwparams.channels + 1) &
+				  v->key_mask;
+		v->index[i].frame = i;
+	}
+	qsort(v->index, v->index_count, sizeof(*v->index), verify_key_cmp);
+	return 0;
+}
+
+/* the earliest pattern frame equal to data, -1 if none */
+static long long verify_find(struct verify_state *v, const u_char *data)
+{
+	uint32_t key = verify_key(v, data);
+	size_t lo = 0, hi = v->index_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (v->index[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < v->index_count && v->index[lo].key == key; lo++)
+		if (verify_match(v, data, v->index[lo].frame))
+			return v->index[lo].frame;
+	return -1;
+}
+
+/*
+ * A path which is not bit exact matches no frame, after VERIFY_MAX_MISSES
+ * frames the search runs only every VERIFY_RETRY_INTERVAL frames so the
+ * capture keeps up with the playback.
+ */
+static inline int verify_search_skip(struct verify_state *v)
+{
+	return v->misses >= VERIFY_MAX_MISSES &&
+	       (v->misses - VERIFY_MAX_MISSES) % VERIFY_RETRY_INTERVAL != 0;
+}
+
+static void verify_frame(struct verify_state *v, const u_char *data)
+{
+	unsigned long long d;
+	long long frame;
+
+	v->position++;
+	if (!v->aligned) {
+		if (memcmp(data, v->silence, v->frame_bytes) == 0)
+			return;
+		v->corrupted++;
+		if (verify_search_skip(v)) {
+			v->misses++;
+			return;
+		}
+		/* look for the first captured frame in the pattern */
+		frame = verify_find(v, data);
+		if (frame < 0) {
+			v->misses++;
+			return;
+		}
+		v->corrupted--;
+		v->misses = 0;
+		v->aligned = 1;
+		v->latency = v->position - 1 - frame;
+		v->dropped += frame;
+		v->next = frame + 1;
+		v->verified++;
+		return;
+	}
+	if (v->next >= v->total)
+		return;		/* trailing data after the pattern */
+	if (verify_match(v, data, v->next)) {
+		v->next++;
+		v->verified++;
+		v->misses = 0;
+		return;
+	}
+	/* a playback underrun pauses the pattern, it does not skip it */
+	if (memcmp(data, v->silence, v->frame_bytes) == 0)
+		return;
+	if (verify_search_skip(v)) {
+		v->corrupted++;
+		v->misses++;
+		v->next++;
+		return;
+	}
+	for (d = 1; d <= VERIFY_RESYNC_WINDOW; d++) {
+		if (v->next + d < v->total && verify_match(v, data, v->next + d)) {
+			v->dropped += d;
+			v->next += d + 1;
+			v->verified++;
+			v->misses = 0;
+			return;
+		}
+		if (d <= v->next && verify_match(v, data, v->next - d)) {
+			v->duplicated += d;
+			v->next = v->next - d + 1;
+			v->verified++;
+			v->misses = 0;
+			return;
+		}
+	}
+	v->corrupted++;
+	v->misses++;
+	v->next++;
+}
+
+/* read everything available from the capture PCM, returns -EAGAIN when empty */
+static int verify_read(snd_pcm_t *chandle, struct verify_state *v, u_char *buf)
+{
+	snd_pcm_sframes_t r, i;
+	int err;
+
+	while (1) {
+		r = snd_pcm_readi(chandle, buf, chunk_size);
+		if (r == -EAGAIN)
+			return -EAGAIN;
+		if (r == -EPIPE) {
+			v->overruns++;
+			if (!quiet_mode)
+				fprintf(stderr, _("verify: capture overrun!!!\n"));
+			if ((err = snd_pcm_prepare(chandle)) < 0 ||
+			    (err = snd_pcm_start(chandle)) < 0) {
+				error(_("verify: capture restart error: %s"), snd_strerror(err));
+				return err;
+			}
+			continue;
+		}
+		if (r < 0) {
+			error(_("verify: read error: %s"), snd_strerror(r));
+			return r;
+		}
+		for (i = 0; i < r; i++)
+			verify_frame(v, buf + i * v->frame_bytes);
+		if (r == 0)
+			return -EAGAIN;
+	}
+}
+
+static int verify(void)
+{
+	struct verify_state v;
+	snd_pcm_t *chandle;
+	u_char *cbuf;
+	struct timeval t1, t2, diff;
+	double secs;
+	unsigned long long played = 0;
+	size_t frames;
+	int err, wait;
+
+	hwparams = rhwparams;
+	if (snd_pcm_format_width(hwparams.format) !=
+	    snd_pcm_format_physical_width(hwparams.format)) {
+		error(_("verify: format %s has padding bits, use a packed format"),
+		      snd_pcm_format_name(hwparams.format));
+		return -EINVAL;
+	}
+	err = snd_pcm_open(&chandle, verify_pcm_name, SND_PCM_STREAM_CAPTURE,
+			   open_mode | SND_PCM_NONBLOCK);
+	if (err < 0) {
+		error(_("verify: capture open error: %s"), snd_strerror(err));
+		return err;
+	}
+	set_params();
+	err = snd_pcm_set_params(chandle, hwparams.format,
+				 SND_PCM_ACCESS_RW_INTERLEAVED,
+				 hwparams.channels, hwparams.rate, 0,
+				 buffer_time > 0 ? buffer_time : 500000);
+	if (err < 0) {
+		error(_("verify: capture setup error: %s"), snd_strerror(err));
+		snd_pcm_close(chandle);
+		return err;
+	}
+	if (verbose)
+		snd_pcm_dump(chandle, log);
+
+	memset(&v, 0, sizeof(v));
+	v.sample_bytes = bits_per_sample / 8;
+	v.frame_bytes = bits_per_frame / 8;
+	v.total = (unsigned long long)hwparams.rate *
+		  (timelimit > 0 ? timelimit : VERIFY_DEFAULT_TIME);
+	v.latency = -1;
+	v.expect = malloc(v.frame_bytes);
+	v.silence = malloc(v.frame_bytes);
+	cbuf = malloc(chunk_bytes);
+	if (v.expect == NULL || v.silence == NULL || cbuf == NULL ||
+	    verify_index(&v) < 0) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	snd_pcm_format_set_silence(hwparams.format, v.silence, hwparams.channels);
+
+	if (!quiet_mode)
+		fprintf(stderr, _("Verifying %llu frames: '%s' -> '%s', %s, Rate %d Hz, Channels %i\n"),
+			v.total, snd_pcm_name(handle), snd_pcm_name(chandle),
+			snd_pcm_format_name(hwparams.format), hwparams.rate,
+			hwparams.channels);
+	if ((err = snd_pcm_start(chandle)) < 0) {
+		error(_("verify: capture start error: %s"), snd_strerror(err));
+		goto __end;
+	}
+	gettimeofday(&t1, NULL);
+	while (played < v.total) {
+		frames = chunk_size;
+		if (frames > v.total - played)
+			frames = v.total - played;
+		verify_pattern(&v, audiobuf, played, frames);
+		if ((size_t)pcm_write(audiobuf, frames) < frames)
+			break;
+		played += frames;
+		if ((err = verify_read(chandle, &v, cbuf)) != -EAGAIN)
+			goto __end;
+	}
+	snd_pcm_nonblock(handle, 0);
+	snd_pcm_drain(handle);
+	snd_pcm_nonblock(handle, nonblock);
+	/* collect the tail of the pattern, give up after one quiet second */
+	for (wait = 0; wait < 10 && v.next < v.total; wait++) {
+		if (snd_pcm_wait(chandle, 100) > 0)
+			wait = 0;
+		if ((err = verify_read(chandle, &v, cbuf)) != -EAGAIN)
+			goto __end;
+	}
+	gettimeofday(&t2, NULL);
+	err = 0;
+
+	timersub(&t2, &t1, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1000000.0;
+	if (v.aligned && v.next < v.total)
+		v.dropped += v.total - v.next;
+	fprintf(stderr, _("Verify: %llu frames verified, %llu dropped, %llu duplicated, %llu corrupted, %llu overruns\n"),
+		v.verified, v.dropped, v.duplicated, v.corrupted, v.overruns);
+	if (v.latency >= 0)
+		fprintf(stderr, _("Verify: latency %lli frames (%.3f ms)\n"),
+			v.latency, v.latency * 1000.0 / hwparams.rate);
+	else
+		fprintf(stderr, _("Verify: pattern not found in captured data\n"));
+	if (secs > 0)
+		fprintf(stderr, _("Verify: throughput %.1f frames/s (%.3f MB/s, %.3fx realtime)\n"),
+			v.position / secs,
+			v.position * v.frame_bytes / secs / 1000000.0,
+			v.position / secs / hwparams.rate);
+	if (!v.aligned || v.dropped || v.duplicated || v.corrupted || v.overruns)
+		err = -EIO;
+
+      __end:
+	snd_pcm_close(chandle);
+	free(cbuf);
+	free(v.expect);
+	free(v.silence);
+	free(v.index);
+	return err;
+}